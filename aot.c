@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+/* unix specific */
+#include <unistd.h>
+#include <sys/termios.h>
+
+#include "aot.h"
+
+/*
+    Runtime of the executables lc3-aot builds: the machine lc3 would run the program on,
+    the OS, the keyboard and display on the terminal and the timer, with the translated
+    code enabled. The program runs from its embedded image.
+*/
+
+struct termios original_tio;
+
+static void disable_input_buffering()
+{
+    tcgetattr(STDIN_FILENO, &original_tio);
+    struct termios new_tio = original_tio;
+    new_tio.c_lflag &= ~ICANON & ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
+
+static void restore_input_buffering()
+{
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
+
+static void handle_interrupt(int signal)
+{
+    restore_input_buffering();
+    printf("\n");
+    exit(-2);
+}
+
+int main(int argc, char **argv)
+{
+    lc3_vm *vm = lc3_create(NULL);
+    if (!vm || !lc3_attach_timer(vm))
+    {
+        printf("out of memory\n");
+        exit(1);
+    }
+    if (!lc3_load_image_data(vm, aot_image, aot_image_size))
+    {
+        printf("failed to load the embedded image\n");
+        exit(1);
+    }
+
+    /* The translation is only used on the code it was made from */
+    if (!lc3_enable_aot(vm, aot_run, aot_count, aot_addr, aot_word))
+        fprintf(stderr, "%s: memory differs from the translation, interpreting\n", argv[0]);
+
+    signal(SIGINT, handle_interrupt);
+    disable_input_buffering();
+    /* Output is flushed when the program polls the keyboard and when it halts */
+    setvbuf(stdout, NULL, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, BUFSIZ);
+
+    lc3_set_reg(vm, R_PC, PC_START);
+    lc3_run(vm);
+
+    restore_input_buffering();
+    lc3_destroy(vm);
+    return 0;
+}
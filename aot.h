@@ -0,0 +1,110 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "vm.h"
+
+/*
+    Support for the C that lc3-aot writes. Every translated instruction has a label L<addr>
+    and runs on a copy of R0-R7 and the condition codes kept in locals, so the compiler can
+    hold them in host registers. Control transfers to translated addresses are gotos,
+    indirect ones go through a switch over every translated address. Whatever the
+    translation leaves to the interpreter (device registers, stores into translated code,
+    native traps, RTI, addresses it never saw) returns the PC of that instruction, the
+    interpreter runs it and comes back at the next block the translation covers.
+*/
+
+/* What the generated file defines and the runtime in aot.c runs */
+extern const uint8_t aot_image[];
+extern const size_t aot_image_size;
+extern const size_t aot_count;
+extern const uint16_t aot_addr[];
+extern const uint16_t aot_word[];
+uint16_t aot_run(lc3_vm *vm, uint16_t pc);
+
+#define AOT_ENTER()                              \
+    uint16_t r[8];                               \
+    memcpy(r, vm->reg, sizeof(r));               \
+    int32_t cc = lazy_result(vm->reg[R_COND]);   \
+    int poll = vm->poll;                         \
+    uint16_t a = 0;                              \
+    (void)a
+
+/* Return to the interpreter at p */
+#define AOT_EXIT(p)                              \
+    do                                           \
+    {                                            \
+        memcpy(vm->reg, r, sizeof(r));           \
+        vm->reg[R_COND] = lazy_cond(cc);         \
+        vm->poll = poll;                         \
+        return (p);                              \
+    } while (0)
+
+#define AOT_SET(dr, v)                           \
+    do                                           \
+    {                                            \
+        r[dr] = (v);                             \
+        cc = (int16_t)r[dr];                     \
+    } while (0)
+
+#define AOT_COND() lazy_cond(cc)
+
+/* a = memory[addr], device registers are left to the interpreter at the instruction at p */
+#define AOT_READ(p, addr)                        \
+    do                                           \
+    {                                            \
+        a = (addr);                              \
+        if (a >= LC3_DEVICE_PAGE)                \
+            AOT_EXIT(p);                         \
+        a = vm->memory[a];                       \
+    } while (0)
+
+/* memory[addr] = val, so are device registers and translated code */
+#define AOT_WRITE(p, addr, val)                  \
+    do                                           \
+    {                                            \
+        a = (addr);                              \
+        if (a >= LC3_DEVICE_PAGE ||              \
+            vm->code_map[a])                     \
+            AOT_EXIT(p);                         \
+        vm->memory[a] = (val);                   \
+        if (vm->dcache[a].handler)               \
+            vm->dcache[a].handler = 0;           \
+    } while (0)
+
+/* Devices are polled every INTERRUPT_POLL control transfers, like in the interpreter */
+#define AOT_POLL(p)                              \
+    if (vm->armed && --poll < 0)                 \
+    AOT_EXIT(p)
+
+/* Control transfer to the translated instruction at x<hex> */
+#define AOT_GOTO(hex)                            \
+    do                                           \
+    {                                            \
+        AOT_POLL(0x##hex);                       \
+        goto L##hex;                             \
+    } while (0)
+
+/* Control transfer to a computed address */
+#define AOT_JUMP(target)                         \
+    do                                           \
+    {                                            \
+        pc = (target);                           \
+        AOT_POLL(pc);                            \
+        goto dispatch;                           \
+    } while (0)
+
+/* TRAP at p, emulated traps call the OS routine through the trap vector table */
+#define AOT_TRAP(p, vect, next)                  \
+    do                                           \
+    {                                            \
+        if (vm->trap_mode != LC3_TRAPS_EMULATED) \
+            AOT_EXIT(p);                         \
+        r[R_R7] = (next);                        \
+        AOT_JUMP(vm->memory[vect]);              \
+    } while (0)
+
+#endif
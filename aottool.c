@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "vm.h"
+
+/*
+    lc3-aot: translates an obj file ahead of time into C, printed on stdout. Compiled with
+    aot.o and liblc3.a it becomes a native executable that runs the program like lc3 does,
+    `make program.aot` does both steps. The code is found statically by following control
+    flow from the program's start, its origin and every entry of the trap and interrupt
+    vector tables, so the OS routines are translated as well. Whatever can't be found
+    that way (the targets of JMP, JSRR and RET are only known at run time) is still run,
+    by the interpreter the executable embeds.
+*/
+
+static const char *op_names[16] = {"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+                                   "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"};
+
+/* HALT does not return */
+#define TRAP_HALT 0x25
+
+static uint8_t code[MEMORY_MAX];
+static uint16_t work[MEMORY_MAX];
+static int work_count;
+
+static void usage()
+{
+    printf("lc3-aot image-file\n");
+    exit(2);
+}
+
+/* Queue addr to be translated. An all-zero word is taken for data, not a branch that never branches */
+static void reach(const lc3_vm *vm, uint16_t addr)
+{
+    if (addr >= LC3_DEVICE_PAGE || code[addr] || vm->memory[addr] == 0)
+        return;
+    code[addr] = 1;
+    work[work_count++] = addr;
+}
+
+static uint16_t branch_target(uint16_t addr, uint16_t instr, int bits)
+{
+    return addr + 1 + sign_extend(instr & ((1 << bits) - 1), bits);
+}
+
+/* Follow control flow from every address queued, marking each instruction reached in code */
+static void discover(const lc3_vm *vm)
+{
+    while (work_count > 0)
+    {
+        uint16_t addr = work[--work_count];
+        uint16_t instr = vm->memory[addr];
+        int falls_through = 1;
+
+        switch (instr >> 12)
+        {
+        case OP_BR:
+            if ((instr >> 9 & 0x7) != 0)
+                reach(vm, branch_target(addr, instr, 9));
+            falls_through = (instr >> 9 & 0x7) != 0x7;
+            break;
+        case OP_JSR:
+            if (instr & (1 << 11))
+                reach(vm, branch_target(addr, instr, 11));
+            break;
+        case OP_JMP:
+        case OP_RTI:
+            falls_through = 0;
+            break;
+        case OP_TRAP:
+            falls_through = (instr & 0xFF) != TRAP_HALT;
+            break;
+        }
+        if (falls_through)
+            reach(vm, addr + 1);
+    }
+}
+
+/* A transfer to target: a goto if it was translated, through the switch otherwise */
+static void print_transfer(uint16_t target)
+{
+    if (code[target])
+        printf("AOT_GOTO(%04X);", target);
+    else
+        printf("AOT_JUMP(0x%04X);", target);
+}
+
+static void print_imm(uint16_t imm)
+{
+    if (imm & 0x8000)
+        printf(" - %d", 0x10000 - imm);
+    else
+        printf(" + %d", imm);
+}
+
+/* The C statements of the instruction at addr. Returns 0 if control never goes on to addr + 1 */
+static int print_instr(const lc3_vm *vm, uint16_t addr)
+{
+    uint16_t instr = vm->memory[addr];
+    uint16_t next = addr + 1;
+    int dr = (instr >> 9) & 0x7;
+    int sr1 = (instr >> 6) & 0x7;
+    uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+    uint16_t offset6 = sign_extend(instr & 0x3F, 6);
+    uint16_t pc_offset9 = branch_target(addr, instr, 9);
+
+    printf("L%04X: /* %04X %s */\n    ", addr, instr, op_names[instr >> 12]);
+    switch (instr >> 12)
+    {
+    case OP_BR:
+        if (dr == 0x7)
+        {
+            print_transfer(pc_offset9);
+            printf("\n");
+            return 0;
+        }
+        if (dr)
+        {
+            printf("if (AOT_COND() & %d)\n        ", dr);
+            print_transfer(pc_offset9);
+        }
+        else
+            printf(";");
+        break;
+    case OP_ADD:
+    case OP_AND:
+        printf("AOT_SET(%d, r[%d]", dr, sr1);
+        if (!(instr & (1 << 5)))
+            printf(" %c r[%d]", instr >> 12 == OP_ADD ? '+' : '&', instr & 0x7);
+        else if (instr >> 12 == OP_ADD)
+            print_imm(imm5);
+        else
+            printf(" & 0x%04X", imm5);
+        printf(");");
+        break;
+    case OP_NOT:
+        printf("AOT_SET(%d, ~r[%d]);", dr, sr1);
+        break;
+    case OP_LEA:
+        printf("AOT_SET(%d, 0x%04X);", dr, pc_offset9);
+        break;
+    case OP_LD:
+        printf("AOT_READ(0x%04X, 0x%04X);\n    AOT_SET(%d, a);", addr, pc_offset9, dr);
+        break;
+    case OP_LDI:
+        printf("AOT_READ(0x%04X, 0x%04X);\n    AOT_READ(0x%04X, a);\n    AOT_SET(%d, a);", addr, pc_offset9, addr, dr);
+        break;
+    case OP_LDR:
+        printf("AOT_READ(0x%04X, r[%d]", addr, sr1);
+        print_imm(offset6);
+        printf(");\n    AOT_SET(%d, a);", dr);
+        break;
+    case OP_ST:
+        printf("AOT_WRITE(0x%04X, 0x%04X, r[%d]);", addr, pc_offset9, dr);
+        break;
+    case OP_STI:
+        printf("AOT_READ(0x%04X, 0x%04X);\n    AOT_WRITE(0x%04X, a, r[%d]);", addr, pc_offset9, addr, dr);
+        break;
+    case OP_STR:
+        printf("AOT_WRITE(0x%04X, r[%d]", addr, sr1);
+        print_imm(offset6);
+        printf(", r[%d]);", dr);
+        break;
+    case OP_JSR:
+        if (instr & (1 << 11))
+        {
+            printf("r[7] = 0x%04X;\n    ", next);
+            print_transfer(branch_target(addr, instr, 11));
+        }
+        else
+            printf("a = r[%d];\n    r[7] = 0x%04X;\n    AOT_JUMP(a);", sr1, next);
+        printf("\n");
+        return 0;
+    case OP_JMP:
+        printf("AOT_JUMP(r[%d]);\n", sr1);
+        return 0;
+    case OP_TRAP:
+        printf("AOT_TRAP(0x%04X, 0x%02X, 0x%04X);\n", addr, instr & 0xFF, next);
+        return 0;
+    case OP_RTI:
+        printf("AOT_EXIT(0x%04X);\n", addr);
+        return 0;
+    case OP_RESERVED:
+        printf(";");
+        break;
+    }
+    printf("\n");
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+        usage();
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in)
+    {
+        fprintf(stderr, "failed to open image: %s\n", argv[1]);
+        exit(1);
+    }
+    static uint8_t image[MEMORY_MAX * 2 + 2];
+    size_t size = fread(image, 1, sizeof(image), in);
+    fclose(in);
+
+    /* The machine the executable starts with: the OS and the program */
+    lc3_vm *vm = lc3_create(NULL);
+    if (!vm || !lc3_load_image_data(vm, image, size))
+    {
+        fprintf(stderr, "failed to load image: %s\n", argv[1]);
+        exit(1);
+    }
+
+    uint16_t origin = image[0] << 8 | image[1];
+    if (PC_START >= origin && PC_START < origin + (size - 2) / 2)
+        reach(vm, PC_START);
+    reach(vm, origin);
+    for (int vect = 0; vect < 0x200; vect++)
+    {
+        if (vm->memory[vect])
+            reach(vm, vm->memory[vect]);
+    }
+    discover(vm);
+
+    printf("/* Translated by lc3-aot from %s */\n\n#include \"aot.h\"\n\n", argv[1]);
+
+    printf("const uint8_t aot_image[] = {");
+    for (size_t i = 0; i < size; i++)
+        printf("%s0x%02X,", i % 16 ? " " : "\n    ", image[i]);
+    printf("\n};\nconst size_t aot_image_size = %zu;\n\n", size);
+
+    size_t count = 0;
+    printf("const uint16_t aot_addr[] = {");
+    for (int addr = 0; addr < MEMORY_MAX; addr++)
+    {
+        if (code[addr])
+            printf("%s0x%04X,", count++ % 12 ? " " : "\n    ", addr);
+    }
+    printf("\n};\nconst uint16_t aot_word[] = {");
+    count = 0;
+    for (int addr = 0; addr < MEMORY_MAX; addr++)
+    {
+        if (code[addr])
+            printf("%s0x%04X,", count++ % 12 ? " " : "\n    ", vm->memory[addr]);
+    }
+    printf("\n};\nconst size_t aot_count = %zu;\n\n", count);
+
+    printf("uint16_t aot_run(lc3_vm *vm, uint16_t pc)\n{\n    AOT_ENTER();\n    goto dispatch;\n\n");
+    printf("dispatch:\n    switch (pc)\n    {\n");
+    for (int addr = 0; addr < MEMORY_MAX; addr++)
+    {
+        if (code[addr])
+            printf("    case 0x%04X:\n        goto L%04X;\n", addr, addr);
+    }
+    printf("    default:\n        AOT_EXIT(pc);\n    }\n\n");
+
+    for (int addr = 0; addr < MEMORY_MAX; addr++)
+    {
+        if (!code[addr])
+            continue;
+        /* Falling through into something that was not translated */
+        if (print_instr(vm, addr) && !code[(uint16_t)(addr + 1)])
+            printf("    AOT_EXIT(0x%04X);\n", (uint16_t)(addr + 1));
+    }
+    printf("}\n");
+
+    lc3_destroy(vm);
+    return 0;
+}
@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+/* unix specific */
+#include <unistd.h>
+
+#include "lc3.h"
+#include "batch.h"
+
+/*
+    Headless batch runner. A manifest has one job per line:
+
+        <obj file> [<input file> [<expected output file> [<instruction budget>]]]
+
+    Fields are separated by blanks, "-" leaves a field out, lines starting with # are
+    comments. Jobs run on a pool of threads, each with its own VM whose console reads
+    the input file and collects the output in memory.
+*/
+
+/* Budget of jobs that don't give one */
+#define BATCH_DEFAULT_BUDGET 100000000UL
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef struct
+{
+    char *obj, *input, *expected;
+    unsigned long budget;
+
+    /* Result */
+    const char *exit_reason; /* "halt", "budget", "timeout" or an error */
+    int error;
+    unsigned long instructions;
+    uint64_t output_hash; /* FNV-1a of everything written to the console */
+    size_t output_size;
+    int match; /* -1 without expected output, else whether the output equals it */
+    double wall_ms;
+} batch_job;
+
+/* Console of a job: scripted keys in, output into a growing buffer */
+typedef struct
+{
+    const char *in;
+    size_t in_size, in_pos;
+    char *out;
+    size_t out_size, out_cap;
+} job_console;
+
+/* Input never blocks: at the end of the script read_key reports end of input */
+static int job_key_ready(void *ctx)
+{
+    return 1;
+}
+
+static int job_read_key(void *ctx)
+{
+    job_console *c = ctx;
+    return c->in_pos < c->in_size ? (unsigned char)c->in[c->in_pos++] : -1;
+}
+
+static void job_write_char(void *ctx, int ch)
+{
+    job_console *c = ctx;
+    if (c->out_size == c->out_cap)
+    {
+        c->out_cap = c->out_cap ? c->out_cap * 2 : 4096;
+        c->out = realloc(c->out, c->out_cap);
+    }
+    c->out[c->out_size++] = ch;
+}
+
+static void job_write(void *ctx, const char *s, size_t len)
+{
+    job_console *c = ctx;
+    if (c->out_size + len > c->out_cap)
+    {
+        while (c->out_size + len > c->out_cap)
+            c->out_cap = c->out_cap ? c->out_cap * 2 : 4096;
+        c->out = realloc(c->out, c->out_cap);
+    }
+    memcpy(c->out + c->out_size, s, len);
+    c->out_size += len;
+}
+
+static void job_flush(void *ctx)
+{
+}
+
+/* Whole file in a malloc'ed buffer, NULL if it can't be read */
+static char *read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    size_t cap = 4096, len = 0;
+    char *buf = malloc(cap);
+    size_t got;
+    while (buf && (got = fread(buf + len, 1, cap - len, f)) > 0)
+    {
+        len += got;
+        if (len == cap)
+            buf = realloc(buf, cap *= 2);
+    }
+    fclose(f);
+
+    *size = len;
+    return buf;
+}
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void run_job(batch_job *job, const batch_options *opt)
+{
+    double start = now_ms();
+    job_console con = {0};
+    lc3_io io = {&con, job_key_ready, job_read_key, job_write_char, job_flush, NULL, job_write};
+    job->match = -1;
+
+    if (job->input && !(con.in = read_file(job->input, &con.in_size)))
+    {
+        job->exit_reason = "input not readable";
+        job->error = 1;
+        return;
+    }
+
+    lc3_vm *vm = lc3_create(&io);
+    job->error = 1;
+    if (!vm)
+        job->exit_reason = "out of memory";
+    else if (opt->rom && !lc3_load_rom(vm, opt->rom))
+        job->exit_reason = "ROM not loadable";
+    else if (!lc3_load_image(vm, job->obj))
+        job->exit_reason = "image not loadable";
+    else
+    {
+        lc3_set_trap_mode(vm, opt->trap_mode);
+        lc3_set_reg(vm, R_PC, PC_START);
+
+        /* A runaway job is stopped within one basic block of its budget or its time */
+        lc3_set_limits(vm, job->budget, opt->timeout_ms);
+        lc3_run(vm);
+        job->instructions = lc3_retired(vm);
+        switch (lc3_stop_reason(vm))
+        {
+        case LC3_STOP_INSTRUCTIONS:
+            job->exit_reason = "budget";
+            break;
+        case LC3_STOP_TIMEOUT:
+            job->exit_reason = "timeout";
+            break;
+        default:
+            job->exit_reason = "halt";
+        }
+        job->error = 0;
+
+        uint64_t hash = FNV_OFFSET;
+        for (size_t i = 0; i < con.out_size; i++)
+            hash = (hash ^ (unsigned char)con.out[i]) * FNV_PRIME;
+        job->output_hash = hash;
+        job->output_size = con.out_size;
+
+        if (job->expected)
+        {
+            size_t size;
+            char *expected = read_file(job->expected, &size);
+            job->match = expected && size == con.out_size && memcmp(expected, con.out, size) == 0;
+            free(expected);
+        }
+    }
+
+    if (vm)
+        lc3_destroy(vm);
+    free((void *)con.in);
+    free(con.out);
+    job->wall_ms = now_ms() - start;
+}
+
+/*
+    Work stealing: every worker owns a range of job indices and takes jobs from its
+    front. A worker whose range is empty steals the back half of the largest range left.
+*/
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t next, end;
+} job_range;
+
+typedef struct
+{
+    batch_job *jobs;
+    job_range *ranges;
+    int workers;
+    const batch_options *opt;
+} batch_pool;
+
+typedef struct
+{
+    batch_pool *pool;
+    int id;
+} batch_worker;
+
+/* Next job of a range, or -1 if it is empty */
+static long take_job(job_range *r)
+{
+    long job = -1;
+    pthread_mutex_lock(&r->lock);
+    if (r->next < r->end)
+        job = r->next++;
+    pthread_mutex_unlock(&r->lock);
+    return job;
+}
+
+static size_t jobs_left(job_range *r)
+{
+    pthread_mutex_lock(&r->lock);
+    size_t left = r->end - r->next;
+    pthread_mutex_unlock(&r->lock);
+    return left;
+}
+
+/* Move jobs from another range into the empty own range. Returns 0 once no range has any left */
+static int steal_jobs(batch_pool *pool, job_range *own)
+{
+    for (;;)
+    {
+        job_range *victim = NULL;
+        size_t most = 0;
+        for (int i = 0; i < pool->workers; i++)
+        {
+            job_range *r = &pool->ranges[i];
+            size_t left = r != own ? jobs_left(r) : 0;
+            if (left > most)
+            {
+                most = left;
+                victim = r;
+            }
+        }
+
+        /* Ranges only shrink, so every job has been taken */
+        if (!victim)
+            return 0;
+
+        /* The victim may have run dry since, then look again */
+        pthread_mutex_lock(&victim->lock);
+        size_t end = victim->end;
+        size_t next = end - (end - victim->next + 1) / 2;
+        victim->end = next;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (next < end)
+        {
+            pthread_mutex_lock(&own->lock);
+            own->next = next;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+}
+
+static void *batch_work(void *arg)
+{
+    batch_worker *w = arg;
+    batch_pool *pool = w->pool;
+    job_range *own = &pool->ranges[w->id];
+
+    for (;;)
+    {
+        long job = take_job(own);
+        if (job < 0)
+        {
+            if (!steal_jobs(pool, own))
+                return NULL;
+            continue;
+        }
+        run_job(&pool->jobs[job], pool->opt);
+    }
+}
+
+static void print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+static void print_result(const batch_job *job)
+{
+    printf("{\"obj\": ");
+    print_json_string(job->obj);
+    printf(", \"exit\": ");
+    print_json_string(job->exit_reason);
+    printf(", \"instructions\": %lu, \"output_bytes\": %zu, \"output_hash\": \"%016llx\", ",
+           job->instructions, job->output_size, (unsigned long long)job->output_hash);
+    if (job->match >= 0)
+        printf("\"match\": %s, ", job->match ? "true" : "false");
+    printf("\"wall_ms\": %.3f}\n", job->wall_ms);
+}
+
+/* Field of a manifest line, NULL if it is missing or "-" */
+static char *next_field(char **line)
+{
+    char *field = strtok_r(NULL, " \t\r\n", line);
+    if (field && strcmp(field, "-") == 0)
+        return NULL;
+    return field ? strdup(field) : NULL;
+}
+
+int run_batch(const char *manifest, const batch_options *opt)
+{
+    FILE *f = fopen(manifest, "r");
+    if (!f)
+    {
+        printf("failed to read manifest: %s\n", manifest);
+        return 2;
+    }
+
+    batch_job *jobs = NULL;
+    size_t count = 0, cap = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), f))
+    {
+        char *save;
+        char *obj = strtok_r(line, " \t\r\n", &save);
+        if (!obj || obj[0] == '#')
+            continue;
+
+        if (count == cap)
+            jobs = realloc(jobs, (cap = cap ? cap * 2 : 64) * sizeof(batch_job));
+
+        batch_job *job = &jobs[count++];
+        memset(job, 0, sizeof(*job));
+        job->obj = strdup(obj);
+        job->input = next_field(&save);
+        job->expected = next_field(&save);
+        char *budget = next_field(&save);
+        job->budget = budget ? strtoul(budget, NULL, 0) : BATCH_DEFAULT_BUDGET;
+        free(budget);
+    }
+    fclose(f);
+
+    int workers = opt->workers > 0 ? opt->workers : sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1)
+        workers = 1;
+    if ((size_t)workers > count)
+        workers = count ? count : 1;
+
+    /* Deal the jobs out in equal ranges */
+    batch_pool pool = {jobs, calloc(workers, sizeof(job_range)), workers, opt};
+    batch_worker *w = calloc(workers, sizeof(batch_worker));
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    for (int i = 0; i < workers; i++)
+    {
+        pthread_mutex_init(&pool.ranges[i].lock, NULL);
+        pool.ranges[i].next = count * i / workers;
+        pool.ranges[i].end = count * (i + 1) / workers;
+        w[i] = (batch_worker){&pool, i};
+    }
+    for (int i = 1; i < workers; i++)
+        pthread_create(&threads[i], NULL, batch_work, &w[i]);
+    batch_work(&w[0]);
+    for (int i = 1; i < workers; i++)
+        pthread_join(threads[i], NULL);
+
+    int status = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        print_result(&jobs[i]);
+        status |= jobs[i].error || jobs[i].match == 0;
+        free(jobs[i].obj);
+        free(jobs[i].input);
+        free(jobs[i].expected);
+    }
+
+    free(threads);
+    free(w);
+    free(pool.ranges);
+    free(jobs);
+    return status;
+}
@@ -0,0 +1,20 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/* Settings every job of a batch shares */
+typedef struct
+{
+    int trap_mode;            /* an lc3_trap_mode */
+    int workers;              /* threads to run jobs on, 0 for one per online CPU */
+    const char *rom;          /* boot ROM image, NULL for the built-in OS */
+    unsigned long timeout_ms; /* wall-clock limit of each job, 0 for none */
+} batch_options;
+
+/*
+    Run every job of a manifest and write one JSON result per job to stdout, in manifest
+    order. Returns the process exit status: 0 if every job ran and those with an expected
+    output produced it, 1 otherwise, 2 if the manifest could not be read.
+*/
+int run_batch(const char *manifest, const batch_options *opt);
+
+#endif
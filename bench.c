@@ -0,0 +1,469 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "lc3.h"
+
+/*
+    Benchmark suite. Runs the sample programs with scripted input and synthetic loops
+    that exercise one class of instructions each, several times, and writes one JSON
+    line per benchmark and execution mode to stdout (a readable table goes to stderr).
+    `lc3-bench --compare old.jsonl new.jsonl` compares two such result files.
+*/
+
+#define DEFAULT_REPS 5
+
+/* Words of memory per host page, restarting touches one word of each */
+#define PAGE_WORDS 2048
+
+/* Iterations of the outer loop of a microbenchmark, the inner one runs MICRO_INNER times */
+#define MICRO_OUTER 100
+#define MICRO_INNER 1000
+
+/* Copies of the body in one inner loop iteration */
+#define MICRO_UNROLL 8
+
+enum bench_mode
+{
+    MODE_INTERP,
+    MODE_JIT,
+    MODE_NATIVE_TRAPS,
+    MODE_JIT_NATIVE_TRAPS,
+    MODE_COUNT,
+};
+
+static const char *mode_names[] = {"interp", "jit", "native-traps", "jit-native-traps"};
+
+typedef struct
+{
+    const char *name;
+    const char *obj;
+    const char *input;         /* keys, repeated for as long as the program reads */
+    unsigned long instructions; /* budget, the same in every mode */
+} program_bench;
+
+/*
+    A program is restarted whenever it halts until it has run its budget. hello-world and
+    hangman halt after a few dozen and a few thousand instructions, and restarting takes
+    far longer than running them, so their budgets are smaller
+*/
+static const program_bench programs[] = {
+    {"hello-world", "lc3-sample-obj/hello-world.obj", "", 20000},
+    {"hangman", "lc3-sample-obj/hangman.obj", "hello\nhxelo", 2000000},
+    {"gol", "lc3-sample-obj/gol.obj", "a", 20000000},
+    {"2048", "lc3-sample-obj/2048.obj", "wasd", 20000000},
+};
+
+/*
+    Microbenchmarks: the body runs MICRO_UNROLL times per inner loop iteration. Bodies may
+    use R0-R3; R5 points at a few data words. PC-relative operands are placeholders (TRAP
+    vectors the bodies never use otherwise) resolved when the program is assembled.
+*/
+#define MAX_BODY 8
+
+#define BODY_LD(r) (0xFFE0 | (r))  /* LD r, 'x' */
+#define BODY_LDI(r) (0xFFE8 | (r)) /* LDI r, pointer to the data words */
+#define BODY_JSR 0xFFF0            /* JSR to a subroutine that is just RET */
+
+typedef struct
+{
+    const char *name;
+    uint16_t body[MAX_BODY];
+    int len;
+    int modes; /* bit per bench_mode */
+} micro_bench;
+
+#define ALL_MODES ((1 << MODE_INTERP) | (1 << MODE_JIT))
+#define TRAP_MODES ((1 << MODE_NATIVE_TRAPS) | (1 << MODE_JIT_NATIVE_TRAPS))
+
+static const micro_bench micros[] = {
+    /* ADD R0,R0,#1; AND R1,R0,R3; NOT R2,R1; ADD R3,R1,R2 */
+    {"alu", {0x1021, 0x5203, 0x947F, 0x1642}, 4, ALL_MODES},
+    /* LD R0; LDI R1; LDR R2,R5,#1; ADD R3,R0,R2 */
+    {"load", {BODY_LD(0), BODY_LDI(1), 0x6541, 0x1602}, 4, ALL_MODES},
+    /* STR R0,R5,#3; STR R1,R5,#4; LDR R2,R5,#3 */
+    {"store", {0x7143, 0x7344, 0x6543}, 3, ALL_MODES},
+    /* ADD R0,R0,#0 (P); BRp +0 (taken); BRn +0 (not taken); BRnzp +0 */
+    {"branch", {0x1020, 0x0200, 0x0800, 0x0E00}, 4, ALL_MODES},
+    /* JSR; RET */
+    {"jsr-ret", {BODY_JSR}, 1, ALL_MODES},
+    /* LD R0; TRAP x21 (OUT) */
+    {"trap-out", {BODY_LD(0), 0xF021}, 2, ALL_MODES | TRAP_MODES},
+};
+
+/* Console of a benchmark run: scripted keys in, output thrown away */
+typedef struct
+{
+    const char *keys;
+    size_t len, pos;
+} bench_console;
+
+static int bench_key_ready(void *ctx)
+{
+    return 1;
+}
+
+static int bench_read_key(void *ctx)
+{
+    bench_console *c = ctx;
+    if (!c->len)
+        return -1;
+    return (unsigned char)c->keys[c->pos++ % c->len];
+}
+
+static void bench_write_char(void *ctx, int ch)
+{
+}
+
+static void bench_write(void *ctx, const char *s, size_t len)
+{
+}
+
+static void bench_flush(void *ctx)
+{
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* PC-relative field of an instruction at address `at` referring to `target` */
+static uint16_t offset(int at, int target, int bits)
+{
+    return (target - (at + 1)) & ((1 << bits) - 1);
+}
+
+/* Assemble the loop around a microbenchmark body, returns the size of the object file */
+static size_t build_micro(const micro_bench *m, uint8_t *image)
+{
+    /*
+        x3000   LEA R5, data
+                LD  R4, outer
+        loop:   LD  R6, inner
+        body:   body * MICRO_UNROLL
+                ADD R6, R6, #-1
+                BRp body
+                ADD R4, R4, #-1
+                BRp loop
+                HALT
+        sub:    RET
+        outer:  .FILL MICRO_OUTER
+        inner:  .FILL MICRO_INNER
+        char:   .FILL 'x'
+        ptr:    .FILL data
+        data:   .FILL 1, 2, 3, 0, 0
+    */
+    uint16_t words[MAX_BODY * MICRO_UNROLL + 32];
+    int n = 0;
+    int lea = n++;
+    int ld_outer = n++;
+    int loop = n++;
+    int body = n;
+    n += m->len * MICRO_UNROLL;
+    words[n++] = 0x1DBF; /* ADD R6, R6, #-1 */
+    words[n] = 0x0200 | offset(n, body, 9);
+    n++;
+    words[n++] = 0x193F; /* ADD R4, R4, #-1 */
+    words[n] = 0x0200 | offset(n, loop, 9);
+    n++;
+    words[n++] = 0xF025; /* HALT */
+    int sub = n;
+    words[n++] = 0xC1C0; /* RET */
+    int outer = n;
+    words[n++] = MICRO_OUTER;
+    int inner = n;
+    words[n++] = MICRO_INNER;
+    int chr = n;
+    words[n++] = 'x';
+    int ptr = n;
+    int data = n + 1;
+    words[n++] = PC_START + data;
+    words[n++] = 1;
+    words[n++] = 2;
+    words[n++] = 3;
+    words[n++] = 0;
+    words[n++] = 0;
+
+    words[lea] = 0xEA00 | offset(lea, data, 9);
+    words[ld_outer] = 0x2800 | offset(ld_outer, outer, 9);
+    words[loop] = 0x2C00 | offset(loop, inner, 9);
+    for (int i = 0; i < m->len * MICRO_UNROLL; i++)
+    {
+        int at = body + i;
+        uint16_t w = m->body[i % m->len];
+        if (w == BODY_JSR)
+            w = 0x4800 | offset(at, sub, 11);
+        else if ((w & 0xFFF8) == BODY_LD(0))
+            w = 0x2000 | (w & 7) << 9 | offset(at, chr, 9);
+        else if ((w & 0xFFF8) == BODY_LDI(0))
+            w = 0xA000 | (w & 7) << 9 | offset(at, ptr, 9);
+        words[at] = w;
+    }
+
+    /* Object file: big-endian origin, then the words */
+    image[0] = PC_START >> 8;
+    image[1] = PC_START & 0xFF;
+    for (int i = 0; i < n; i++)
+    {
+        image[2 + 2 * i] = words[i] >> 8;
+        image[3 + 2 * i] = words[i] & 0xFF;
+    }
+    return 2 + 2 * n;
+}
+
+typedef struct
+{
+    unsigned long instructions;
+    double ns[64];
+    int reps;
+} bench_result;
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *group, const char *name, int mode, bench_result *r)
+{
+    double mean = 0, var = 0;
+    for (int i = 0; i < r->reps; i++)
+        mean += r->ns[i];
+    mean /= r->reps;
+    for (int i = 0; i < r->reps; i++)
+        var += (r->ns[i] - mean) * (r->ns[i] - mean);
+    double stddev_pct = r->reps > 1 ? sqrt(var / (r->reps - 1)) / mean * 100 : 0;
+
+    qsort(r->ns, r->reps, sizeof(double), compare_double);
+    double median = r->reps % 2 ? r->ns[r->reps / 2] : (r->ns[r->reps / 2 - 1] + r->ns[r->reps / 2]) / 2;
+    double ns_per_instr = median / r->instructions;
+
+    printf("{\"bench\": \"%s/%s\", \"mode\": \"%s\", \"instructions\": %lu, \"reps\": %d, "
+           "\"median_ms\": %.3f, \"mips\": %.1f, \"ns_per_instr\": %.3f, \"stddev_pct\": %.2f}\n",
+           group, name, mode_names[mode], r->instructions, r->reps,
+           median / 1e6, 1e3 / ns_per_instr, ns_per_instr, stddev_pct);
+    fprintf(stderr, "%-8s %-12s %-16s %8.1f MIPS %8.3f ns/instr  +-%5.2f%%\n",
+            group, name, mode_names[mode], 1e3 / ns_per_instr, ns_per_instr, stddev_pct);
+    fflush(stdout);
+}
+
+static lc3_vm *bench_vm(bench_console *con, int mode)
+{
+    lc3_io io = {con, bench_key_ready, bench_read_key, bench_write_char, bench_flush, NULL, bench_write};
+    lc3_vm *vm = lc3_create(&io);
+    if (!vm)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    if ((mode == MODE_JIT || mode == MODE_JIT_NATIVE_TRAPS) && !lc3_enable_jit(vm))
+    {
+        lc3_destroy(vm);
+        return NULL;
+    }
+    if (mode == MODE_NATIVE_TRAPS || mode == MODE_JIT_NATIVE_TRAPS)
+        lc3_set_trap_mode(vm, LC3_TRAPS_NATIVE);
+    return vm;
+}
+
+/*
+    Start a program over from the snapshot of it. The snapshot is mapped copy-on-write,
+    storing to every page here keeps the page faults out of the timed runs
+*/
+static void restart(lc3_vm *vm, const lc3_snapshot *start, bench_console *con)
+{
+    con->pos = 0;
+    lc3_restore(vm, start);
+    for (int addr = 0; addr < LC3_DEVICE_PAGE; addr += PAGE_WORDS)
+        lc3_write(vm, addr, lc3_peek(vm, addr));
+}
+
+/*
+    Run a program for its instruction budget with limited lc3_runs, restarting it when it
+    halts. Only lc3_run is timed, restarting is not.
+*/
+static int run_program(const program_bench *p, int mode, bench_result *r)
+{
+    bench_console con = {p->input, strlen(p->input), 0};
+    lc3_vm *vm = bench_vm(&con, mode);
+    if (!vm)
+        return 0;
+    if (!lc3_load_image(vm, p->obj))
+    {
+        fprintf(stderr, "program  %-12s could not be loaded\n", p->name);
+        lc3_destroy(vm);
+        return 0;
+    }
+    lc3_set_reg(vm, R_PC, PC_START);
+    lc3_snapshot *start = lc3_snapshot_take(vm);
+    if (!start)
+    {
+        lc3_destroy(vm);
+        return 0;
+    }
+
+    for (int rep = 0; rep < r->reps; rep++)
+    {
+        unsigned long done = 0;
+        double ns = 0;
+        restart(vm, start, &con);
+        while (done < p->instructions)
+        {
+            unsigned long before = lc3_retired(vm);
+            lc3_set_limits(vm, p->instructions - done, 0);
+            double t = now_ns();
+            lc3_run(vm);
+            ns += now_ns() - t;
+            done += lc3_retired(vm) - before;
+            if (lc3_retired(vm) == before)
+                break;
+            if (!lc3_running(vm))
+                restart(vm, start, &con);
+        }
+        r->ns[rep] = ns;
+        r->instructions = done;
+    }
+    lc3_snapshot_close(start);
+    lc3_destroy(vm);
+    return 1;
+}
+
+/* Run a microbenchmark to completion with lc3_run, its instruction count comes from a stepped run */
+static int run_micro(const micro_bench *m, int mode, bench_result *r)
+{
+    uint8_t image[2 * (MAX_BODY * MICRO_UNROLL + 32) + 2];
+    size_t size = build_micro(m, image);
+    bench_console con = {"", 0, 0};
+
+    lc3_vm *vm = bench_vm(&con, mode == MODE_INTERP || mode == MODE_JIT ? MODE_INTERP : MODE_NATIVE_TRAPS);
+    lc3_load_image_data(vm, image, size);
+    while (lc3_step(vm, ~0UL >> 1))
+        ;
+    r->instructions = lc3_retired(vm);
+    lc3_destroy(vm);
+
+    for (int rep = 0; rep < r->reps; rep++)
+    {
+        vm = bench_vm(&con, mode);
+        if (!vm)
+            return 0;
+        lc3_load_image_data(vm, image, size);
+        double start = now_ns();
+        lc3_run(vm);
+        r->ns[rep] = now_ns() - start;
+        lc3_destroy(vm);
+    }
+    return 1;
+}
+
+/* Value of a number field of a result line, NAN if it is missing */
+static double field(const char *line, const char *name)
+{
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\": ", name);
+    const char *p = strstr(line, key);
+    return p ? strtod(p + strlen(key), NULL) : NAN;
+}
+
+/* "bench mode" of a result line, used to match lines of two result files */
+static void bench_key(const char *line, char *key, size_t size)
+{
+    char bench[64] = "", mode[32] = "";
+    const char *p = strstr(line, "\"bench\": \"");
+    const char *q = strstr(line, "\"mode\": \"");
+    if (p)
+        sscanf(p + 10, "%63[^\"]", bench);
+    if (q)
+        sscanf(q + 9, "%31[^\"]", mode);
+    snprintf(key, size, "%s %s", bench, mode);
+}
+
+static int compare(const char *old_path, const char *new_path)
+{
+    FILE *old = fopen(old_path, "r");
+    FILE *new = fopen(new_path, "r");
+    if (!old || !new)
+    {
+        fprintf(stderr, "failed to read results\n");
+        return 2;
+    }
+
+    char line[512], old_line[512], key[128], old_key[128];
+    printf("%-36s %10s %10s %8s\n", "benchmark", "old ns", "new ns", "change");
+    while (fgets(line, sizeof(line), new))
+    {
+        bench_key(line, key, sizeof(key));
+        rewind(old);
+        while (fgets(old_line, sizeof(old_line), old))
+        {
+            bench_key(old_line, old_key, sizeof(old_key));
+            if (strcmp(key, old_key) != 0)
+                continue;
+            double a = field(old_line, "ns_per_instr"), b = field(line, "ns_per_instr");
+            printf("%-36s %10.3f %10.3f %+7.1f%%\n", key, a, b, (b - a) / a * 100);
+            break;
+        }
+    }
+    fclose(old);
+    fclose(new);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int reps = DEFAULT_REPS;
+    const char *only = NULL;
+
+    for (int j = 1; j < argc; ++j)
+    {
+        if (strcmp(argv[j], "--compare") == 0 && j + 2 < argc)
+            return compare(argv[j + 1], argv[j + 2]);
+        if (strcmp(argv[j], "--reps") == 0 && j + 1 < argc)
+        {
+            reps = atoi(argv[++j]);
+            if (reps < 1 || reps > 64)
+                reps = DEFAULT_REPS;
+            continue;
+        }
+        if (strcmp(argv[j], "--only") == 0 && j + 1 < argc)
+        {
+            only = argv[++j];
+            continue;
+        }
+        printf("lc3-bench [--reps n] [--only name] | --compare old.jsonl new.jsonl\n");
+        return 2;
+    }
+
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++)
+    {
+        if (only && !strstr(programs[i].name, only))
+            continue;
+        for (int mode = MODE_INTERP; mode < MODE_COUNT; mode++)
+        {
+            bench_result r = {0, {0}, reps};
+            if (run_program(&programs[i], mode, &r))
+                report("program", programs[i].name, mode, &r);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(micros) / sizeof(micros[0]); i++)
+    {
+        if (only && !strstr(micros[i].name, only))
+            continue;
+        for (int mode = MODE_INTERP; mode < MODE_COUNT; mode++)
+        {
+            if (!(micros[i].modes & (1 << mode)))
+                continue;
+            bench_result r = {0, {0}, reps};
+            if (run_micro(&micros[i], mode, &r))
+                report("micro", micros[i].name, mode, &r);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+/* unix specific */
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/termios.h>
+
+/*
+    lc3-client: a terminal for `lc3 --serve`. Keys typed go to the session, its output
+    comes back to stdout, and the client exits when the program halts. With --sessions n
+    it is a load generator instead: it opens n sessions at once, sends each all of stdin,
+    discards their output and reports how long they took.
+*/
+
+static struct termios original_tio;
+static int raw_terminal;
+
+static void usage()
+{
+    printf("lc3-client socket [--sessions n]\n");
+    exit(2);
+}
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int connect_to(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* Relay stdin to the session and the session to stdout until the session ends */
+static int run_terminal(const char *path)
+{
+    int fd = connect_to(path);
+    if (fd < 0)
+    {
+        fprintf(stderr, "failed to connect to %s\n", path);
+        return 1;
+    }
+
+    if (isatty(STDIN_FILENO))
+    {
+        tcgetattr(STDIN_FILENO, &original_tio);
+        struct termios new_tio = original_tio;
+        new_tio.c_lflag &= ~ICANON & ~ECHO;
+        tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+        raw_terminal = 1;
+    }
+
+    struct pollfd fds[2] = {{fd, POLLIN}, {STDIN_FILENO, POLLIN}};
+    int nfds = 2;
+    char buf[4096];
+    for (;;)
+    {
+        if (poll(fds, nfds, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[0].revents)
+        {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0 || !write_all(STDOUT_FILENO, buf, n))
+                break;
+        }
+        if (nfds > 1 && fds[1].revents)
+        {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            /* At the end of stdin keep showing output until the program halts */
+            if (n <= 0)
+                nfds = 1;
+            else if (!write_all(fd, buf, n))
+                break;
+        }
+    }
+
+    if (raw_terminal)
+        tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    close(fd);
+    return 0;
+}
+
+/* Open count sessions, feed each the script and wait for all of them to end */
+static int run_load(const char *path, int count)
+{
+    size_t len = 0, cap = 4096;
+    char *script = malloc(cap);
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, script + len, cap - len)) > 0)
+    {
+        len += n;
+        if (len == cap)
+            script = realloc(script, cap *= 2);
+    }
+
+    /* Every session is a socket */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)count + 16)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct pollfd *fds = calloc(count, sizeof(struct pollfd));
+    size_t *sent = calloc(count, sizeof(size_t));
+    double start = now_ms();
+    for (int i = 0; i < count; i++)
+    {
+        fds[i].fd = connect_to(path);
+        if (fds[i].fd < 0)
+        {
+            fprintf(stderr, "failed to open session %d\n", i);
+            return 1;
+        }
+        fds[i].events = POLLIN | (len ? POLLOUT : 0);
+    }
+
+    int open = count;
+    unsigned long long received = 0;
+    char buf[65536];
+    while (open > 0)
+    {
+        if (poll(fds, count, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (fds[i].revents & POLLOUT)
+            {
+                ssize_t n = write(fds[i].fd, script + sent[i], len - sent[i]);
+                if (n > 0)
+                    sent[i] += n;
+                if (n < 0 || sent[i] == len)
+                    fds[i].events = POLLIN;
+            }
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+                if (n > 0)
+                    received += n;
+                else
+                {
+                    close(fds[i].fd);
+                    fds[i].fd = -1;
+                    open--;
+                }
+            }
+        }
+    }
+
+    double ms = now_ms() - start;
+    fprintf(stderr, "%d sessions, %llu bytes of output in %.1f ms, %.2f ms per session\n",
+            count, received, ms, ms / count);
+    free(sent);
+    free(fds);
+    free(script);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = NULL;
+    int sessions = 0;
+    for (int j = 1; j < argc; j++)
+    {
+        if (strcmp(argv[j], "--sessions") == 0 && j + 1 < argc)
+            sessions = atoi(argv[++j]);
+        else if (!path)
+            path = argv[j];
+        else
+            usage();
+    }
+    if (!path)
+        usage();
+
+    return sessions > 0 ? run_load(path, sessions) : run_terminal(path);
+}
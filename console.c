@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+/* unix specific */
+#include <unistd.h>
+
+#include "console.h"
+
+/* Keys read ahead of the program, must be a power of 2 */
+#define KEY_RING_SIZE (64 * 1024)
+
+/*
+    Keyboard input. A reader thread blocks in read(2) on stdin and fills a single-producer,
+    single-consumer ring, so polling the keyboard status register is a load instead of a
+    syscall. head only moves on the reader thread, tail only on the thread running the VM.
+    The lock and condition variable are only used when one side has to wait for the other.
+*/
+static struct
+{
+    uint8_t buf[KEY_RING_SIZE];
+    _Atomic size_t head; /* next slot the reader fills */
+    _Atomic size_t tail; /* next slot the VM takes */
+    atomic_int eof;      /* stdin is exhausted, set after the last key was added */
+
+    pthread_once_t started;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; /* a key was added or taken, or input ended */
+} keys = {.started = PTHREAD_ONCE_INIT, .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER};
+
+static void keys_changed()
+{
+    pthread_mutex_lock(&keys.lock);
+    pthread_cond_broadcast(&keys.changed);
+    pthread_mutex_unlock(&keys.lock);
+}
+
+static void *key_reader(void *arg)
+{
+    for (;;)
+    {
+        size_t head = atomic_load_explicit(&keys.head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&keys.tail, memory_order_acquire);
+
+        if (head - tail == KEY_RING_SIZE)
+        {
+            /* Full: wait for the program to catch up */
+            pthread_mutex_lock(&keys.lock);
+            while (head - atomic_load(&keys.tail) == KEY_RING_SIZE)
+                pthread_cond_wait(&keys.changed, &keys.lock);
+            pthread_mutex_unlock(&keys.lock);
+            continue;
+        }
+
+        /* Read as much as fits without wrapping around */
+        size_t off = head & (KEY_RING_SIZE - 1);
+        size_t space = KEY_RING_SIZE - (head - tail);
+        if (space > KEY_RING_SIZE - off)
+            space = KEY_RING_SIZE - off;
+
+        ssize_t got = read(STDIN_FILENO, keys.buf + off, space);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+        {
+            atomic_store_explicit(&keys.eof, 1, memory_order_release);
+            keys_changed();
+            return NULL;
+        }
+
+        atomic_store(&keys.head, head + got);
+        keys_changed();
+    }
+}
+
+static void start_key_reader()
+{
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, key_reader, NULL) != 0)
+    {
+        /* Without a reader there is no input */
+        atomic_store(&keys.eof, 1);
+        return;
+    }
+    pthread_detach(reader);
+}
+
+/* UNIX specific keyboard check */
+static int stdio_key_ready(void *ctx)
+{
+    pthread_once(&keys.started, start_key_reader);
+
+    /* At the end of input read_key returns -1 right away */
+    size_t tail = atomic_load_explicit(&keys.tail, memory_order_relaxed);
+    return atomic_load_explicit(&keys.head, memory_order_acquire) != tail ||
+           atomic_load_explicit(&keys.eof, memory_order_acquire);
+}
+
+static int stdio_read_key(void *ctx)
+{
+    pthread_once(&keys.started, start_key_reader);
+
+    size_t tail = atomic_load_explicit(&keys.tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&keys.head, memory_order_acquire);
+
+    if (head == tail)
+    {
+        /* Nothing typed yet, block until the reader adds a key */
+        pthread_mutex_lock(&keys.lock);
+        for (;;)
+        {
+            /* eof is published after the last key, so head has to be checked again after it */
+            int eof = atomic_load_explicit(&keys.eof, memory_order_acquire);
+            head = atomic_load_explicit(&keys.head, memory_order_acquire);
+            if (head != tail || eof)
+                break;
+            pthread_cond_wait(&keys.changed, &keys.lock);
+        }
+        pthread_mutex_unlock(&keys.lock);
+        if (head == tail)
+            return -1;
+    }
+
+    int c = keys.buf[tail & (KEY_RING_SIZE - 1)];
+    atomic_store(&keys.tail, tail + 1);
+
+    /*
+        The reader may be waiting for room. Either it sees the new tail, or this sees the
+        head that filled the ring (both sides store then load sequentially consistent).
+    */
+    if (atomic_load(&keys.head) - tail == KEY_RING_SIZE)
+        keys_changed();
+    return c;
+}
+
+static int stdio_wait_key(void *ctx, long timeout_ms)
+{
+    pthread_once(&keys.started, start_key_reader);
+
+    struct timespec deadline;
+    if (timeout_ms >= 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&keys.lock);
+    while (!stdio_key_ready(ctx))
+    {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&keys.changed, &keys.lock);
+        else if (pthread_cond_timedwait(&keys.changed, &keys.lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&keys.lock);
+
+    return stdio_key_ready(ctx);
+}
+
+static void stdio_write_char(void *ctx, int c)
+{
+    putc(c, stdout);
+}
+
+static void stdio_write(void *ctx, const char *s, size_t len)
+{
+    fwrite(s, 1, len, stdout);
+}
+
+static void stdio_flush(void *ctx)
+{
+    fflush(stdout);
+}
+
+const lc3_io stdio_io = {NULL, stdio_key_ready, stdio_read_key, stdio_write_char, stdio_flush, stdio_wait_key,
+                         stdio_write};
@@ -0,0 +1,12 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "lc3.h"
+
+/*
+    The process console: keys come from stdin through a reader thread, characters go to
+    stdout. Used by VMs created without their own I/O callbacks.
+*/
+extern const lc3_io stdio_io;
+
+#endif
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+/* unix specific */
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "lc3.h"
+
+/*
+    Devices beyond the console. They only use the public device interface: each keeps
+    its registers itself and touches memory through lc3_read and lc3_write.
+*/
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+typedef struct
+{
+    uint16_t status;   /* MR_TMSR as written, bit 15 is worked out when it is read */
+    uint16_t interval; /* milliseconds between ticks, 0 while stopped */
+    int ticked;        /* a tick was noticed and MR_TMSR not read since */
+    uint64_t due;      /* when the next tick is */
+} timer;
+
+/* Notice a tick that is due, the next interval counts from now. Recorded input logs it */
+static int timer_ticked(timer *t, lc3_vm *vm)
+{
+    if (t->interval && !t->ticked)
+    {
+        uint64_t now = now_ms();
+        if (lc3_device_event(vm, now >= t->due))
+        {
+            t->ticked = 1;
+            t->due = now + t->interval;
+        }
+    }
+    return t->ticked;
+}
+
+static uint16_t timer_read(void *ctx, lc3_vm *vm, uint16_t addr)
+{
+    timer *t = ctx;
+    if (addr == MR_TMIR)
+        return t->interval;
+    if (addr != MR_TMSR)
+        return 0;
+
+    uint16_t ready = timer_ticked(t, vm) << 15;
+    t->ticked = 0;
+    return (t->status & 0x7FFF) | ready;
+}
+
+static void timer_write(void *ctx, lc3_vm *vm, uint16_t addr, uint16_t val)
+{
+    timer *t = ctx;
+    if (addr == MR_TMSR)
+        t->status = val & 0x7FFF;
+    else if (addr == MR_TMIR)
+    {
+        t->interval = val;
+        t->ticked = 0;
+        t->due = now_ms() + val;
+    }
+}
+
+static int timer_interrupt(void *ctx, lc3_vm *vm, uint8_t *vector)
+{
+    timer *t = ctx;
+    if (!(t->status & LC3_INTERRUPT_ENABLE) || !t->interval)
+        return -1;
+    if (!timer_ticked(t, vm))
+        return 0;
+    *vector = LC3_TIMER_VECTOR;
+    return LC3_TIMER_PRIORITY;
+}
+
+int lc3_attach_timer(lc3_vm *vm)
+{
+    timer *t = calloc(1, sizeof(timer));
+    if (!t)
+        return 0;
+    if (!lc3_map_device(vm, MR_TMSR, MR_TMIR, &(lc3_device){t, timer_read, timer_write, free, timer_interrupt}))
+    {
+        free(t);
+        return 0;
+    }
+    return 1;
+}
+
+typedef struct
+{
+    int fd;
+    uint16_t status; /* bit 0: the last transfer failed */
+    uint16_t block;
+    uint16_t addr;
+} disk;
+
+/* Move a block between the file and memory, returns 1 on success */
+static int disk_transfer(disk *dk, lc3_vm *vm, int command)
+{
+    uint8_t buf[LC3_DISK_BLOCK * 2];
+    off_t offset = (off_t)dk->block * sizeof(buf);
+
+    /* DMA into the device page would trigger devices */
+    if ((uint32_t)dk->addr + LC3_DISK_BLOCK > LC3_DEVICE_PAGE)
+        return 0;
+
+    if (command == LC3_DISK_READ)
+    {
+        ssize_t got = pread(dk->fd, buf, sizeof(buf), offset);
+        if (got < 0)
+            return 0;
+        memset(buf + got, 0, sizeof(buf) - got);
+        for (int i = 0; i < LC3_DISK_BLOCK; i++)
+            lc3_write(vm, dk->addr + i, buf[2 * i] << 8 | buf[2 * i + 1]);
+        return 1;
+    }
+    if (command == LC3_DISK_WRITE)
+    {
+        for (int i = 0; i < LC3_DISK_BLOCK; i++)
+        {
+            uint16_t word = lc3_read(vm, dk->addr + i);
+            buf[2 * i] = word >> 8;
+            buf[2 * i + 1] = word & 0xFF;
+        }
+        return pwrite(dk->fd, buf, sizeof(buf), offset) == sizeof(buf);
+    }
+    return 0;
+}
+
+static uint16_t disk_read(void *ctx, lc3_vm *vm, uint16_t addr)
+{
+    disk *dk = ctx;
+    switch (addr)
+    {
+    case MR_DKSR:
+        return (1 << 15) | dk->status;
+    case MR_DKBR:
+        return dk->block;
+    case MR_DKAR:
+        return dk->addr;
+    default:
+        return 0;
+    }
+}
+
+static void disk_write(void *ctx, lc3_vm *vm, uint16_t addr, uint16_t val)
+{
+    disk *dk = ctx;
+    if (addr == MR_DKBR)
+        dk->block = val;
+    else if (addr == MR_DKAR)
+        dk->addr = val;
+    else if (addr == MR_DKCR)
+        dk->status = !disk_transfer(dk, vm, val);
+}
+
+static void disk_destroy(void *ctx)
+{
+    disk *dk = ctx;
+    close(dk->fd);
+    free(dk);
+}
+
+int lc3_attach_disk(lc3_vm *vm, const char *path)
+{
+    disk *dk = calloc(1, sizeof(disk));
+    if (!dk)
+        return 0;
+    dk->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (dk->fd < 0)
+    {
+        free(dk);
+        return 0;
+    }
+    if (!lc3_map_device(vm, MR_DKSR, MR_DKCR, &(lc3_device){dk, disk_read, disk_write, disk_destroy}))
+    {
+        disk_destroy(dk);
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+/* unix specific */
+#include <unistd.h>
+
+#include "lc3.h"
+
+/*
+    Text framebuffer. The program draws into ordinary memory and presents a frame by
+    writing MR_FBCR; presenting copies it into the front buffer and marks the rows that
+    differ from the last frame presented. A thread draws the front buffer on the
+    terminal at a capped frame rate, so the program never waits for the terminal and
+    frames presented faster than that are merged. Only the dirty rows are looked at, and
+    on them only the cells that differ from what the terminal shows are rewritten.
+*/
+
+#define FB_CELLS (LC3_FB_COLS * LC3_FB_ROWS)
+
+/* What a cleared screen shows */
+#define FB_BLANK ' '
+
+/* Default frame rate */
+#define FB_FPS 30
+
+/* Unchanged cells on a row that are rewritten rather than skipped with a cursor move */
+#define FB_MAX_REWRITE 4
+
+/* Worst case output of a frame: a cursor move, a colour and a character per cell */
+#define FB_OUT_SIZE (FB_CELLS * 24 + 64)
+
+typedef struct
+{
+    int fd;
+    long interval_ns; /* between frames */
+    uint16_t base;    /* MR_FBAR */
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t presented;
+
+    /* Shared with the thread, under lock */
+    uint16_t front[FB_CELLS]; /* the last frame presented */
+    uint32_t dirty;           /* bit per row of front not drawn yet */
+    int stop;
+
+    /* Owned by the thread */
+    uint16_t shown[FB_CELLS]; /* what the terminal shows */
+    int drawn;                /* the screen was cleared and holds the framebuffer */
+    int colour;               /* colour the terminal draws in */
+    char out[FB_OUT_SIZE];
+    size_t len;
+} framebuffer;
+
+static void fb_printf(framebuffer *f, const char *fmt, int a, int b)
+{
+    f->len += snprintf(f->out + f->len, FB_OUT_SIZE - f->len, fmt, a, b);
+}
+
+static void fb_flush(framebuffer *f)
+{
+    size_t done = 0;
+    while (done < f->len)
+    {
+        ssize_t n = write(f->fd, f->out + done, f->len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    f->len = 0;
+}
+
+static void fb_set_colour(framebuffer *f, int colour)
+{
+    if (colour == f->colour)
+        return;
+    if (colour == 0)
+        fb_printf(f, "\x1b[39m", 0, 0);
+    else
+        fb_printf(f, "\x1b[%dm", colour < 8 ? 30 + colour : 90 + colour - 8, 0);
+    f->colour = colour;
+}
+
+/* A cell as it looks: anything unprintable is a space, the unused bits are cleared */
+static uint16_t fb_cell(uint16_t word)
+{
+    int c = word & 0xFF;
+    return (word & 0x0F00) | (c >= 0x20 && c < 0x7F ? c : ' ');
+}
+
+static void fb_put(framebuffer *f, uint16_t cell)
+{
+    fb_set_colour(f, cell >> 8);
+    f->out[f->len++] = cell & 0xFF;
+}
+
+/* Bring the dirty rows of frame on the terminal up to date, with as little output as possible */
+static void fb_draw(framebuffer *f, const uint16_t *frame, uint32_t dirty)
+{
+    if (!f->drawn)
+    {
+        fb_printf(f, "\x1b[0m\x1b[H\x1b[2J", 0, 0);
+        for (int i = 0; i < FB_CELLS; i++)
+            f->shown[i] = FB_BLANK;
+        f->colour = 0;
+        f->drawn = 1;
+    }
+
+    for (int row = 0; row < LC3_FB_ROWS; row++)
+    {
+        if (!(dirty >> row & 1))
+            continue;
+
+        const uint16_t *cells = frame + row * LC3_FB_COLS;
+        uint16_t *shown = f->shown + row * LC3_FB_COLS;
+        int col = -1; /* cursor column on this row, -1 if elsewhere */
+        for (int c = 0; c < LC3_FB_COLS; c++)
+        {
+            if (cells[c] == shown[c])
+                continue;
+
+            if (col < 0)
+                fb_printf(f, "\x1b[%d;%dH", row + 1, c + 1);
+            else if (c > col)
+            {
+                /* Rewriting a short run of unchanged cells is cheaper than moving over it */
+                int rewrite = c - col <= FB_MAX_REWRITE;
+                for (int k = col; rewrite && k < c; k++)
+                    rewrite = ((shown[k] >> 8) & 0xF) == f->colour;
+                if (rewrite)
+                {
+                    for (int k = col; k < c; k++)
+                        fb_put(f, shown[k]);
+                }
+                else
+                    fb_printf(f, "\x1b[%dC", c - col, 0);
+            }
+            fb_put(f, cells[c]);
+            shown[c] = cells[c];
+            col = c + 1;
+        }
+    }
+
+    /* Leave the cursor below the framebuffer, where anything else the program prints goes */
+    fb_printf(f, "\x1b[%d;1H", LC3_FB_ROWS + 1, 0);
+    fb_flush(f);
+}
+
+static void *fb_thread(void *arg)
+{
+    framebuffer *f = arg;
+    uint16_t frame[FB_CELLS];
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    pthread_mutex_lock(&f->lock);
+    for (;;)
+    {
+        while (!f->dirty && !f->stop)
+            pthread_cond_wait(&f->presented, &f->lock);
+        if (!f->dirty)
+            break;
+
+        uint32_t dirty = f->dirty;
+        f->dirty = 0;
+        for (int row = 0; row < LC3_FB_ROWS; row++)
+        {
+            if (dirty >> row & 1)
+                memcpy(frame + row * LC3_FB_COLS, f->front + row * LC3_FB_COLS, LC3_FB_COLS * sizeof(uint16_t));
+        }
+        int stopping = f->stop;
+        pthread_mutex_unlock(&f->lock);
+
+        fb_draw(f, frame, dirty);
+
+        /* No faster than the frame rate, frames presented meanwhile are drawn as one */
+        if (!stopping)
+        {
+            next.tv_nsec += f->interval_ns;
+            while (next.tv_nsec >= 1000000000)
+            {
+                next.tv_nsec -= 1000000000;
+                next.tv_sec++;
+            }
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+                next = now;
+            else
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+        pthread_mutex_lock(&f->lock);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return NULL;
+}
+
+/* Copy the frame out of memory and mark the rows that changed since the last one */
+static void fb_present(framebuffer *f, lc3_vm *vm)
+{
+    uint16_t frame[FB_CELLS];
+    for (int i = 0; i < FB_CELLS; i++)
+    {
+        uint16_t addr = f->base + i;
+        frame[i] = fb_cell(addr < LC3_DEVICE_PAGE ? lc3_read(vm, addr) : 0);
+    }
+
+    pthread_mutex_lock(&f->lock);
+    uint32_t dirty = f->dirty;
+    for (int row = 0; row < LC3_FB_ROWS; row++)
+    {
+        size_t at = row * LC3_FB_COLS;
+        if (memcmp(frame + at, f->front + at, LC3_FB_COLS * sizeof(uint16_t)) != 0)
+        {
+            memcpy(f->front + at, frame + at, LC3_FB_COLS * sizeof(uint16_t));
+            f->dirty |= 1u << row;
+        }
+    }
+    if (f->dirty != dirty)
+        pthread_cond_signal(&f->presented);
+    pthread_mutex_unlock(&f->lock);
+}
+
+static uint16_t fb_read(void *ctx, lc3_vm *vm, uint16_t addr)
+{
+    framebuffer *f = ctx;
+    if (addr == MR_FBAR)
+        return f->base;
+    if (addr != MR_FBCR)
+        return 0;
+
+    pthread_mutex_lock(&f->lock);
+    uint16_t status = f->dirty ? 0 : 1 << 15;
+    pthread_mutex_unlock(&f->lock);
+    return status;
+}
+
+static void fb_write(void *ctx, lc3_vm *vm, uint16_t addr, uint16_t val)
+{
+    framebuffer *f = ctx;
+    if (addr == MR_FBAR)
+        f->base = val;
+    else if (addr == MR_FBCR && (val & 1))
+        fb_present(f, vm);
+}
+
+static void fb_destroy(void *ctx)
+{
+    framebuffer *f = ctx;
+
+    /* The last frame presented is still drawn */
+    pthread_mutex_lock(&f->lock);
+    f->stop = 1;
+    pthread_cond_signal(&f->presented);
+    pthread_mutex_unlock(&f->lock);
+    pthread_join(f->thread, NULL);
+
+    if (f->drawn)
+    {
+        fb_printf(f, "\x1b[0m", 0, 0);
+        fb_flush(f);
+    }
+    pthread_cond_destroy(&f->presented);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+}
+
+int lc3_attach_framebuffer(lc3_vm *vm, int fd, unsigned fps)
+{
+    framebuffer *f = calloc(1, sizeof(framebuffer));
+    if (!f)
+        return 0;
+    f->fd = fd;
+    f->interval_ns = 1000000000L / (fps ? fps : FB_FPS);
+    f->base = LC3_FB_BASE;
+    /* Rows that stay blank are never drawn */
+    for (int i = 0; i < FB_CELLS; i++)
+        f->front[i] = FB_BLANK;
+
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->presented, NULL);
+    if (pthread_create(&f->thread, NULL, fb_thread, f) != 0)
+    {
+        pthread_cond_destroy(&f->presented);
+        pthread_mutex_destroy(&f->lock);
+        free(f);
+        return 0;
+    }
+    if (!lc3_map_device(vm, MR_FBCR, MR_FBAR, &(lc3_device){f, fb_read, fb_write, fb_destroy}))
+    {
+        fb_destroy(f);
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,628 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+/* unix specific */
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "lc3.h"
+#include "gdb.h"
+
+/*
+    GDB remote serial protocol stub for one connection. The target as the debugger sees it:
+    memory is byte addressed, byte 2a being the high and 2a + 1 the low byte of word a
+    (big-endian, like object files), and the registers in the order of the 'g' packet are
+    R0-R7, PC and PSR with the condition codes in bits [2:0], 16 bits each, big-endian.
+    Breakpoints (Z0, Z1) and write watchpoints (Z2) go to lc3_set_breakpoint and
+    lc3_set_watchpoint. While the program runs the stub looks for an interrupt (^C) from
+    the debugger every GDB_QUANTUM instructions, and every GDB_POLL_MS while the program
+    waits for a key.
+
+    If the VM is recorded (lc3_enable_history) the debugger can also go back: reverse
+    step and continue (bs, bc), and the monitor commands "history", which shows the
+    instructions the history holds, and "goto n", which puts the machine before
+    instruction n. A halt is then reported as the end of the history, for the debugger
+    to go back from.
+*/
+
+/* Largest packet either side sends */
+#define GDB_PACKET_SIZE 4096
+
+#define GDB_QUANTUM 1000000
+#define GDB_POLL_MS 50
+
+/* Registers in a 'g' packet */
+#define GDB_REGS 10
+
+typedef struct
+{
+    int fd;
+    lc3_vm *vm;
+    int no_ack;
+    int gone;    /* the connection was lost */
+    int history; /* the VM is recorded, it can go back */
+
+    char in[GDB_PACKET_SIZE];
+    size_t in_len, in_pos;
+
+    char packet[GDB_PACKET_SIZE];
+    char out[GDB_PACKET_SIZE + 4];
+} gdb_conn;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(int ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+/* The n hex digits at s as a number, -1 if there aren't that many */
+static long parse_hex(const char *s, int n)
+{
+    long v = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int h = hex_value(s[i]);
+        if (h < 0)
+            return -1;
+        v = v * 16 + h;
+    }
+    return v;
+}
+
+static void put_hex16(char *s, uint16_t v)
+{
+    for (int i = 0; i < 4; i++)
+        s[i] = hex_digits[(v >> (12 - 4 * i)) & 0xF];
+}
+
+static int read_byte(gdb_conn *c)
+{
+    if (c->in_pos == c->in_len)
+    {
+        ssize_t n;
+        do
+            n = read(c->fd, c->in, sizeof(c->in));
+        while (n < 0 && errno == EINTR);
+        if (n <= 0)
+        {
+            c->gone = 1;
+            return -1;
+        }
+        c->in_len = n;
+        c->in_pos = 0;
+    }
+    return (unsigned char)c->in[c->in_pos++];
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* Next packet into c->packet, acknowledged. Returns its length, -1 if the connection is lost */
+static int get_packet(gdb_conn *c)
+{
+    for (;;)
+    {
+        /* Acks and interrupts that arrive while the program is stopped mean nothing */
+        int ch;
+        do
+            ch = read_byte(c);
+        while (ch >= 0 && ch != '$');
+
+        size_t len = 0;
+        unsigned sum = 0;
+        while ((ch = read_byte(c)) >= 0 && ch != '#')
+        {
+            if (len < GDB_PACKET_SIZE - 1)
+                c->packet[len++] = ch;
+            sum += ch;
+        }
+        int hi = read_byte(c);
+        int lo = read_byte(c);
+        if (ch < 0 || lo < 0)
+            return -1;
+        c->packet[len] = '\0';
+
+        if (c->no_ack)
+            return len;
+        if (hex_value(hi) * 16 + hex_value(lo) == (int)(sum & 0xFF))
+            return write_all(c->fd, "+", 1) ? (int)len : -1;
+        if (!write_all(c->fd, "-", 1))
+            return -1;
+    }
+}
+
+/* Send a packet, again until the debugger acknowledges it. Returns 0 if the connection is lost */
+static int put_packet(gdb_conn *c, const char *data)
+{
+    size_t len = strlen(data);
+    unsigned sum = 0;
+    c->out[0] = '$';
+    for (size_t i = 0; i < len; i++)
+    {
+        c->out[i + 1] = data[i];
+        sum += (unsigned char)data[i];
+    }
+    c->out[len + 1] = '#';
+    c->out[len + 2] = hex_digits[(sum >> 4) & 0xF];
+    c->out[len + 3] = hex_digits[sum & 0xF];
+
+    for (;;)
+    {
+        if (!write_all(c->fd, c->out, len + 4))
+            return 0;
+        if (c->no_ack)
+            return 1;
+        int ch;
+        do
+            ch = read_byte(c);
+        while (ch >= 0 && ch != '+' && ch != '-');
+        if (ch != '-')
+            return ch == '+';
+    }
+}
+
+/* 1 if the debugger sent an interrupt while the program runs */
+static int interrupted(gdb_conn *c)
+{
+    struct pollfd p = {c->fd, POLLIN};
+    while (c->in_pos < c->in_len || poll(&p, 1, 0) > 0)
+    {
+        int ch = read_byte(c);
+        if (ch < 0)
+            return 1;
+        if (ch == 0x03)
+            return 1;
+    }
+    return 0;
+}
+
+/* Registers in the order of the 'g' packet, the PSR with the condition codes */
+static uint16_t get_reg(lc3_vm *vm, int n)
+{
+    if (n < 8)
+        return lc3_get_reg(vm, R_R0 + n);
+    if (n == 8)
+        return lc3_get_reg(vm, R_PC);
+    return (lc3_get_reg(vm, R_PSR) & ~0x7) | lc3_get_reg(vm, R_COND);
+}
+
+static void set_reg(lc3_vm *vm, int n, uint16_t val)
+{
+    if (n < 8)
+        lc3_set_reg(vm, R_R0 + n, val);
+    else if (n == 8)
+        lc3_set_reg(vm, R_PC, val);
+    else
+    {
+        lc3_set_reg(vm, R_PSR, val);
+        /* Exactly one of N, Z and P is set on the LC-3 */
+        if (val & 0x7)
+            lc3_set_reg(vm, R_COND, val & 0x7);
+    }
+}
+
+/* Memory bytes as the debugger addresses them */
+static int get_byte(lc3_vm *vm, unsigned long addr)
+{
+    uint16_t word = lc3_peek(vm, addr >> 1);
+    return addr & 1 ? word & 0xFF : word >> 8;
+}
+
+static void set_byte(lc3_vm *vm, unsigned long addr, int val)
+{
+    uint16_t word = lc3_peek(vm, addr >> 1);
+    word = addr & 1 ? (word & 0xFF00) | val : (word & 0x00FF) | val << 8;
+    lc3_poke(vm, addr >> 1, word);
+}
+
+/* "addr,length" at s, past it in *end. Returns 0 if it is malformed or outside of memory */
+static int parse_range(const char *s, unsigned long *addr, unsigned long *len, char **end)
+{
+    *addr = strtoul(s, end, 16);
+    if (**end != ',')
+        return 0;
+    *len = strtoul(*end + 1, end, 16);
+    return *addr < 2UL * MEMORY_MAX && *len <= 2UL * MEMORY_MAX - *addr;
+}
+
+/* Z and z packets: "type,addr,kind". Returns the reply */
+static const char *set_point(lc3_vm *vm, const char *packet, int on)
+{
+    unsigned long addr, kind;
+    char *end;
+    int type = packet[1] - '0';
+    if (packet[2] != ',' || !parse_range(packet + 3, &addr, &kind, &end))
+        return "E01";
+
+    /* Software and hardware breakpoints are the same thing here, only writes can be watched */
+    int ok = 1;
+    if (type == 0 || type == 1)
+        ok = lc3_set_breakpoint(vm, addr >> 1, on);
+    else if (type == 2)
+    {
+        for (unsigned long a = addr >> 1; ok && a < MEMORY_MAX && 2 * a < addr + (kind ? kind : 1); a++)
+            ok = lc3_set_watchpoint(vm, a, on);
+    }
+    else
+        return "";
+    return ok ? "OK" : "E02";
+}
+
+/*
+    Resume the program, one instruction or until something stops it, forward or back,
+    and describe why it stopped
+*/
+static void resume(gdb_conn *c, int single, int reverse, char *reply)
+{
+    lc3_vm *vm = c->vm;
+    for (;;)
+    {
+        if (reverse && single)
+            lc3_reverse_step(vm, 1);
+        else if (reverse)
+            lc3_reverse_run(vm);
+        else if (single)
+            lc3_step(vm, 1);
+        else
+            lc3_run(vm);
+
+        int reason = lc3_stop_reason(vm);
+        if (!lc3_running(vm))
+            strcpy(reply, c->history ? "T05replaylog:end;" : "W00");
+        else if (reason == LC3_STOP_HISTORY)
+            strcpy(reply, "T05replaylog:begin;");
+        else if (reason == LC3_STOP_BREAKPOINT)
+            strcpy(reply, "T05swbreak:;");
+        else if (reason == LC3_STOP_WATCHPOINT)
+            sprintf(reply, "T05watch:%x;", 2 * lc3_watch_address(vm));
+        else if (single || reverse)
+            strcpy(reply, "S05");
+        else if (interrupted(c))
+            strcpy(reply, "S02");
+        else
+            continue;
+        return;
+    }
+}
+
+/* Show text on the debugger's console while a monitor command runs */
+static int monitor_print(gdb_conn *c, const char *text)
+{
+    char out[GDB_PACKET_SIZE];
+    size_t i = 0;
+    out[0] = 'O';
+    for (; text[i] && 2 * i + 2 < sizeof(out); i++)
+    {
+        out[1 + 2 * i] = hex_digits[(uint8_t)text[i] >> 4];
+        out[2 + 2 * i] = hex_digits[text[i] & 0xF];
+    }
+    out[1 + 2 * i] = '\0';
+    return put_packet(c, out);
+}
+
+/* qRcmd: a monitor command, hex encoded. Returns its reply, or NULL if the connection was lost */
+static const char *monitor(gdb_conn *c, const char *hex)
+{
+    lc3_vm *vm = c->vm;
+    char cmd[GDB_PACKET_SIZE / 2 + 1];
+    size_t len = 0;
+    for (long ch; len + 1 < sizeof(cmd) && (ch = parse_hex(hex + 2 * len, 2)) >= 0; len++)
+        cmd[len] = ch;
+    cmd[len] = '\0';
+
+    unsigned long begin, end, n;
+    char text[128];
+    char *rest;
+    if (!c->history)
+        return "";
+    if (strcmp(cmd, "history") == 0)
+    {
+        lc3_history_range(vm, &begin, &end);
+        snprintf(text, sizeof(text), "instructions %lu to %lu, at %lu\n", begin, end, lc3_retired(vm));
+        return monitor_print(c, text) ? "OK" : NULL;
+    }
+    if (strncmp(cmd, "goto ", 5) == 0)
+    {
+        /* The debugger still has the registers from before, "maint flush register-cache" */
+        n = strtoul(cmd + 5, &rest, 0);
+        if (rest == cmd + 5 || *rest || !lc3_seek(vm, n))
+        {
+            lc3_history_range(vm, &begin, &end);
+            snprintf(text, sizeof(text), "no instruction %.40s in the history, %lu to %lu\n", cmd + 5, begin, end);
+            return monitor_print(c, text) ? "E01" : NULL;
+        }
+        return "OK";
+    }
+    return "";
+}
+
+/* Handle one packet. Returns 0 once the session is over, the program killed or let go */
+static int handle_packet(gdb_conn *c, char *stop_reply)
+{
+    lc3_vm *vm = c->vm;
+    char *p = c->packet;
+    char reply[GDB_PACKET_SIZE];
+    unsigned long addr, len;
+    char *end;
+    reply[0] = '\0';
+
+    switch (p[0])
+    {
+    case '?':
+        strcpy(reply, stop_reply);
+        break;
+    case 'g':
+        for (int n = 0; n < GDB_REGS; n++)
+            put_hex16(reply + 4 * n, get_reg(vm, n));
+        reply[4 * GDB_REGS] = '\0';
+        break;
+    case 'G':
+        for (int n = 0; n < GDB_REGS; n++)
+        {
+            long v = parse_hex(p + 1 + 4 * n, 4);
+            if (v < 0)
+                break;
+            set_reg(vm, n, v);
+        }
+        strcpy(reply, "OK");
+        break;
+    case 'p':
+    {
+        unsigned long n = strtoul(p + 1, NULL, 16);
+        if (n < GDB_REGS)
+        {
+            put_hex16(reply, get_reg(vm, n));
+            reply[4] = '\0';
+        }
+        else
+            strcpy(reply, "E01");
+        break;
+    }
+    case 'P':
+    {
+        unsigned long n = strtoul(p + 1, &end, 16);
+        long v = *end == '=' ? parse_hex(end + 1, 4) : -1;
+        if (n < GDB_REGS && v >= 0)
+        {
+            set_reg(vm, n, v);
+            strcpy(reply, "OK");
+        }
+        else
+            strcpy(reply, "E01");
+        break;
+    }
+    case 'm':
+        if (!parse_range(p + 1, &addr, &len, &end))
+        {
+            strcpy(reply, "E01");
+            break;
+        }
+        if (len > (sizeof(reply) - 1) / 2)
+            len = (sizeof(reply) - 1) / 2;
+        for (unsigned long i = 0; i < len; i++)
+        {
+            int b = get_byte(vm, addr + i);
+            reply[2 * i] = hex_digits[b >> 4];
+            reply[2 * i + 1] = hex_digits[b & 0xF];
+        }
+        reply[2 * len] = '\0';
+        break;
+    case 'M':
+    {
+        if (!parse_range(p + 1, &addr, &len, &end) || *end != ':' || strlen(end + 1) < 2 * len)
+        {
+            strcpy(reply, "E01");
+            break;
+        }
+        /* Nothing is written unless all of the data is hex */
+        unsigned long i;
+        for (i = 0; i < len && parse_hex(end + 1 + 2 * i, 2) >= 0; i++)
+            ;
+        if (i < len)
+        {
+            strcpy(reply, "E01");
+            break;
+        }
+        for (i = 0; i < len; i++)
+            set_byte(vm, addr + i, parse_hex(end + 1 + 2 * i, 2));
+        strcpy(reply, "OK");
+        break;
+    }
+    case 'c':
+    case 's':
+        /* An address to resume at may follow */
+        if (p[1])
+            lc3_set_reg(vm, R_PC, strtoul(p + 1, NULL, 16) >> 1);
+        resume(c, p[0] == 's', 0, stop_reply);
+        strcpy(reply, stop_reply);
+        break;
+    case 'b':
+        /* Reverse step and continue, only offered while the VM is recorded */
+        if (c->history && (strcmp(p, "bs") == 0 || strcmp(p, "bc") == 0))
+        {
+            resume(c, p[1] == 's', 1, stop_reply);
+            strcpy(reply, stop_reply);
+        }
+        break;
+    case 'C':
+    case 'S':
+        /* Resuming with a signal, which the LC-3 has no use for */
+        resume(c, p[0] == 'S', 0, stop_reply);
+        strcpy(reply, stop_reply);
+        break;
+    case 'v':
+        if (strcmp(p, "vCont?") == 0)
+            strcpy(reply, "vCont;c;C;s;S");
+        else if (strncmp(p, "vCont;", 6) == 0)
+        {
+            /* One thread: the first action is the one for it */
+            resume(c, p[6] == 's' || p[6] == 'S', 0, stop_reply);
+            strcpy(reply, stop_reply);
+        }
+        break;
+    case 'Z':
+    case 'z':
+        strcpy(reply, set_point(vm, p, p[0] == 'Z'));
+        break;
+    case 'H':
+    case 'T':
+        strcpy(reply, "OK");
+        break;
+    case 'q':
+        if (strncmp(p, "qSupported", 10) == 0)
+            sprintf(reply, "PacketSize=%x;QStartNoAckMode+;swbreak+;hwbreak+;vContSupported+%s", GDB_PACKET_SIZE,
+                    c->history ? ";ReverseStep+;ReverseContinue+" : "");
+        else if (strncmp(p, "qRcmd,", 6) == 0)
+        {
+            const char *r = monitor(c, p + 6);
+            if (!r)
+                return 0;
+            strcpy(reply, r);
+        }
+        else if (strcmp(p, "qAttached") == 0)
+            strcpy(reply, "1");
+        else if (strcmp(p, "qC") == 0)
+            strcpy(reply, "QC1");
+        else if (strcmp(p, "qfThreadInfo") == 0)
+            strcpy(reply, "m1");
+        else if (strcmp(p, "qsThreadInfo") == 0)
+            strcpy(reply, "l");
+        break;
+    case 'Q':
+        if (strcmp(p, "QStartNoAckMode") == 0)
+        {
+            /* Acknowledged once more, then never again */
+            if (!put_packet(c, "OK"))
+                return 0;
+            c->no_ack = 1;
+            return 1;
+        }
+        break;
+    case 'D':
+        put_packet(c, "OK");
+        return 0;
+    case 'k':
+        return 0;
+    }
+
+    if (!put_packet(c, reply))
+        return 0;
+    /* The program halted, the debugger is done with it */
+    return reply[0] != 'W';
+}
+
+/* Listening socket for "[host]:port", -1 if it can't be opened */
+static int listen_on(const char *addr)
+{
+    const char *colon = strrchr(addr, ':');
+    if (!colon || !colon[1])
+        return -1;
+
+    struct sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(atoi(colon + 1))};
+    char host[64];
+    if (colon == addr)
+        strcpy(host, "127.0.0.1");
+    else if ((size_t)(colon - addr) < sizeof(host))
+    {
+        memcpy(host, addr, colon - addr);
+        host[colon - addr] = '\0';
+    }
+    else
+        return -1;
+    if (inet_pton(AF_INET, host, &sin.sin_addr) != 1)
+        return -1;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(fd, 1) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    fprintf(stderr, "waiting for gdb on %s:%d\n", host, ntohs(sin.sin_port));
+    return fd;
+}
+
+int run_gdb(const char *addr, lc3_vm *vm)
+{
+    int listener = listen_on(addr);
+    if (listener < 0)
+    {
+        fprintf(stderr, "can't listen on %s\n", addr);
+        return 0;
+    }
+    int fd;
+    do
+        fd = accept(listener, NULL, NULL);
+    while (fd < 0 && errno == EINTR);
+    close(listener);
+    if (fd < 0)
+        return 0;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    gdb_conn *c = calloc(1, sizeof(gdb_conn));
+    if (!c)
+    {
+        close(fd);
+        return 0;
+    }
+    c->fd = fd;
+    c->vm = vm;
+    unsigned long begin, end;
+    c->history = lc3_history_range(vm, &begin, &end);
+
+    /* Runs are cut into slices to look for interrupts in between */
+    lc3_set_limits(vm, GDB_QUANTUM, GDB_POLL_MS);
+    char stop_reply[64] = "S05";
+    while (get_packet(c) >= 0 && handle_packet(c, stop_reply))
+        ;
+    int killed = !c->gone && c->packet[0] == 'k';
+    close(fd);
+    free(c);
+
+    /* Let go of the program: no breakpoints, no watchpoints and no slices. It runs on from the present */
+    for (int a = 0; a < MEMORY_MAX; a++)
+    {
+        lc3_set_breakpoint(vm, a, 0);
+        lc3_set_watchpoint(vm, a, 0);
+    }
+    lc3_set_limits(vm, 0, 0);
+    if (lc3_history_range(vm, &begin, &end))
+    {
+        lc3_seek(vm, end);
+        lc3_disable_history(vm);
+    }
+    if (!killed && lc3_running(vm))
+        lc3_run(vm);
+    return 1;
+}
@@ -0,0 +1,15 @@
+#ifndef GDB_H
+#define GDB_H
+
+#include "lc3.h"
+
+/*
+    Debug vm with GDB's remote serial protocol. Waits for a debugger to connect to the
+    TCP address addr ("[host]:port", the loopback interface if host is left out) and runs
+    the program under its control, stopped at the current PC at first. Once the debugger
+    detaches, or the connection is lost, the program runs on without breakpoints. Returns
+    1 once the program halted, was killed or ran to the end, 0 if the address can't be used.
+*/
+int run_gdb(const char *addr, lc3_vm *vm);
+
+#endif
@@ -0,0 +1,619 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include "vm.h"
+#include "history.h"
+#include "simd.h"
+
+/*
+    Time travel. The present is only ever executed: going back saves it like a checkpoint,
+    and moving forward again through the past restores checkpoints and undoes records
+    until it is reached, then execution carries on from it.
+*/
+
+/* Registers of a record's system part, in the order of its bits */
+static const uint8_t system_reg[] = {R_PSR, R_SSP, R_USP, R_COND};
+
+static history_segment *segment(const struct history *h, size_t i)
+{
+    return &h->seg[(h->head + i) % h->max];
+}
+
+static history_segment *last_segment(const struct history *h)
+{
+    return segment(h, h->count - 1);
+}
+
+unsigned long history_begin(const struct history *h)
+{
+    return h->count ? segment(h, 0)->first : h->end;
+}
+
+/* A page holding the words at p: hint if it holds them, else any page that does, else a new one */
+static struct history_page *share_page(struct history *h, const uint16_t *p, struct history_page *hint)
+{
+    if (hint && simd_equal(hint->word, p, HISTORY_PAGE_WORDS))
+    {
+        hint->refs++;
+        return hint;
+    }
+
+    uint64_t hash = simd_hash(p, HISTORY_PAGE_WORDS);
+    struct history_page **bucket = &h->table[hash % HISTORY_TABLE_SIZE];
+    for (struct history_page *page = *bucket; page; page = page->next)
+    {
+        if (page->hash == hash && simd_equal(page->word, p, HISTORY_PAGE_WORDS))
+        {
+            page->refs++;
+            return page;
+        }
+    }
+
+    struct history_page *page = malloc(sizeof(struct history_page));
+    if (!page)
+        return NULL;
+    page->hash = hash;
+    page->refs = 1;
+    memcpy(page->word, p, sizeof(page->word));
+    page->next = *bucket;
+    *bucket = page;
+    h->bytes += sizeof(struct history_page);
+    return page;
+}
+
+static void release_page(struct history *h, struct history_page *page)
+{
+    if (--page->refs)
+        return;
+    struct history_page **link = &h->table[page->hash % HISTORY_TABLE_SIZE];
+    while (*link != page)
+        link = &(*link)->next;
+    *link = page->next;
+    free(page);
+    h->bytes -= sizeof(struct history_page);
+}
+
+static void release_segment(struct history *h, history_segment *s)
+{
+    for (int i = 0; i < HISTORY_PAGES; i++)
+        release_page(h, s->page[i]);
+    free(s->log);
+    h->bytes -= s->size;
+}
+
+/*
+    Checkpoint of the machine, continuing at pc, into s. Pages nothing was stored to since
+    prev are shared with it. Returns 0 if out of memory
+*/
+static int checkpoint(struct history *h, const lc3_vm *vm, uint16_t pc, history_segment *s, const history_segment *prev)
+{
+    s->first = h->end;
+    memcpy(s->reg, vm->reg, sizeof(s->reg));
+    s->reg[R_PC] = pc;
+    s->log = NULL;
+    s->used = s->size = 0;
+
+    for (int i = 0; i < HISTORY_PAGES; i++)
+    {
+        struct history_page *hint = prev ? prev->page[i] : NULL;
+        if (hint && !h->dirty[i])
+        {
+            hint->refs++;
+            s->page[i] = hint;
+        }
+        else if (!(s->page[i] = share_page(h, vm->memory + i * HISTORY_PAGE_WORDS, hint)))
+        {
+            while (i-- > 0)
+                release_page(h, s->page[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Put the machine's registers and memory in the state of a checkpoint */
+static void restore(lc3_vm *vm, const history_segment *s)
+{
+    /* Pages that are the same stay untouched, they may still be shared copy-on-write */
+    for (int i = 0; i < HISTORY_PAGES; i++)
+    {
+        uint16_t *p = vm->memory + i * HISTORY_PAGE_WORDS;
+        if (!simd_equal(p, s->page[i]->word, HISTORY_PAGE_WORDS))
+            memcpy(p, s->page[i]->word, sizeof(s->page[i]->word));
+    }
+    memcpy(vm->reg, s->reg, sizeof(vm->reg));
+}
+
+/* Drop every segment and the saved present */
+static void clear(struct history *h)
+{
+    for (size_t i = 0; i < h->count; i++)
+        release_segment(h, segment(h, i));
+    if (h->past)
+        release_segment(h, &h->present);
+    h->head = h->count = 0;
+    h->past = 0;
+}
+
+/* First checkpoint of a history whose next instruction, at pc, is instruction number first */
+static void start(struct history *h, const lc3_vm *vm, uint16_t pc, unsigned long first)
+{
+    clear(h);
+    h->end = h->now = first;
+    h->pending = 0;
+    h->stores = 0;
+    memcpy(h->reg, vm->reg, sizeof(h->reg));
+    memset(h->dirty, 0, sizeof(h->dirty));
+    h->due = h->interval;
+
+    h->lost = !checkpoint(h, vm, pc, &h->seg[0], NULL);
+    if (!h->lost)
+        h->count = 1;
+}
+
+struct history *history_create(lc3_vm *vm, size_t limit, unsigned long interval)
+{
+    struct history *h = calloc(1, sizeof(struct history));
+    if (!h)
+        return NULL;
+    h->limit = limit;
+    h->segment_max = limit / HISTORY_MIN_SEGMENTS;
+    h->interval = interval;
+    memset(h->map, 1, sizeof(h->map));
+
+    h->max = 16;
+    h->seg = malloc(h->max * sizeof(history_segment));
+    if (h->seg)
+        start(h, vm, vm->reg[R_PC], vm->retired);
+    if (!h->seg || h->lost)
+    {
+        history_destroy(h);
+        return NULL;
+    }
+    return h;
+}
+
+void history_destroy(struct history *h)
+{
+    if (h->seg)
+        clear(h);
+    free(h->seg);
+    free(h);
+}
+
+void history_restart(struct history *h, lc3_vm *vm)
+{
+    /* Code was decoded from the memory of the present */
+    if (h->past)
+        memory_changed(vm);
+    start(h, vm, vm->reg[R_PC], vm->retired);
+}
+
+/* Room for n more bytes in the log of s */
+static int reserve(struct history *h, history_segment *s, size_t n)
+{
+    if (s->size - s->used >= n)
+        return 1;
+    size_t size = s->size ? 2 * s->size : HISTORY_LOG_CHUNK;
+    while (size - s->used < n)
+        size *= 2;
+    uint8_t *log = realloc(s->log, size);
+    if (!log)
+        return 0;
+    h->bytes += size - s->size;
+    s->log = log;
+    s->size = size;
+    return 1;
+}
+
+/* Start a new segment at the machine's state, dropping the oldest ones beyond the size limit */
+static void next_segment(struct history *h, const lc3_vm *vm, uint16_t pc)
+{
+    h->due = h->interval;
+
+    /* The log is complete, give back what it did not use */
+    history_segment *prev = last_segment(h);
+    uint8_t *log = prev->used ? realloc(prev->log, prev->used) : NULL;
+    if (log || !prev->used)
+    {
+        if (!prev->used)
+            free(prev->log);
+        h->bytes -= prev->size - prev->used;
+        prev->log = log;
+        prev->size = prev->used;
+    }
+
+    if (h->count == h->max)
+    {
+        history_segment *seg = malloc(2 * h->max * sizeof(history_segment));
+        if (!seg)
+        {
+            h->lost = 1;
+            return;
+        }
+        for (size_t i = 0; i < h->count; i++)
+            seg[i] = *segment(h, i);
+        free(h->seg);
+        h->seg = seg;
+        h->head = 0;
+        h->max *= 2;
+        prev = last_segment(h);
+    }
+
+    if (!checkpoint(h, vm, pc, segment(h, h->count), prev))
+    {
+        h->lost = 1;
+        return;
+    }
+    h->count++;
+    memset(h->dirty, 0, sizeof(h->dirty));
+
+    while (h->bytes > h->limit && h->count > 1)
+    {
+        release_segment(h, segment(h, 0));
+        h->head = (h->head + 1) % h->max;
+        h->count--;
+    }
+}
+
+void history_record(struct history *h, lc3_vm *vm, uint16_t pc)
+{
+    h->pending = 0;
+
+    /* Records went missing: start over with the state the instruction left */
+    if (h->lost)
+    {
+        start(h, vm, pc, h->end + 1);
+        return;
+    }
+
+    history_segment *s = last_segment(h);
+    if (!reserve(h, s, HISTORY_RECORD_MAX))
+    {
+        start(h, vm, pc, h->end + 1);
+        return;
+    }
+
+    uint8_t *p = s->log + s->used;
+    const uint16_t *reg = vm->reg;
+    uint8_t f = (h->reg[R_COND] & 7) << HISTORY_CC_SHIFT;
+
+    if (h->stores)
+    {
+        f |= HISTORY_STORES;
+        memcpy(p, &h->stores, 2);
+        p += 2;
+        h->stores = 0;
+    }
+
+    /* Compare R0-R7 four at a time, most instructions change one register or none */
+    uint64_t now[2], before[2];
+    memcpy(now, reg, sizeof(now));
+    memcpy(before, h->reg, sizeof(before));
+    if ((now[0] ^ before[0]) | (now[1] ^ before[1]))
+    {
+        uint8_t mask = 0;
+        for (int r = 0; r < 8; r++)
+        {
+            if (reg[r] != h->reg[r])
+            {
+                memcpy(p, &h->reg[r], 2);
+                p += 2;
+                mask |= 1 << r;
+            }
+        }
+        *p++ = mask;
+        f |= HISTORY_REGS;
+        memcpy(h->reg, now, sizeof(now));
+    }
+
+    uint8_t mask = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int r = system_reg[i];
+        if (r == R_COND ? h->reg[r] > 7 : reg[r] != h->reg[r])
+        {
+            memcpy(p, &h->reg[r], 2);
+            p += 2;
+            mask |= 1 << i;
+        }
+        h->reg[r] = reg[r];
+    }
+    if (mask)
+    {
+        *p++ = mask;
+        f |= HISTORY_SYSTEM;
+    }
+
+    if (pc != (uint16_t)(h->pc + 1))
+    {
+        f |= HISTORY_JUMP;
+        memcpy(p, &h->pc, 2);
+        p += 2;
+    }
+    *p++ = f;
+    s->used = p - s->log;
+    h->now = ++h->end;
+
+    if (--h->due == 0 || s->used >= h->segment_max)
+        next_segment(h, vm, pc);
+}
+
+void history_store(struct history *h, const lc3_vm *vm, uint16_t addr)
+{
+    /* Checkpoints must see the page changed, even by a device outside of an instruction */
+    h->dirty[addr / HISTORY_PAGE_WORDS] = 1;
+    if (!h->pending || h->lost)
+        return;
+
+    history_segment *s = last_segment(h);
+    if (h->stores == UINT16_MAX || !reserve(h, s, 4 + HISTORY_RECORD_MAX))
+    {
+        h->lost = 1;
+        return;
+    }
+    uint8_t *p = s->log + s->used;
+    memcpy(p, &addr, 2);
+    memcpy(p + 2, &vm->memory[addr], 2);
+    s->used += 4;
+    h->stores++;
+}
+
+/*
+    Undo the record before the cursor, the machine goes back one instruction. Returns a
+    watched address it stored to, -1 if none
+*/
+static int undo(struct history *h, lc3_vm *vm)
+{
+    history_segment *s = segment(h, h->cursor);
+    while (h->offset == 0)
+    {
+        s = segment(h, --h->cursor);
+        h->offset = s->used;
+    }
+
+    const uint8_t *p = s->log + h->offset;
+    uint16_t *reg = vm->reg;
+    uint8_t f = *--p;
+    reg[R_COND] = (f >> HISTORY_CC_SHIFT) & 7;
+
+    if (f & HISTORY_JUMP)
+    {
+        p -= 2;
+        memcpy(&reg[R_PC], p, 2);
+    }
+    else
+        reg[R_PC]--;
+
+    if (f & HISTORY_SYSTEM)
+    {
+        uint8_t mask = *--p;
+        for (int i = 3; i >= 0; i--)
+        {
+            if (mask & (1 << i))
+            {
+                p -= 2;
+                memcpy(&reg[system_reg[i]], p, 2);
+            }
+        }
+    }
+
+    if (f & HISTORY_REGS)
+    {
+        uint8_t mask = *--p;
+        for (int r = 7; r >= 0; r--)
+        {
+            if (mask & (1 << r))
+            {
+                p -= 2;
+                memcpy(&reg[r], p, 2);
+            }
+        }
+    }
+
+    /* Last store first, so a word stored twice gets its oldest value back */
+    int watched = -1;
+    if (f & HISTORY_STORES)
+    {
+        uint16_t n, addr;
+        p -= 2;
+        memcpy(&n, p, 2);
+        while (n-- > 0)
+        {
+            p -= 4;
+            memcpy(&addr, p, 2);
+            memcpy(&vm->memory[addr], p + 2, 2);
+            if (vm->debug && vm->debug->watch[addr])
+                watched = addr;
+        }
+    }
+
+    h->offset = p - s->log;
+    h->now--;
+    return watched;
+}
+
+/* Save the present before the machine leaves it. Returns 0 if out of memory */
+static int leave_present(struct history *h, lc3_vm *vm)
+{
+    if (h->past)
+        return 1;
+    if (!checkpoint(h, vm, vm->reg[R_PC], &h->present, last_segment(h)))
+        return 0;
+    h->past = 1;
+    h->cursor = h->count - 1;
+    h->offset = last_segment(h)->used;
+    return 1;
+}
+
+/* Restore checkpoint i, or the present if i is count */
+static void go_to(struct history *h, lc3_vm *vm, size_t i)
+{
+    if (i == h->count)
+    {
+        restore(vm, &h->present);
+        h->now = h->end;
+        h->cursor = h->count - 1;
+        h->offset = last_segment(h)->used;
+    }
+    else
+    {
+        restore(vm, segment(h, i));
+        h->now = segment(h, i)->first;
+        h->cursor = i;
+        h->offset = 0;
+    }
+}
+
+/* Index of the first checkpoint after state n, count if that is the present */
+static size_t checkpoint_after(const struct history *h, unsigned long n)
+{
+    size_t lo = 1, hi = h->count;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (segment(h, mid)->first > n)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/* The machine is where the history put it: the rest of the VM follows */
+static void settle(struct history *h, lc3_vm *vm)
+{
+    /* Back in the present, which executes on from where it was left */
+    if (h->past && h->now == h->end)
+    {
+        release_segment(h, &h->present);
+        h->past = 0;
+    }
+    vm->retired = h->now;
+    vm->running = (vm->memory[MR_MCR] >> 15) & 1;
+    vm->idle = 0;
+    /* Decoded instructions are of the memory the machine had before */
+    memory_changed(vm);
+}
+
+/* Move the machine to state n, which is in the history and the machine in the past */
+static void move(struct history *h, lc3_vm *vm, unsigned long n)
+{
+    size_t i = checkpoint_after(h, n);
+    unsigned long after = i < h->count ? segment(h, i)->first : h->end;
+
+    /* Undo straight from where the machine is if that is on the way */
+    if (h->now < n || h->now > after)
+        go_to(h, vm, i);
+    else if (n == h->end)
+        go_to(h, vm, h->count);
+    while (h->now > n)
+        undo(h, vm);
+}
+
+int history_seek(struct history *h, lc3_vm *vm, unsigned long n)
+{
+    if (h->lost || n < history_begin(h) || n > h->end)
+        return 0;
+    if (n != h->now)
+    {
+        if (!leave_present(h, vm))
+            return 0;
+        move(h, vm, n);
+    }
+    settle(h, vm);
+    return 1;
+}
+
+static int breakpoint(const lc3_vm *vm)
+{
+    return vm->debug && vm->debug->breakpoint[vm->reg[R_PC]];
+}
+
+static void watchpoint_hit(lc3_vm *vm, uint16_t addr)
+{
+    vm->stop_reason = LC3_STOP_WATCHPOINT;
+    vm->debug->watch_address = addr;
+}
+
+unsigned long history_forward(struct history *h, lc3_vm *vm, unsigned long n)
+{
+    if (!h->past || n == 0)
+        return n;
+
+    unsigned long start = h->now;
+    unsigned long target = n < h->end - start ? start + n : h->end;
+    unsigned long hit = ULONG_MAX;
+    int watched = -1;
+
+    /*
+        Records only go backward: look for the first stop segment by segment, each from
+        the checkpoint after it back to where the search is
+    */
+    for (unsigned long from = start; vm->debug && from < target && hit == ULONG_MAX;)
+    {
+        size_t i = checkpoint_after(h, from);
+        unsigned long after = i < h->count ? segment(h, i)->first : h->end;
+        go_to(h, vm, i);
+        for (;;)
+        {
+            /* A breakpoint at a state, a watchpoint at the state after the store */
+            if (h->now > start && h->now <= target && breakpoint(vm))
+            {
+                hit = h->now;
+                watched = -1;
+            }
+            if (h->now == from)
+                break;
+            int w = undo(h, vm);
+            if (w >= 0 && h->now + 1 > start && h->now + 1 <= target)
+            {
+                hit = h->now + 1;
+                watched = w;
+            }
+        }
+        from = after;
+    }
+
+    move(h, vm, hit != ULONG_MAX ? hit : target);
+    settle(h, vm);
+    if (hit == ULONG_MAX)
+        return n - (target - start);
+
+    if (watched >= 0)
+        watchpoint_hit(vm, watched);
+    else
+        vm->stop_reason = LC3_STOP_BREAKPOINT;
+    return 0;
+}
+
+void history_back(struct history *h, lc3_vm *vm, unsigned long n)
+{
+    if (h->lost || n == 0 || !leave_present(h, vm))
+        return;
+
+    unsigned long begin = history_begin(h);
+    while (n-- > 0)
+    {
+        if (h->now == begin)
+        {
+            vm->stop_reason = LC3_STOP_HISTORY;
+            break;
+        }
+        int w = undo(h, vm);
+        /* Stopped before the store, at the instruction that made it */
+        if (w >= 0)
+        {
+            watchpoint_hit(vm, w);
+            break;
+        }
+        if (breakpoint(vm))
+        {
+            vm->stop_reason = LC3_STOP_BREAKPOINT;
+            break;
+        }
+    }
+    settle(h, vm);
+}
@@ -0,0 +1,154 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+    Execution history of one VM, for time travel. The recording interpreter loop leaves
+    an undo record for every instruction: the registers it changed and the old value of
+    every word it stored. Every interval instructions a checkpoint of the whole machine
+    starts a new segment of records. A state in the past is reached by restoring the
+    checkpoint after it, or the present, and undoing records back to it, so nothing is
+    executed again and devices and the console don't see it happen twice.
+
+    Records are read backward, from their last byte:
+
+        stores  address and old value of each word stored, 2 bytes each, in the order
+                of the stores, then their count in 2 bytes, if HISTORY_STORES
+        regs    the old values of R0-R7 that changed, 2 bytes each in register order,
+                then a byte with a bit per register, if HISTORY_REGS
+        system  the same for PSR, SSP and USP, and for the condition codes if they were
+                more than 3 bits, if HISTORY_SYSTEM
+        pc      2 bytes if HISTORY_JUMP, otherwise it was the PC after minus 1
+        flags   HISTORY_* bits and the old condition codes in bits 4-6
+
+    Numbers are in host byte order. The memory of checkpoints is kept in pages shared
+    between them: only pages stored to since the last checkpoint are looked at, and
+    those are shared with any page of the same contents, found by their hash.
+*/
+
+/* Checkpoints keep memory in pages of this many words */
+#define HISTORY_PAGE_WORDS 512
+#define HISTORY_PAGES (MEMORY_MAX / HISTORY_PAGE_WORDS)
+
+/* Hash table of the pages, by the low bits of their hash */
+#define HISTORY_TABLE_SIZE 4096
+
+/* A segment ends once its records take this fraction of the size limit, so dropping the oldest frees room */
+#define HISTORY_MIN_SEGMENTS 16
+
+/* Records grow a segment's log by at least this much at a time */
+#define HISTORY_LOG_CHUNK (64 * 1024)
+
+/* Longest record without its stores */
+#define HISTORY_RECORD_MAX (2 + 8 * 2 + 1 + 4 * 2 + 1 + 2 + 1)
+
+enum
+{
+    HISTORY_JUMP = 1 << 0,   /* the instruction did not continue at the next address */
+    HISTORY_REGS = 1 << 1,   /* general purpose registers changed */
+    HISTORY_SYSTEM = 1 << 2, /* PSR, SSP or USP changed, or the condition codes are odd */
+    HISTORY_STORES = 1 << 3, /* memory was written */
+};
+#define HISTORY_CC_SHIFT 4
+
+/* Memory of checkpoints, one copy of every page contents */
+struct history_page
+{
+    struct history_page *next; /* in its hash table bucket */
+    uint64_t hash;
+    unsigned long refs;
+    uint16_t word[HISTORY_PAGE_WORDS];
+};
+
+/* A checkpoint and the records of the instructions executed from it up to the next one */
+typedef struct
+{
+    unsigned long first; /* number of the instruction the checkpoint was taken before */
+    uint16_t reg[R_COUNT];
+    struct history_page *page[HISTORY_PAGES];
+    uint8_t *log;
+    size_t used, size;
+} history_segment;
+
+/* History of one VM, filled by the recording interpreter loop */
+struct history
+{
+    size_t limit; /* bytes records and pages may take, the oldest segments are dropped */
+    size_t bytes;
+    size_t segment_max;
+    unsigned long interval;
+
+    /* Segments, oldest first: a ring of max entries, count of them from head */
+    history_segment *seg;
+    size_t head, count, max;
+
+    /* Number of the next instruction the present executes, and of the machine's state */
+    unsigned long end;
+    unsigned long now;
+
+    /*
+        While the machine is in the past: the present it left, and the record to undo
+        next, the one before offset in segment cursor
+    */
+    int past;
+    history_segment present;
+    size_t cursor, offset;
+
+    /* The instruction being recorded: its PC and the registers before it, the stores so far */
+    int pending;
+    uint16_t pc;
+    uint16_t reg[R_COUNT];
+    uint16_t stores;
+
+    unsigned long due; /* instructions before the next checkpoint */
+    int lost;          /* out of memory, the history starts over after the instruction */
+
+    uint8_t dirty[HISTORY_PAGES]; /* pages stored to since the last checkpoint */
+    struct history_page *table[HISTORY_TABLE_SIZE];
+
+    /* The VM's code_map while it is recorded: every store takes mem_write's slow path */
+    uint8_t map[MEMORY_MAX];
+};
+
+/* History from the machine's state on, numbered from lc3_retired. NULL if out of memory */
+struct history *history_create(lc3_vm *vm, size_t limit, unsigned long interval);
+void history_destroy(struct history *h);
+
+/* Forget the history, the machine's state becomes the first of a new one */
+void history_restart(struct history *h, lc3_vm *vm);
+
+/* Close the record of the pending instruction, the machine continues at pc */
+void history_record(struct history *h, lc3_vm *vm, uint16_t pc);
+
+/* The pending instruction is about to write addr */
+void history_store(struct history *h, const lc3_vm *vm, uint16_t addr);
+
+/* The instruction at pc is about to run: record the one before it */
+static inline void history_fetch(struct history *h, lc3_vm *vm, uint16_t pc)
+{
+    if (h->pending)
+        history_record(h, vm, pc);
+    h->pending = 1;
+    h->pc = pc;
+}
+
+/* Number of the oldest state the history holds */
+unsigned long history_begin(const struct history *h);
+
+/* Put the machine in its state before instruction n. Returns 0 if n is outside the history */
+int history_seek(struct history *h, lc3_vm *vm, unsigned long n);
+
+/*
+    Move forward through the history by up to n instructions, stopping at breakpoints and
+    watchpoints. Returns the instructions left to execute from the present, 0 if it stopped
+*/
+unsigned long history_forward(struct history *h, lc3_vm *vm, unsigned long n);
+
+/* Undo up to n instructions, stopping at breakpoints, watchpoints and the oldest state */
+void history_back(struct history *h, lc3_vm *vm, unsigned long n);
+
+#endif
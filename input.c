@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+/* unix specific */
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "vm.h"
+#include "input.h"
+
+/*
+    Deterministic keyboard input. The only thing a program cannot predict is when keys
+    arrive, and a program only learns of a key when an instruction reads the keyboard
+    status register (or a native trap does). Recording logs every key with the number of
+    instructions executed before the instruction that read it; replay reports no key
+    ready until that many instructions have executed and then hands out the same key,
+    so the program takes the same path without a terminal or any waiting. Devices that
+    follow the host's clock, like the timer, log their events the same way.
+*/
+
+/* Instructions executed before the one running now. lc3_step keeps vm->retired up to date */
+static uint64_t instructions(const struct input_log *log)
+{
+    const lc3_vm *vm = log->vm;
+    return vm->retired + (vm->quantum - vm->steps) - 1 - log->start;
+}
+
+static int record_key_ready(void *ctx)
+{
+    struct input_log *log = ctx;
+    return log->console.key_ready(log->console.ctx);
+}
+
+/* A line per key or event, written right away so a crash or Ctrl-C loses nothing */
+static void record_line(struct input_log *log, int key)
+{
+    char line[48];
+    int len;
+    if (key == INPUT_EOF)
+        len = snprintf(line, sizeof(line), "%llu eof\n", (unsigned long long)instructions(log));
+    else if (key == INPUT_DEVICE_EVENT)
+        len = snprintf(line, sizeof(line), "%llu event\n", (unsigned long long)instructions(log));
+    else
+        len = snprintf(line, sizeof(line), "%llu %d\n", (unsigned long long)instructions(log), key);
+    if (log->fd >= 0 && write(log->fd, line, len) != len)
+    {
+        close(log->fd);
+        log->fd = -1;
+    }
+}
+
+static int record_read_key(void *ctx)
+{
+    struct input_log *log = ctx;
+    int key = log->console.read_key(log->console.ctx);
+
+    /* The end of input is sticky, only the first read of it goes in the log */
+    if (key < 0 && log->eof)
+        return key;
+    log->eof = key < 0;
+    record_line(log, key < 0 ? INPUT_EOF : key);
+    return key;
+}
+
+static int record_wait_key(void *ctx, long timeout_ms)
+{
+    struct input_log *log = ctx;
+    return log->console.wait_key(log->console.ctx, timeout_ms);
+}
+
+/* The next replayed key, NULL if none is left or a device event comes first */
+static const input_event *next_key(const struct input_log *log)
+{
+    if (log->next == log->count || log->events[log->next].key == INPUT_DEVICE_EVENT)
+        return NULL;
+    return &log->events[log->next];
+}
+
+static int replay_key_ready(void *ctx)
+{
+    struct input_log *log = ctx;
+    const input_event *e = next_key(log);
+    if (!e)
+        return log->eof;
+    return instructions(log) >= e->at;
+}
+
+static int replay_read_key(void *ctx)
+{
+    struct input_log *log = ctx;
+    /* The end of input stays, like it does on a console */
+    if (!next_key(log))
+        return -1;
+    int key = log->events[log->next++].key;
+    log->eof = key < 0;
+    return key;
+}
+
+/* Nothing is waited for in a replay, a key that is not due yet never comes by waiting */
+static int replay_wait_key(void *ctx, long timeout_ms)
+{
+    return replay_key_ready(ctx);
+}
+
+static void log_write_char(void *ctx, int c)
+{
+    struct input_log *log = ctx;
+    log->console.write_char(log->console.ctx, c);
+}
+
+static void log_write(void *ctx, const char *s, size_t len)
+{
+    struct input_log *log = ctx;
+    if (log->console.write)
+        log->console.write(log->console.ctx, s, len);
+    else
+        while (len-- > 0)
+            log->console.write_char(log->console.ctx, *s++);
+}
+
+static void log_flush(void *ctx)
+{
+    struct input_log *log = ctx;
+    log->console.flush(log->console.ctx);
+}
+
+static struct input_log *install(lc3_vm *vm, int replay)
+{
+    struct input_log *log = calloc(1, sizeof(struct input_log));
+    if (!log)
+        return NULL;
+
+    log->replay = replay;
+    log->vm = vm;
+    log->console = vm->io;
+    log->start = vm->retired;
+    log->fd = -1;
+    if (replay)
+        vm->io = (lc3_io){log, replay_key_ready, replay_read_key, log_write_char, log_flush, replay_wait_key, log_write};
+    else
+        vm->io = (lc3_io){log, record_key_ready, record_read_key, log_write_char, log_flush,
+                          log->console.wait_key ? record_wait_key : NULL, log_write};
+    return log;
+}
+
+struct input_log *input_record(lc3_vm *vm, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+    if (write(fd, INPUT_LOG_HEADER, strlen(INPUT_LOG_HEADER)) != (ssize_t)strlen(INPUT_LOG_HEADER))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    struct input_log *log = install(vm, 0);
+    if (!log)
+    {
+        close(fd);
+        return NULL;
+    }
+    log->fd = fd;
+    return log;
+}
+
+struct input_log *input_replay(lc3_vm *vm, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return NULL;
+
+    char line[64];
+    input_event *events = NULL;
+    size_t count = 0, max = 0;
+    int ok = fgets(line, sizeof(line), f) && (strcmp(line, INPUT_LOG_HEADER) == 0 || strcmp(line, INPUT_LOG_HEADER_V1) == 0);
+
+    while (ok && fgets(line, sizeof(line), f))
+    {
+        unsigned long long at;
+        char key[16];
+        if (sscanf(line, "%llu %15s", &at, key) != 2 || (count && at < events[count - 1].at))
+        {
+            ok = 0;
+            break;
+        }
+        if (count == max)
+        {
+            max = max ? 2 * max : 256;
+            input_event *more = realloc(events, max * sizeof(input_event));
+            if (!more)
+            {
+                ok = 0;
+                break;
+            }
+            events = more;
+        }
+        events[count].at = at;
+        if (strcmp(key, "eof") == 0)
+            events[count].key = INPUT_EOF;
+        else if (strcmp(key, "event") == 0)
+            events[count].key = INPUT_DEVICE_EVENT;
+        else
+            events[count].key = atoi(key) & 0xFF;
+        count++;
+    }
+    fclose(f);
+
+    struct input_log *log = ok ? install(vm, 1) : NULL;
+    if (!log)
+    {
+        free(events);
+        return NULL;
+    }
+    log->events = events;
+    log->count = count;
+    return log;
+}
+
+int input_close(struct input_log *log)
+{
+    int ok = 1;
+    log->vm->io = log->console;
+    if (!log->replay)
+        ok = log->fd >= 0 && close(log->fd) == 0;
+    free(log->events);
+    free(log);
+    return ok;
+}
+
+unsigned long input_next(const struct input_log *log)
+{
+    if (!log->replay || log->next == log->count)
+        return ULONG_MAX;
+
+    /* Between lc3_step calls nothing is running: the next instruction is the one to count */
+    uint64_t now = log->vm->retired - log->start;
+    uint64_t at = log->events[log->next].at;
+    return at > now ? at - now : 0;
+}
+
+int input_device_event(struct input_log *log, int due)
+{
+    if (!log->replay)
+    {
+        if (due)
+            record_line(log, INPUT_DEVICE_EVENT);
+        return due;
+    }
+
+    /* The recording decides, the host's clock has nothing to do with it */
+    if (log->next == log->count || log->events[log->next].key != INPUT_DEVICE_EVENT ||
+        instructions(log) < log->events[log->next].at)
+        return 0;
+    log->next++;
+    return 1;
+}
@@ -0,0 +1,63 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+    Input log file: a header line, then one line per key the program read, in order:
+    the number of instructions executed since recording started before the instruction
+    that read it, and the character code, or "eof" at the end of input. Events of devices
+    that follow the host's clock (lc3_device_event) are lines with "event" instead, at the
+    instruction they happened before. Logs of version 1 have no events.
+*/
+#define INPUT_LOG_HEADER "lc3-input 2\n"
+#define INPUT_LOG_HEADER_V1 "lc3-input 1\n"
+
+/* Instructions lc3_run executes per lc3_step while input is recorded or replayed */
+#define INPUT_QUANTUM 1000000
+
+/* A key at the end of input, and a device event instead of a key */
+#define INPUT_EOF (-1)
+#define INPUT_DEVICE_EVENT (-2)
+
+/* One key read by the program, or a device event */
+typedef struct
+{
+    uint64_t at;
+    int key; /* or INPUT_EOF, INPUT_DEVICE_EVENT */
+} input_event;
+
+/* Recording or replay of the keyboard of one VM, installed in place of its console input */
+struct input_log
+{
+    int replay;
+    lc3_vm *vm;
+    lc3_io console; /* the VM's own I/O, output always goes there */
+    uint64_t start; /* instructions retired when recording or replay started */
+
+    /* The end of input was read */
+    int eof;
+
+    /* Recording: the log file */
+    int fd;
+
+    /* Replay: the keys and device events still to come */
+    input_event *events;
+    size_t count, next;
+};
+
+struct input_log *input_record(lc3_vm *vm, const char *path);
+struct input_log *input_replay(lc3_vm *vm, const char *path);
+
+/* Put the VM's own I/O back. Returns 1 if the whole log was written */
+int input_close(struct input_log *log);
+
+/* Instructions to run before the next replayed key or event is due, 0 if it is due, ULONG_MAX if none is left */
+unsigned long input_next(const struct input_log *log);
+
+/* lc3_device_event while input is recorded or replayed */
+int input_device_event(struct input_log *log, int due);
+
+#endif
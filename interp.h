@@ -0,0 +1,549 @@
+/*
+    Threaded interpreter loop. This file is a template included once per execution
+    mode: define RUN_FN to the name of the function to generate and, optionally,
+    ENTER_HOOK() to declarations and statements run once before the first instruction,
+    LEAVE_HOOK() to a statement run whenever the loop returns after executing,
+    BLOCK_HOOK() to a statement run every time control is transferred (after the
+    new PC is known, before it is fetched), FETCH_HOOK() to a statement run before
+    every instruction is fetched, IDLE_HOOK() to a statement run after a load from
+    the keyboard status register found no key, WAIT_HOOK() after an interrupt poll found
+    nothing to take, CALL_HOOK(trap) after JSR, JSRR or an
+    emulated TRAP (trap vector, -1 for the others) went to a routine, RETURN_HOOK()
+    before a JMP R7 goes to its target, STORE_HOOK(addr, val) before a store and
+    BREAK_HOOK() when a breakpoint stops the loop before the instruction at pc, which
+    was fetched but does not run.
+    Hooks may `goto leave` to return to the caller with the machine still running.
+    Nothing is added to the loop for hooks left undefined.
+
+    Condition codes are kept lazily as the last result written, sign extended, and only
+    worked out when a BR tests them; reg[R_COND] is written when the loop returns and
+    around native traps. A hook that looks at reg[R_COND] has to SAVE_CC() first, one
+    that changes it LOAD_CC() after, or the mode defines EAGER_CC to set it on every
+    instruction. Loops without a FETCH_HOOK also fuse common pairs of instructions into
+    one handler, which a per-instruction hook would only see once. A fused handler
+    finds the second instruction in the next entry and decodes the pair again once a
+    store has cleared that.
+
+    Interrupts are only taken between basic blocks: while a device may request one, the
+    devices are polled every INTERRUPT_POLL blocks, before BLOCK_HOOK() sees the new PC.
+    The count of blocks left is kept in a local and only in vm->poll while the loop is
+    not running; a hook setting it to 0 has the devices polled at the next block.
+
+    Decoded handlers are only valid for the loop that decoded them, so the cache is
+    emptied whenever a different loop runs the VM.
+
+    A debugger's breakpoints are decoded as H_BREAK in place of the instruction, and its
+    watchpoints make stores take mem_write's slow path, which clears vm->running like a
+    store to the Machine Control Register. Neither costs the loop anything.
+*/
+
+#ifndef ENTER_HOOK
+#define ENTER_HOOK()
+#endif
+
+#ifndef LEAVE_HOOK
+#define LEAVE_HOOK()
+#endif
+
+/* Instruction pairs can only be fused if nothing has to happen between them */
+#ifdef FETCH_HOOK
+#define FUSE 0
+#else
+#define FUSE 1
+#endif
+
+#ifndef BLOCK_HOOK
+#define BLOCK_HOOK()
+#endif
+
+#ifndef FETCH_HOOK
+#define FETCH_HOOK()
+#endif
+
+#ifndef IDLE_HOOK
+#define IDLE_HOOK()
+#endif
+
+#ifndef WAIT_HOOK
+#define WAIT_HOOK()
+#endif
+
+#ifndef CALL_HOOK
+#define CALL_HOOK(trap)
+#endif
+
+#ifndef RETURN_HOOK
+#define RETURN_HOOK()
+#endif
+
+#ifndef STORE_HOOK
+#define STORE_HOOK(addr, val)
+#endif
+
+#ifndef BREAK_HOOK
+#define BREAK_HOOK()
+#endif
+
+#ifdef EAGER_CC
+#define SET_CC(r) update_flags(vm, r)
+#define COND() reg[R_COND]
+#define SAVE_CC()
+#define LOAD_CC()
+#else
+#define SET_CC(r) cc = (int16_t)reg[r]
+#define COND() lazy_cond(cc)
+#define SAVE_CC() reg[R_COND] = lazy_cond(cc)
+#define LOAD_CC() cc = lazy_result(reg[R_COND])
+#endif
+
+/* Fetch the next decoded instruction and jump straight to its handler */
+#define DISPATCH()                           \
+    do                                       \
+    {                                        \
+        FETCH_HOOK();                        \
+        d = &dcache[pc++];                   \
+        goto *(&&do_decode + d->handler);    \
+    } while (0)
+
+/* The PC was just set by a control transfer */
+#define END_BLOCK()             \
+    do                          \
+    {                           \
+        if (vm->armed &&        \
+            --poll < 0)         \
+            goto interrupt;     \
+        BLOCK_HOOK();           \
+        DISPATCH();             \
+    } while (0)
+
+/* Run the fetch-decode-execute cycle until the Machine Control Register is cleared */
+static void RUN_FN(lc3_vm *vm)
+{
+    /* Handler addresses, relative to do_decode so that a zeroed cache entry means "not decoded" */
+    static const int32_t handlers[H_COUNT] = {
+        [H_DECODE] = &&do_decode - &&do_decode,
+        [H_NOP] = &&do_nop - &&do_decode,
+        [H_BR] = &&do_br - &&do_decode,
+        [H_BR_ALWAYS] = &&do_br_always - &&do_decode,
+        [H_ADD] = &&do_add - &&do_decode,
+        [H_ADD_IMM] = &&do_add_imm - &&do_decode,
+        [H_AND] = &&do_and - &&do_decode,
+        [H_AND_IMM] = &&do_and_imm - &&do_decode,
+        [H_NOT] = &&do_not - &&do_decode,
+        [H_LD] = &&do_ld - &&do_decode,
+        [H_LDI] = &&do_ldi - &&do_decode,
+        [H_LDR] = &&do_ldr - &&do_decode,
+        [H_LEA] = &&do_lea - &&do_decode,
+        [H_ST] = &&do_st - &&do_decode,
+        [H_STI] = &&do_sti - &&do_decode,
+        [H_STR] = &&do_str - &&do_decode,
+        [H_JSR] = &&do_jsr - &&do_decode,
+        [H_JSRR] = &&do_jsrr - &&do_decode,
+        [H_JMP] = &&do_jmp - &&do_decode,
+        [H_RTI] = &&do_rti - &&do_decode,
+        [H_TRAP] = &&do_trap - &&do_decode,
+        [H_CLEAR] = &&do_clear - &&do_decode,
+        [H_RET] = &&do_ret - &&do_decode,
+        [H_ADD_IMM_BR] = &&do_add_imm_br - &&do_decode,
+        [H_LDR_ADD_IMM] = &&do_ldr_add_imm - &&do_decode,
+        [H_BREAK] = &&do_break - &&do_decode,
+    };
+
+    uint16_t *reg = vm->reg;
+    decoded_instr *dcache = vm->dcache;
+    uint16_t pc = reg[R_PC];
+    uint16_t addr;
+    decoded_instr *d;
+    int request;
+    int poll = vm->poll;
+#ifndef EAGER_CC
+    int32_t cc; /* last result sign extended, or 0x10000 + reg[R_COND] if that is no single flag */
+#endif
+
+    /* No owner means nothing has been decoded since the cache was emptied */
+    if (vm->dcache_owner != RUN_FN)
+    {
+        if (vm->dcache_owner)
+            memset(vm->dcache, 0, sizeof(vm->dcache));
+        vm->dcache_owner = RUN_FN;
+    }
+
+    /* While the Machine Control Register bit 15 is set */
+    vm->running = (vm->memory[MR_MCR] >> 15) & 1;
+    if (!vm->running)
+        return;
+
+    LOAD_CC();
+    ENTER_HOOK();
+    DISPATCH();
+
+do_decode:
+    /* First execution of this memory location since it was last written */
+    d->handler = handlers[specialize_instr(vm, pc - 1, d, decode_instr(vm, pc - 1, d), FUSE ? handlers : NULL)];
+    goto *(&&do_decode + d->handler);
+
+do_nop:
+    DISPATCH();
+
+do_br:
+    /*
+        The condition codes specified by the state of bits [11:9] are tested. If bit [11] is
+        set, N is tested; if bit [11] is clear, N is not tested. If bit [10] is set, Z is tested, etc.
+        If any of the condition codes tested is set, the program branches to the location
+        specified by adding the sign-extended PCoffset9 field to the incremented PC.
+    */
+    if (d->r1 & COND())
+        pc = d->arg;
+    END_BLOCK();
+
+do_br_always:
+    pc = d->arg;
+    END_BLOCK();
+
+do_add:
+    /*
+        If bit [5] is 0, the second source operand is obtained from SR2. If bit [5] is 1, the
+        second source operand is obtained by sign-extending the imm5 field to 16 bits.
+        In both cases, the second source operand is added to the contents of SRI and the
+        result stored in DR. The condition codes are set, based on whether the result is
+        negative, zero, or positive.
+    */
+    reg[d->r1] = reg[d->r2] + reg[d->arg];
+    SET_CC(d->r1);
+    DISPATCH();
+
+do_add_imm:
+    reg[d->r1] = reg[d->r2] + d->arg;
+    SET_CC(d->r1);
+    DISPATCH();
+
+do_and:
+    reg[d->r1] = reg[d->r2] & reg[d->arg];
+    SET_CC(d->r1);
+    DISPATCH();
+
+do_and_imm:
+    reg[d->r1] = reg[d->r2] & d->arg;
+    SET_CC(d->r1);
+    DISPATCH();
+
+do_not:
+    /*
+        The bit-wise complement of the contents of SR is stored in DR. The condition
+        codes are set, based on whether the binary value produced, taken as a 2's
+        complement integer, is negative, zero, or positive.
+    */
+    reg[d->r1] = ~reg[d->r2];
+    SET_CC(d->r1);
+    DISPATCH();
+
+do_ld:
+    /*
+        An address is computed by sign-extending bits [8:0] to 16 bits and adding this
+        value to the incremented PC. The contents of memory at this address are loaded
+        into DR. The condition codes are set, based on whether the value loaded is
+        negative, zero, or positive.
+    */
+    reg[d->r1] = mem_read(vm, d->arg);
+    SET_CC(d->r1);
+    DISPATCH();
+
+do_ldi:
+    /*
+        An address is computed by sign-extending bits [8:0] to 16 bits and adding this
+        value to the incremented PC. What is stored in memory at this address is the
+        address of the data to be loaded into DR. The condition codes are set, based on
+        whether the value loaded is negative, zero, or positive.
+    */
+    addr = mem_read(vm, d->arg);
+    reg[d->r1] = mem_read(vm, addr);
+    SET_CC(d->r1);
+    if (addr == MR_KBSR && !reg[d->r1])
+        IDLE_HOOK();
+    DISPATCH();
+
+do_ldr:
+    /*
+        An address is computed by sign-extending bits [5:0] to 16 bits and adding this
+        value to the contents of the register specified by bits [8:6]. The contents of memory
+        at this address are loaded into DR. The condition codes are set, based on whether
+        the value loaded is negative, zero, or positive.
+    */
+    addr = reg[d->r2] + d->arg;
+    reg[d->r1] = mem_read(vm, addr);
+    SET_CC(d->r1);
+    if (addr == MR_KBSR && !reg[d->r1])
+        IDLE_HOOK();
+    DISPATCH();
+
+do_lea:
+    /*
+        An address is computed by sign-extending bits [8:0] to 16 bits and adding this
+        value to the incremented PC. This address is loaded into DR. The condition
+        codes are set, based on whether the value loaded is negative, zero, or positive.
+    */
+    reg[d->r1] = d->arg;
+    SET_CC(d->r1);
+    DISPATCH();
+
+    /* Stores are the only way to clear the Machine Control Register, so only they check it */
+
+do_st:
+    /*
+        The contents of the register specified by SR are stored in the memory location
+        whose address is computed by sign-extending bits [8:0] to 16 bits and adding this
+        value to the incremented PC.
+    */
+    STORE_HOOK(d->arg, reg[d->r1]);
+    mem_write(vm, d->arg, reg[d->r1]);
+    if (!vm->running)
+        goto leave;
+    DISPATCH();
+
+do_sti:
+    /*
+        The contents of the register specified by SR are stored in the memory location
+        whose address is obtained as follows: Bits [8:0] are sign-extended to 16 bits and
+        added to the incremented PC. What is in memory at this address is the address of
+        the location to which the data in SR is stored.
+    */
+    addr = mem_read(vm, d->arg);
+    STORE_HOOK(addr, reg[d->r1]);
+    mem_write(vm, addr, reg[d->r1]);
+    if (!vm->running)
+        goto leave;
+    DISPATCH();
+
+do_str:
+    /*
+        The contents of the register specified by SR are stored in the memory location
+        whose address is computed by sign-extending bits [5:0] to 16 bits and adding this
+        value to the contents of the register specified by bits [8:6].
+    */
+    addr = reg[d->r2] + d->arg;
+    STORE_HOOK(addr, reg[d->r1]);
+    mem_write(vm, addr, reg[d->r1]);
+    if (!vm->running)
+        goto leave;
+    DISPATCH();
+
+do_clear:
+    /* AND with #0 */
+    reg[d->r1] = 0;
+    SET_CC(d->r1);
+    DISPATCH();
+
+do_add_imm_br:
+    /*
+        ADD with an immediate followed by a conditional BR, like a loop counter. d[1] is the
+        BR, unless a store replaced it and it was decoded again as something else
+    */
+    if (d[1].handler != handlers[H_BR])
+        goto refuse;
+    reg[d->r1] = reg[d->r2] + d->arg;
+    SET_CC(d->r1);
+    d++;
+    pc++;
+    if (d->r1 & COND())
+        pc = d->arg;
+    END_BLOCK();
+
+do_ldr_add_imm:
+    /* LDR followed by ADD with an immediate, like a pointer walk. d[1] is the ADD, maybe of a pair of its own */
+    if (d[1].handler != handlers[H_ADD_IMM] && d[1].handler != handlers[H_ADD_IMM_BR])
+        goto refuse;
+    reg[d->r1] = mem_read(vm, reg[d->r2] + d->arg);
+    d++;
+    pc++;
+    reg[d->r1] = reg[d->r2] + d->arg;
+    SET_CC(d->r1);
+    DISPATCH();
+
+refuse:
+    /* The second instruction of the pair was written over, or is not decoded yet */
+    goto do_decode;
+
+do_break:
+    /* A breakpoint stands in for the instruction at pc - 1, stop before it runs */
+    pc--;
+    BREAK_HOOK();
+    vm->debug->stop = LC3_STOP_BREAKPOINT;
+    vm->running = 0;
+    goto leave;
+
+do_jsr:
+    reg[R_R7] = pc;
+    pc = d->arg;
+    CALL_HOOK(-1);
+    END_BLOCK();
+
+do_jsrr:
+    reg[R_R7] = pc;
+    pc = reg[d->r2];
+    CALL_HOOK(-1);
+    END_BLOCK();
+
+do_jmp:
+    /*
+        The program unconditionally jumps to the location specified by the contents of
+        the base register. Bits [8:6] identify the base register.
+
+        The RET instruction is a special case of the JMP instruction. The PC is loaded
+        with the contents of R7, which contains the linkage back to the instruction
+        following the subroutine call instruction.
+    */
+    pc = reg[d->r2];
+    END_BLOCK();
+
+do_ret:
+    pc = reg[R_R7];
+    RETURN_HOOK();
+    END_BLOCK();
+
+do_trap:
+    /*
+        First R7 is loaded with the incremented PC. (This enables a return to the instruction
+        physically following the TRAP instruction in the original program after the service
+        routine has completed execution.) Then the PC is loaded with the starting address
+        of the system call specified by trapvector8. The starting address is contained in
+        the memory location whose address is obtained by zero-extending trapvector8 to
+        16 bits.
+    */
+    reg[R_R7] = pc;
+
+    /* Handle trap instructions natively, unless the OS routine has to run after all */
+    if (vm->trap_mode != LC3_TRAPS_EMULATED)
+    {
+        SAVE_CC();
+        int next = host_trap(vm, d->arg);
+        LOAD_CC();
+        if (next >= 0)
+        {
+            pc = next;
+            if (!vm->running)
+                goto leave;
+            END_BLOCK();
+        }
+    }
+
+    pc = mem_read(vm, d->arg);
+    CALL_HOOK(d->arg);
+    END_BLOCK();
+
+do_rti:
+    /*
+        If the processor is running in Supervisor mode, the top two elements on the
+        Supervisor Stack are popped and loaded into PC, PSR. If the processor is running
+        in User mode, a privilege mode violation exception occurs.
+    */
+    // PSR[15] = 0 in Supervisor Mode
+    if (((reg[R_PSR] >> 15) & 1) == 0)
+    {
+        // Pop PC from supervisor stack
+        pc = mem_read(vm, reg[R_R6]);
+        reg[R_R6]++;
+        // Pop PSR from supervisor stack
+        reg[R_PSR] = mem_read(vm, reg[R_R6]);
+        reg[R_R6]++;
+        // The condition codes were saved in PSR[2:0] if an interrupt pushed it
+        if (reg[R_PSR] & 0x7)
+        {
+            reg[R_COND] = reg[R_PSR] & 0x7;
+            LOAD_CC();
+        }
+        // Back in User mode: save the Supervisor Stack Pointer and restore the User Stack Pointer
+        if (reg[R_PSR] >> 15)
+        {
+            reg[R_SSP] = reg[R_R6];
+            reg[R_R6] = reg[R_USP];
+        }
+        // The priority may have dropped below a pending interrupt
+        poll = 0;
+        END_BLOCK();
+    }
+
+    /* Privilege mode violation occurs if the processor encounters the RTI instruction while running in User Mode, throwing an illegal opcode exception */
+    // The processor sets the privilege mode to Supervisor mode (PSR[15] = 0).
+    reg[R_PSR] &= ~(1 << 15);
+    // R6 is loaded with the Supervisor Stack Pointer (SSP) if it does not already contain the SSP
+    reg[R_R6] = reg[R_SSP];
+    // The PSR and PC of the interrupted process are pushed onto the Supervisor Stack
+    mem_write(vm, reg[R_R6]--, reg[R_PSR]);
+    mem_write(vm, reg[R_R6]--, pc);
+    // The exception supplies its 8-bit vector. In the case of the Privilege mode violation, that vector is x00
+
+    // The processor expands that vector to x0100, the corresponding 16-bit address in the interrupt vector table.
+
+    /* The PC is loaded with the contents of memory location x0100,
+    the address of the first instruction in the corresponding exception service
+    routine. */
+    pc = 0x0100;
+    io_puts(vm, "illegal opcode exception: An RTI instruction was executed while in user mode. The machine has been halted.\n");
+    vm->running = 0;
+    goto leave;
+
+interrupt:
+    /* Take the most urgent interrupt the devices request above the current priority */
+    poll = INTERRUPT_POLL;
+    request = poll_interrupts(vm);
+    if (request < 0)
+    {
+        WAIT_HOOK();
+    }
+    else
+    {
+        /*
+            The PSR, with the condition codes in bits [2:0], and the PC of the interrupted
+            program are pushed onto the Supervisor Stack, switching to it in User mode.
+            PSR[10:8] is set to the priority of the interrupt and the PC is loaded from
+            the interrupt vector table at x0100 + the vector.
+        */
+        SAVE_CC();
+        uint16_t psr = (reg[R_PSR] & ~0x7) | reg[R_COND];
+        if (psr >> 15)
+        {
+            reg[R_USP] = reg[R_R6];
+            reg[R_R6] = reg[R_SSP];
+        }
+        addr = reg[R_R6] - 1;
+        STORE_HOOK(addr, psr);
+        mem_write(vm, addr, psr);
+        addr--;
+        STORE_HOOK(addr, pc);
+        mem_write(vm, addr, pc);
+        reg[R_R6] = addr;
+        reg[R_PSR] = request & 0x0700;
+        pc = mem_read(vm, 0x0100 + (request & 0xFF));
+        /* A watchpoint on the supervisor stack */
+        if (!vm->running)
+            goto leave;
+    }
+    BLOCK_HOOK();
+    DISPATCH();
+
+leave:
+    LEAVE_HOOK();
+    SAVE_CC();
+    vm->poll = poll;
+    reg[R_PC] = pc;
+}
+
+#undef DISPATCH
+#undef END_BLOCK
+#undef FUSE
+#undef EAGER_CC
+#undef SET_CC
+#undef COND
+#undef SAVE_CC
+#undef LOAD_CC
+#undef ENTER_HOOK
+#undef LEAVE_HOOK
+#undef BLOCK_HOOK
+#undef FETCH_HOOK
+#undef IDLE_HOOK
+#undef WAIT_HOOK
+#undef CALL_HOOK
+#undef RETURN_HOOK
+#undef STORE_HOOK
+#undef BREAK_HOOK
+#undef RUN_FN
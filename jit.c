@@ -0,0 +1,929 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+
+#include <sys/mman.h>
+
+#include "vm.h"
+#include "jit.h"
+
+/*
+    Basic-block compiler from LC-3 to x86-64.
+
+    A block runs from its start address up to the first BR, JMP, JSR, JSRR or TRAP
+    (included) or the first instruction that must be interpreted (excluded). While
+    translated code runs the LC-3 registers and the condition codes live in host
+    registers, and stay there when a block jumps to the next one:
+
+        esi = R0    edi = R1    r8d = R2    r9d = R3
+        r10d = R4   r11d = R5   ebp = R6    r13d = R7
+        ebx = condition codes, in the interpreter's lazy form (see lazy_cond)
+        r12 = vm->memory        r14 = j     r15 = vm->dcache
+
+    Only the low 16 bits of an LC-3 register are meaningful. They are spilled to vm->reg
+    when control goes back to C: on the way out to the interpreter and around calls to
+    the helpers below. The condition codes of the last flag-setting instruction are only
+    computed into ebx when a branch, an exit or a call needs them.
+
+    Every block starts by counting down j->poll and leaves through a side exit once
+    that is negative, for the interpreter to poll the devices for interrupts. While the
+    VM is not armed the count starts out of reach, until a store to the device page arms
+    it. Blocks also charge their instructions to j->watch, which limited runs count with,
+    and leave the same way when it runs out; side exits give back what did not run.
+
+    Loads and stores whose address is only known at run time check it inline. Device
+    registers and stores into translated code go through a call to a C helper instead,
+    as do native traps. The interpreter still runs RTI, loads and stores whose address
+    is on the device page when the block is translated, and keyboard polls that find no
+    key, so that it can wait for one.
+*/
+
+#define JIT_BUF_SIZE (8 << 20)      /* executable memory for translated code */
+#define JIT_BLOCK_MAX 64            /* maximum number of instructions in a block */
+#define JIT_BLOCK_BYTES (16 << 10)  /* upper bound on the size of one translated block */
+#define JIT_DEVICE_PAGE LC3_DEVICE_PAGE /* first address translated code doesn't access inline */
+#define JIT_LEAVE 0x10000           /* set in a helper's result to leave translated code */
+
+typedef uint16_t (*jit_enter_fn)(struct jit *j, void *code);
+
+/* Helper called from translated code, through j->call */
+typedef uint32_t (*jit_helper_fn)(struct jit *j, uint32_t a, uint32_t b);
+
+/* x86 registers used as scratch */
+enum
+{
+    X_EAX = 0,
+    X_ECX = 1,
+    X_EDX = 2,
+    X_EBX = 3,
+    X_R12 = 12,
+    X_R14 = 14,
+};
+
+/* Host register of each LC-3 register */
+static const uint8_t host_reg[8] = {6, 7, 8, 9, 10, 11, 5, 13};
+
+/* Where the condition codes of the last flag-setting instruction are, they are only computed when needed */
+enum
+{
+    CC_HOST = 0, /* in ebx */
+    CC_REG,      /* from the value of a register */
+    CC_CONST,    /* a known constant */
+};
+
+typedef struct
+{
+    int kind;
+    uint16_t val; /* register index for CC_REG, the condition codes for CC_CONST */
+} pending_cc;
+
+/* Code emitted out of line once the block body is done */
+enum
+{
+    STUB_EXIT = 0, /* side exit to the interpreter */
+    STUB_LOAD,     /* load through jit_load */
+    STUB_STORE,    /* store through jit_store */
+};
+
+typedef struct
+{
+    int kind;
+    uint8_t *site[2]; /* rel32 fields of the jumps to the stub, the second may be NULL */
+    uint8_t *resume;  /* where the block goes on after a load or a store */
+    int r;            /* LC-3 register loaded or stored */
+    uint16_t pc;      /* PC of the instruction */
+    pending_cc cc;    /* condition codes to compute on the way out */
+} stub;
+
+/* A jump to the block at pc, through a stub until that block is translated */
+typedef struct
+{
+    uint8_t *site; /* rel32 field of the jump */
+    uint16_t pc;
+} block_chain;
+
+static void emit8(struct jit *j, uint8_t v)
+{
+    *j->p++ = v;
+}
+
+static void emit32(struct jit *j, uint32_t v)
+{
+    memcpy(j->p, &v, sizeof(v));
+    j->p += sizeof(v);
+}
+
+static void emit64(struct jit *j, uint64_t v)
+{
+    memcpy(j->p, &v, sizeof(v));
+    j->p += sizeof(v);
+}
+
+/* Point the rel32 field at site to target */
+static void patch_rel32(uint8_t *site, uint8_t *target)
+{
+    int32_t rel = (int32_t)(target - (site + 4));
+    memcpy(site, &rel, sizeof(rel));
+}
+
+/* Emit a rel32 field pointing to target */
+static void emit_rel32(struct jit *j, uint8_t *target)
+{
+    patch_rel32(j->p, target);
+    j->p += 4;
+}
+
+/* Leave room for a rel32 field patched later, returns it */
+static uint8_t *emit_rel32_later(struct jit *j)
+{
+    uint8_t *site = j->p;
+    j->p += 4;
+    return site;
+}
+
+/* REX prefix for the registers in ModRM.reg, SIB.index and ModRM.rm or SIB.base, if one is needed */
+static void emit_rex(struct jit *j, int w, int reg, int index, int base)
+{
+    uint8_t rex = 0x40 | w << 3 | (reg >> 3) << 2 | (index >> 3) << 1 | base >> 3;
+    if (rex != 0x40)
+        emit8(j, rex);
+}
+
+/* op rm, reg between 32-bit registers: mov 0x89, add 0x01, and 0x21, test 0x85 */
+static void emit_rr(struct jit *j, uint8_t op, int rm, int reg)
+{
+    emit_rex(j, 0, reg, 0, rm);
+    emit8(j, op);
+    emit8(j, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* op rm, imm8 sign-extended, with the operation in ModRM.reg: add 0, and 4 */
+static void emit_ri8(struct jit *j, int op, int rm, int8_t imm)
+{
+    emit_rex(j, 0, 0, 0, rm);
+    emit8(j, 0x83);
+    emit8(j, 0xC0 | op << 3 | (rm & 7));
+    emit8(j, (uint8_t)imm);
+}
+
+/* mov r, imm32 */
+static void emit_mov_imm(struct jit *j, int r, uint32_t imm)
+{
+    emit_rex(j, 0, 0, 0, r);
+    emit8(j, 0xB8 | (r & 7));
+    emit32(j, imm);
+}
+
+/* movzx (0xB7) or movsx (0xBF) dst, the low word of src */
+static void emit_extend(struct jit *j, uint8_t op, int dst, int src)
+{
+    emit_rex(j, 0, dst, 0, src);
+    emit8(j, 0x0F);
+    emit8(j, op);
+    emit8(j, 0xC0 | (dst & 7) << 3 | (src & 7));
+}
+
+/* movzx x, word [r12 + addr * 2] */
+static void emit_load_mem(struct jit *j, int x, uint16_t addr)
+{
+    emit_rex(j, 0, x, 0, X_R12);
+    emit8(j, 0x0F);
+    emit8(j, 0xB7);
+    emit8(j, 0x84 | (x & 7) << 3);
+    emit8(j, 0x24);
+    emit32(j, addr * 2);
+}
+
+/* movzx x, word [r12 + rcx * 2] */
+static void emit_load_ecx(struct jit *j, int x)
+{
+    emit_rex(j, 0, x, X_ECX, X_R12);
+    emit8(j, 0x0F);
+    emit8(j, 0xB7);
+    emit8(j, 0x04 | (x & 7) << 3);
+    emit8(j, 0x4C);
+}
+
+/* mov word [r12 + rcx * 2], x */
+static void emit_store_ecx(struct jit *j, int x)
+{
+    emit8(j, 0x66);
+    emit_rex(j, 0, x, X_ECX, X_R12);
+    emit8(j, 0x89);
+    emit8(j, 0x04 | (x & 7) << 3);
+    emit8(j, 0x4C);
+}
+
+/* op [r14 + field], r for a field of struct jit: mov to it 0x89, mov from it 0x8B */
+static void emit_field(struct jit *j, int w, uint8_t op, int r, size_t field)
+{
+    emit_rex(j, w, r, 0, X_R14);
+    emit8(j, op);
+    emit8(j, 0x86 | (r & 7) << 3);
+    emit32(j, (uint32_t)field);
+}
+
+/* Copy the LC-3 registers and the condition codes from the host registers to vm->reg and j->cc, through pointer register x */
+static void emit_spill(struct jit *j, int x)
+{
+    emit_field(j, 1, 0x8B, x, offsetof(struct jit, reg));
+    for (int r = 0; r < 8; r++)
+    {
+        emit8(j, 0x66); /* mov word [x + r * 2], host */
+        emit_rex(j, 0, host_reg[r], 0, x);
+        emit8(j, 0x89);
+        emit8(j, 0x40 | (host_reg[r] & 7) << 3 | x);
+        emit8(j, r * 2);
+    }
+    emit_field(j, 0, 0x89, X_EBX, offsetof(struct jit, cc));
+}
+
+/* The other way around */
+static void emit_fill(struct jit *j, int x)
+{
+    emit_field(j, 1, 0x8B, x, offsetof(struct jit, reg));
+    for (int r = 0; r < 8; r++)
+    {
+        emit_rex(j, 0, host_reg[r], 0, x); /* movzx host, word [x + r * 2] */
+        emit8(j, 0x0F);
+        emit8(j, 0xB7);
+        emit8(j, 0x40 | (host_reg[r] & 7) << 3 | x);
+        emit8(j, r * 2);
+    }
+    emit_field(j, 0, 0x8B, X_EBX, offsetof(struct jit, cc));
+}
+
+/* Compute the condition codes of the last flag-setting instruction into ebx */
+static void emit_cc(struct jit *j, pending_cc cc)
+{
+    if (cc.kind == CC_CONST)
+        emit_mov_imm(j, X_EBX, (uint32_t)lazy_result(cc.val));
+    else if (cc.kind == CC_REG)
+        emit_extend(j, 0xBF, X_EBX, host_reg[cc.val]);
+}
+
+/* Call helper with ecx and edx as its arguments, the result is in eax */
+static void emit_call(struct jit *j, jit_helper_fn helper)
+{
+    emit8(j, 0x48); /* mov rax, helper */
+    emit8(j, 0xB8);
+    emit64(j, (uint64_t)(uintptr_t)helper);
+    emit8(j, 0xE8); /* call j->call */
+    emit_rel32(j, j->call);
+}
+
+/* Leave for the interpreter at pc, giving back the instructions of the block that did not run */
+static void emit_exit(struct jit *j, uint16_t pc, pending_cc cc, uint32_t unrun)
+{
+    if (unrun)
+    {
+        emit8(j, 0x41); /* add dword [r14 + watch], unrun */
+        emit8(j, 0x81);
+        emit8(j, 0x86);
+        emit32(j, offsetof(struct jit, watch));
+        emit32(j, unrun);
+    }
+    emit_cc(j, cc);
+    emit_mov_imm(j, X_EAX, pc);
+    emit8(j, 0xE9); /* jmp j->exit_side */
+    emit_rel32(j, j->exit_side);
+}
+
+/* jcc rel32 (or jmp if jcc is 0) to a stub emitted later */
+static stub *emit_stub_jump(struct jit *j, stub *stubs, int *count, uint8_t jcc, int kind, uint16_t pc, pending_cc cc)
+{
+    stub *s = &stubs[(*count)++];
+    if (jcc)
+    {
+        emit8(j, 0x0F);
+        emit8(j, jcc);
+    }
+    else
+    {
+        emit8(j, 0xE9);
+    }
+    *s = (stub){kind, {emit_rel32_later(j), NULL}, NULL, 0, pc, cc};
+    return s;
+}
+
+/* jmp rel32 (or jcc) to the block at pc, through a stub until that block is translated */
+static void emit_chain(struct jit *j, block_chain *chains, int *count, uint8_t jcc, uint16_t pc)
+{
+    if (jcc)
+    {
+        emit8(j, 0x0F);
+        emit8(j, jcc);
+    }
+    else
+    {
+        emit8(j, 0xE9);
+    }
+    chains[*count].site = emit_rel32_later(j);
+    chains[*count].pc = pc;
+    (*count)++;
+}
+
+/* Continue at the block whose address is in eax, without returning to C if it is translated */
+static void emit_indirect(struct jit *j)
+{
+    /* mov rdx, [r14 + rax * 8] */
+    emit8(j, 0x49);
+    emit8(j, 0x8B);
+    emit8(j, 0x14);
+    emit8(j, 0xC6);
+    /* test rdx, rdx */
+    emit8(j, 0x48);
+    emit8(j, 0x85);
+    emit8(j, 0xD2);
+    /* jz j->exit_block */
+    emit8(j, 0x0F);
+    emit8(j, 0x84);
+    emit_rel32(j, j->exit_block);
+    /* jmp rdx */
+    emit8(j, 0xFF);
+    emit8(j, 0xE2);
+}
+
+/* Jump to a stub if the address in ecx is on the device page: cmp ecx, JIT_DEVICE_PAGE; jae stub */
+static stub *emit_device_check(struct jit *j, stub *stubs, int *count, int kind, uint16_t pc, pending_cc cc)
+{
+    emit8(j, 0x81);
+    emit8(j, 0xF9);
+    emit32(j, JIT_DEVICE_PAGE);
+    return emit_stub_jump(j, stubs, count, 0x83, kind, pc, cc);
+}
+
+/*
+    Store LC-3 register r to the address in ecx, s being the stub for the device page if
+    the address was checked. Stores into translated code go to the stub too, anything else
+    also invalidates the decoded instruction.
+*/
+static void emit_store(struct jit *j, stub *stubs, int *count, stub *s, int r, uint16_t pc, pending_cc cc)
+{
+    /* cmp byte [r14 + rcx + code_map], 0 */
+    emit8(j, 0x41);
+    emit8(j, 0x80);
+    emit8(j, 0xBC);
+    emit8(j, 0x0E);
+    emit32(j, offsetof(struct jit, code_map));
+    emit8(j, 0x00);
+    if (s)
+    {
+        emit8(j, 0x0F); /* jne s */
+        emit8(j, 0x85);
+        s->site[1] = emit_rel32_later(j);
+    }
+    else
+    {
+        s = emit_stub_jump(j, stubs, count, 0x85, STUB_STORE, pc, cc);
+    }
+    s->r = r;
+    emit_store_ecx(j, host_reg[r]);
+    /* mov dword [r15 + rcx * 8], 0 */
+    emit8(j, 0x41);
+    emit8(j, 0xC7);
+    emit8(j, 0x04);
+    emit8(j, 0xCF);
+    emit32(j, 0);
+    s->resume = j->p;
+}
+
+/* A helper armed the VM, e.g. with a store to the device page: count down the blocks the interpreter had left */
+static void check_armed(struct jit *j)
+{
+    if (!j->armed && j->vm->armed)
+    {
+        j->armed = 1;
+        j->poll = j->vm->poll;
+    }
+}
+
+/* Load from the device page. A keyboard poll that finds no key is left to the interpreter, which waits for one */
+static uint32_t jit_load(struct jit *j, uint32_t addr, uint32_t unused)
+{
+    (void)unused;
+    uint16_t val = lc3_read(j->vm, addr);
+    if (addr == MR_KBSR && !val)
+        return JIT_LEAVE;
+    return val;
+}
+
+/* Store to the device page or into translated code, leave if that code is gone or the machine stopped */
+static uint32_t jit_store(struct jit *j, uint32_t addr, uint32_t val)
+{
+    lc3_vm *vm = j->vm;
+    int code = j->code_map[addr];
+    lc3_write(vm, addr, val);
+    check_armed(j);
+    return code || !vm->running;
+}
+
+/* Native trap, returns the PC to continue at, with JIT_LEAVE once the machine halted */
+static uint32_t jit_trap(struct jit *j, uint32_t vect, uint32_t unused)
+{
+    (void)unused;
+    lc3_vm *vm = j->vm;
+    vm->reg[R_COND] = lazy_cond(j->cc);
+    int next = host_trap(vm, vect);
+    j->cc = lazy_result(vm->reg[R_COND]);
+    check_armed(j);
+    if (next < 0)
+        return lc3_read(vm, vect);
+    return vm->running ? (uint32_t)next : (uint32_t)next | JIT_LEAVE;
+}
+
+/* Same condition codes as update_flags */
+static uint16_t cc_of(uint16_t val)
+{
+    if (val == 0)
+        return FL_Z;
+    if (val >> 15)
+        return FL_N;
+    return FL_P;
+}
+
+/* Branch taken on the condition codes in the mask, after test ebx, ebx */
+static const uint8_t br_jcc[8] = {
+    [FL_P] = 0x8F,                /* jg */
+    [FL_Z] = 0x84,                /* je */
+    [FL_Z | FL_P] = 0x89,         /* jns */
+    [FL_N] = 0x88,                /* js */
+    [FL_N | FL_P] = 0x85,         /* jne */
+    [FL_N | FL_Z] = 0x8E,         /* jle */
+};
+
+/* Translate the block at start, returns its code or NULL if its first instruction must be interpreted */
+static void *jit_compile(lc3_vm *vm, uint16_t start)
+{
+    stub stubs[JIT_BLOCK_MAX + 2];
+    int stub_count = 0;
+    block_chain chains[2];
+    int chain_count = 0;
+    pending_cc cc = {CC_HOST, 0};
+    uint16_t pc = start;
+    int count = 0;
+
+    struct jit *j = vm->jit;
+    if (j->used + JIT_BLOCK_BYTES > JIT_BUF_SIZE)
+        jit_flush(j);
+
+    uint8_t *code = j->buf + j->used;
+    j->p = code;
+
+    /* The whole block is charged up front, the instruction count is filled in at the end */
+    emit8(j, 0x41); /* sub dword [r14 + watch], count */
+    emit8(j, 0x81);
+    emit8(j, 0xAE);
+    emit32(j, offsetof(struct jit, watch));
+    uint8_t *charge = emit_rel32_later(j);
+    stub *entry = emit_stub_jump(j, stubs, &stub_count, 0x88, STUB_EXIT, start, cc); /* js exit */
+    emit8(j, 0x41); /* sub dword [r14 + poll], 1 */
+    emit8(j, 0x83);
+    emit8(j, 0xAE);
+    emit32(j, offsetof(struct jit, poll));
+    emit8(j, 1);
+    emit8(j, 0x0F); /* js exit */
+    emit8(j, 0x88);
+    entry->site[1] = emit_rel32_later(j);
+
+    for (;;)
+    {
+        if (count == JIT_BLOCK_MAX || pc >= JIT_DEVICE_PAGE)
+        {
+            /* Too long, or about to run into the device page: continue in another block */
+            emit_cc(j, cc);
+            emit_chain(j, chains, &chain_count, 0, pc);
+            break;
+        }
+
+        decoded_instr d;
+        int h = decode_instr(vm, pc, &d);
+        uint16_t next_pc = pc + 1;
+        int r1 = host_reg[d.r1];
+        int r2 = host_reg[d.r2];
+        int stop = 0;
+        stub *s;
+
+        /* RTI and accesses to the device page that are known now are left to the interpreter */
+        if (h == H_RTI || ((h == H_LD || h == H_LDI || h == H_ST || h == H_STI) && d.arg >= JIT_DEVICE_PAGE))
+        {
+            if (count == 0)
+                return NULL;
+            emit_exit(j, pc, cc, 0);
+            break;
+        }
+
+        switch (h)
+        {
+        case H_NOP:
+            break;
+        case H_ADD:
+        case H_AND:
+        {
+            uint8_t op = h == H_ADD ? 0x01 : 0x21;
+            if (d.r1 == d.r2)
+            {
+                emit_rr(j, op, r1, host_reg[d.arg]);
+            }
+            else if (d.r1 == d.arg)
+            {
+                emit_rr(j, op, r1, r2);
+            }
+            else
+            {
+                emit_rr(j, 0x89, r1, r2);
+                emit_rr(j, op, r1, host_reg[d.arg]);
+            }
+            cc = (pending_cc){CC_REG, d.r1};
+            break;
+        }
+        case H_ADD_IMM:
+        case H_AND_IMM:
+            if (d.r1 != d.r2)
+                emit_rr(j, 0x89, r1, r2);
+            emit_ri8(j, h == H_ADD_IMM ? 0 : 4, r1, (int8_t)(int16_t)d.arg);
+            cc = (pending_cc){CC_REG, d.r1};
+            break;
+        case H_NOT:
+            if (d.r1 != d.r2)
+                emit_rr(j, 0x89, r1, r2);
+            emit_rex(j, 0, 0, 0, r1); /* not r1 */
+            emit8(j, 0xF7);
+            emit8(j, 0xD0 | (r1 & 7));
+            cc = (pending_cc){CC_REG, d.r1};
+            break;
+        case H_LEA:
+            emit_mov_imm(j, r1, d.arg);
+            cc = (pending_cc){CC_CONST, cc_of(d.arg)};
+            break;
+        case H_LD:
+            emit_load_mem(j, r1, d.arg);
+            cc = (pending_cc){CC_REG, d.r1};
+            break;
+        case H_LDR:
+            emit_rr(j, 0x89, X_ECX, r2);
+            emit_ri8(j, 0, X_ECX, (int8_t)(int16_t)d.arg);
+            emit_extend(j, 0xB7, X_ECX, X_ECX);
+            /* fall through */
+        case H_LDI:
+            if (h == H_LDI)
+                emit_load_mem(j, X_ECX, d.arg);
+            s = emit_device_check(j, stubs, &stub_count, STUB_LOAD, pc, cc);
+            s->r = d.r1;
+            emit_load_ecx(j, r1);
+            s->resume = j->p;
+            cc = (pending_cc){CC_REG, d.r1};
+            break;
+        case H_ST:
+            emit_mov_imm(j, X_ECX, d.arg);
+            emit_store(j, stubs, &stub_count, NULL, d.r1, pc, cc);
+            break;
+        case H_STR:
+            emit_rr(j, 0x89, X_ECX, r2);
+            emit_ri8(j, 0, X_ECX, (int8_t)(int16_t)d.arg);
+            emit_extend(j, 0xB7, X_ECX, X_ECX);
+            s = emit_device_check(j, stubs, &stub_count, STUB_STORE, pc, cc);
+            emit_store(j, stubs, &stub_count, s, d.r1, pc, cc);
+            break;
+        case H_STI:
+            emit_load_mem(j, X_ECX, d.arg);
+            s = emit_device_check(j, stubs, &stub_count, STUB_STORE, pc, cc);
+            emit_store(j, stubs, &stub_count, s, d.r1, pc, cc);
+            break;
+        case H_BR:
+            if (cc.kind == CC_CONST)
+            {
+                /* Decided now */
+                emit_cc(j, cc);
+                emit_chain(j, chains, &chain_count, 0, (cc.val & d.r1) ? d.arg : next_pc);
+            }
+            else
+            {
+                /* Several condition codes set at once, only from the interpreter: let it branch */
+                if (cc.kind == CC_HOST)
+                {
+                    emit8(j, 0x81); /* cmp ebx, 0x10000 */
+                    emit8(j, 0xFB);
+                    emit32(j, 0x10000);
+                    emit_stub_jump(j, stubs, &stub_count, 0x8D, STUB_EXIT, pc, cc); /* jge exit */
+                }
+                emit_cc(j, cc);
+                emit_rr(j, 0x85, X_EBX, X_EBX);
+                emit_chain(j, chains, &chain_count, br_jcc[d.r1], d.arg);
+                emit_chain(j, chains, &chain_count, 0, next_pc);
+            }
+            stop = 1;
+            break;
+        case H_BR_ALWAYS:
+            emit_cc(j, cc);
+            emit_chain(j, chains, &chain_count, 0, d.arg);
+            stop = 1;
+            break;
+        case H_JSR:
+            emit_cc(j, cc);
+            emit_mov_imm(j, host_reg[R_R7], next_pc);
+            emit_chain(j, chains, &chain_count, 0, d.arg);
+            stop = 1;
+            break;
+        case H_JSRR:
+            /* R7 is written before BaseR is read, like the interpreter does */
+            emit_cc(j, cc);
+            emit_mov_imm(j, host_reg[R_R7], next_pc);
+            emit_extend(j, 0xB7, X_EAX, r2);
+            emit_indirect(j);
+            stop = 1;
+            break;
+        case H_JMP:
+            emit_cc(j, cc);
+            emit_extend(j, 0xB7, X_EAX, r2);
+            emit_indirect(j);
+            stop = 1;
+            break;
+        case H_TRAP:
+            emit_cc(j, cc);
+            emit_mov_imm(j, host_reg[R_R7], next_pc);
+            if (vm->trap_mode == LC3_TRAPS_EMULATED)
+            {
+                emit_load_mem(j, X_EAX, d.arg);
+            }
+            else
+            {
+                emit_mov_imm(j, X_ECX, d.arg);
+                emit_call(j, jit_trap);
+                emit8(j, 0xA9); /* test eax, JIT_LEAVE */
+                emit32(j, JIT_LEAVE);
+                emit8(j, 0x0F); /* jnz j->exit_side */
+                emit8(j, 0x85);
+                emit_rel32(j, j->exit_side);
+                /* Native traps return to the next instruction, unless they run the OS routine */
+                emit8(j, 0x3D); /* cmp eax, next_pc */
+                emit32(j, next_pc);
+                emit_chain(j, chains, &chain_count, 0x84, next_pc); /* je next */
+            }
+            emit_indirect(j);
+            stop = 1;
+            break;
+        }
+
+        count++;
+        pc = next_pc;
+        if (stop)
+            break;
+    }
+
+    /* Side exits and calls to the helpers */
+    for (int i = 0; i < stub_count; i++)
+    {
+        stub *s = &stubs[i];
+        for (int k = 0; k < 2; k++)
+        {
+            if (s->site[k])
+                patch_rel32(s->site[k], j->p);
+        }
+
+        if (s->kind == STUB_EXIT)
+        {
+            emit_exit(j, s->pc, s->cc, count - (uint16_t)(s->pc - start));
+            continue;
+        }
+
+        /* The address is in ecx */
+        uint16_t leave_pc = s->pc;
+        if (s->kind == STUB_LOAD)
+        {
+            emit_call(j, jit_load);
+            emit8(j, 0xA9); /* test eax, JIT_LEAVE */
+            emit32(j, JIT_LEAVE);
+        }
+        else
+        {
+            emit_rr(j, 0x89, X_EDX, host_reg[s->r]);
+            emit_call(j, jit_store);
+            emit_rr(j, 0x85, X_EAX, X_EAX);
+            leave_pc++;
+        }
+        emit8(j, 0x75); /* jnz leave */
+        uint8_t *skip = j->p++;
+        if (s->kind == STUB_LOAD)
+            emit_rr(j, 0x89, host_reg[s->r], X_EAX);
+        emit8(j, 0xE9); /* jmp resume */
+        emit_rel32(j, s->resume);
+        *skip = (uint8_t)(j->p - (skip + 1));
+        emit_exit(j, leave_pc, s->cc, count - (uint16_t)(leave_pc - start)); /* leave: */
+    }
+
+    /* Chained exits: return the next block and the jump to patch once it is translated */
+    for (int i = 0; i < chain_count; i++)
+    {
+        patch_rel32(chains[i].site, j->p);
+        emit_mov_imm(j, X_EAX, chains[i].pc);
+        emit8(j, 0x48); /* mov rdx, site */
+        emit8(j, 0xBA);
+        emit64(j, (uint64_t)(uintptr_t)chains[i].site);
+        emit8(j, 0x49); /* mov [r14 + link], rdx */
+        emit8(j, 0x89);
+        emit8(j, 0x96);
+        emit32(j, offsetof(struct jit, link));
+        emit8(j, 0x41); /* mov dword [r14 + at_block], 1 */
+        emit8(j, 0xC7);
+        emit8(j, 0x86);
+        emit32(j, offsetof(struct jit, at_block));
+        emit32(j, 1);
+        emit8(j, 0xE9); /* jmp j->epilogue */
+        emit_rel32(j, j->epilogue);
+    }
+
+    memcpy(charge, &(uint32_t){count}, sizeof(uint32_t));
+
+    /* The block covers start up to the last translated instruction */
+    for (uint16_t a = start; a != pc; a++)
+        j->code_map[a] = 1;
+
+    j->entry[start] = code;
+    j->used = ((j->p - j->buf) + 15) & ~(size_t)15;
+    return code;
+}
+
+void jit_flush(struct jit *j)
+{
+    memset(j->entry, 0, sizeof(j->entry));
+    memset(j->code_map, 0, sizeof(j->code_map));
+    /* Count again, or every block that was ever hot would be translated the next time it runs */
+    memset(j->heat, 0, sizeof(j->heat));
+    j->link = NULL;
+    j->used = j->trampoline_size;
+}
+
+uint16_t jit_execute(lc3_vm *vm, uint16_t pc, long *watch)
+{
+    struct jit *j = vm->jit;
+    jit_enter_fn enter = (jit_enter_fn)(void *)j->enter;
+    void *code = j->entry[pc];
+    j->link = NULL;
+    j->vm = vm;
+    j->reg = vm->reg;
+    j->memory = vm->memory;
+    j->dcache = vm->dcache;
+    j->cc = lazy_result(vm->reg[R_COND]);
+    j->armed = vm->armed;
+    j->poll = j->armed ? vm->poll : INT_MAX;
+    j->watch = watch && *watch < INT_MAX ? (int32_t)*watch : INT_MAX;
+    int32_t budget = j->watch;
+
+    for (;;)
+    {
+        if (!code)
+        {
+            code = jit_compile(vm, pc);
+            if (!code)
+            {
+                /* Try again once the block gets hot again */
+                j->heat[pc] = 0;
+                break;
+            }
+        }
+
+        /* Jump straight from the previous block to this one from now on */
+        if (j->link)
+            patch_rel32(j->link, code);
+
+        pc = enter(j, code);
+
+        if (!j->at_block)
+            break;
+
+        /* Only translate the next block once it is hot, the interpreter runs it meanwhile */
+        code = j->entry[pc];
+        if (!code && ++j->heat[pc] <= JIT_THRESHOLD)
+            break;
+    }
+
+    vm->reg[R_COND] = lazy_cond(j->cc);
+    if (watch)
+        *watch -= budget - j->watch;
+    if (j->armed)
+        vm->poll = j->poll;
+    return pc;
+}
+
+struct jit *jit_create()
+{
+#if defined(__x86_64__)
+    struct jit *j = calloc(1, sizeof(struct jit));
+    if (!j)
+        return NULL;
+
+    j->buf = mmap(NULL, JIT_BUF_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->buf == MAP_FAILED)
+    {
+        free(j);
+        return NULL;
+    }
+
+    j->p = j->buf;
+
+    /* enter(j, code), keeps the stack 16-byte aligned for the helpers */
+    j->enter = j->p;
+    emit8(j, 0x53); /* push rbx */
+    emit8(j, 0x55); /* push rbp */
+    emit8(j, 0x41); /* push r12 */
+    emit8(j, 0x54);
+    emit8(j, 0x41); /* push r13 */
+    emit8(j, 0x55);
+    emit8(j, 0x41); /* push r14 */
+    emit8(j, 0x56);
+    emit8(j, 0x41); /* push r15 */
+    emit8(j, 0x57);
+    emit8(j, 0x48); /* sub rsp, 8 */
+    emit8(j, 0x83);
+    emit8(j, 0xEC);
+    emit8(j, 8);
+    emit8(j, 0x49); /* mov r14, rdi */
+    emit8(j, 0x89);
+    emit8(j, 0xFE);
+    emit8(j, 0x48); /* mov rax, rsi */
+    emit8(j, 0x89);
+    emit8(j, 0xF0);
+    emit_field(j, 1, 0x8B, X_R12, offsetof(struct jit, memory));
+    emit_field(j, 1, 0x8B, 15, offsetof(struct jit, dcache));
+    emit_fill(j, X_EDX);
+    emit8(j, 0xFF); /* jmp rax */
+    emit8(j, 0xE0);
+
+    j->exit_side = j->p;
+    emit8(j, 0x41); /* mov dword [r14 + at_block], 0 */
+    emit8(j, 0xC7);
+    emit8(j, 0x86);
+    emit32(j, offsetof(struct jit, at_block));
+    emit32(j, 0);
+    emit8(j, 0xEB); /* jmp clear_link, over the next instruction */
+    emit8(j, 11);
+
+    j->exit_block = j->p;
+    emit8(j, 0x41); /* mov dword [r14 + at_block], 1 */
+    emit8(j, 0xC7);
+    emit8(j, 0x86);
+    emit32(j, offsetof(struct jit, at_block));
+    emit32(j, 1);
+
+    /* clear_link: */
+    emit8(j, 0x49); /* mov qword [r14 + link], 0 */
+    emit8(j, 0xC7);
+    emit8(j, 0x86);
+    emit32(j, offsetof(struct jit, link));
+    emit32(j, 0);
+
+    j->epilogue = j->p;
+    emit_spill(j, X_EDX);
+    emit8(j, 0x48); /* add rsp, 8 */
+    emit8(j, 0x83);
+    emit8(j, 0xC4);
+    emit8(j, 8);
+    emit8(j, 0x41); /* pop r15 */
+    emit8(j, 0x5F);
+    emit8(j, 0x41); /* pop r14 */
+    emit8(j, 0x5E);
+    emit8(j, 0x41); /* pop r13 */
+    emit8(j, 0x5D);
+    emit8(j, 0x41); /* pop r12 */
+    emit8(j, 0x5C);
+    emit8(j, 0x5D); /* pop rbp */
+    emit8(j, 0x5B); /* pop rbx */
+    emit8(j, 0xC3); /* ret */
+
+    /* call: helper(j, ecx, edx) in rax, the LC-3 registers may change meanwhile */
+    j->call = j->p;
+    emit8(j, 0x50); /* push rax */
+    emit_spill(j, X_EAX);
+    emit8(j, 0x4C); /* mov rdi, r14 */
+    emit8(j, 0x89);
+    emit8(j, 0xF7);
+    emit8(j, 0x89); /* mov esi, ecx */
+    emit8(j, 0xCE);
+    emit8(j, 0xFF); /* call [rsp] */
+    emit8(j, 0x14);
+    emit8(j, 0x24);
+    emit8(j, 0x48); /* add rsp, 8 */
+    emit8(j, 0x83);
+    emit8(j, 0xC4);
+    emit8(j, 8);
+    emit_fill(j, X_EDX);
+    emit_rr(j, 0x89, X_EAX, X_EAX); /* mov eax, eax: the index of emit_indirect */
+    emit8(j, 0xC3); /* ret */
+
+    j->trampoline_size = ((j->p - j->buf) + 15) & ~(size_t)15;
+    jit_flush(j);
+    return j;
+#else
+    return NULL;
+#endif
+}
+
+void jit_destroy(struct jit *j)
+{
+    munmap(j->buf, JIT_BUF_SIZE);
+    free(j);
+}
@@ -0,0 +1,59 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+/* Number of times a block must be entered by the interpreter before it is translated */
+#define JIT_THRESHOLD 50
+
+/* Translated code of one VM. The first members are addressed by the generated code */
+struct jit
+{
+    void *entry[MEMORY_MAX]; /* translated code of the block starting at each address */
+    uint8_t *link;           /* jump to point at the next block, NULL if the exit can't be chained */
+    uint32_t at_block;       /* the returned PC is the start of a block (0 after a side exit) */
+    int32_t poll;            /* vm->poll while translated code runs, every block counts it down */
+    int32_t watch;           /* instructions translated code may still run, every block charges its own */
+    int32_t cc;              /* condition codes in the interpreter's lazy form, while ebx is spilled */
+    uint16_t *reg;           /* vm->reg, where the host registers are spilled and filled */
+    uint16_t *memory;        /* vm->memory */
+    decoded_instr *dcache;   /* vm->dcache */
+    lc3_vm *vm;              /* VM whose code runs, for the helpers called from translated code */
+    int armed;               /* vm->armed, polling starts when a helper arms it */
+
+    /* How many times each address has been entered as the start of a basic block */
+    uint16_t heat[MEMORY_MAX];
+
+    /* Set for every memory location that is part of a translated block */
+    uint8_t code_map[MEMORY_MAX];
+
+    uint8_t *buf;       /* code buffer, starts with the trampoline */
+    size_t used;        /* bytes of the code buffer in use */
+    size_t trampoline_size;
+    uint8_t *enter;      /* saves host registers, fills the LC-3 registers and jumps to a block */
+    uint8_t *exit_side;  /* return to the interpreter at the instruction in eax */
+    uint8_t *exit_block; /* return the block start in eax, no translation found */
+    uint8_t *epilogue;   /* spill the LC-3 registers, restore host registers and return eax */
+    uint8_t *call;       /* call the helper in rax with ecx and edx, around a spill and a fill */
+
+    /* Emitter state while a block is translated */
+    uint8_t *p; /* emit position */
+};
+
+/* Allocate the code buffer. Returns NULL if the JIT is unavailable on this host */
+struct jit *jit_create();
+void jit_destroy(struct jit *j);
+
+/*
+    Run translated code starting at the block at pc, returns the PC the interpreter resumes
+    at. With watch, the instructions run are charged to it and no block starts once it runs out
+*/
+uint16_t jit_execute(lc3_vm *vm, uint16_t pc, long *watch);
+
+/* Throw away every translated block, e.g. because the program stored over its own code */
+void jit_flush(struct jit *j);
+
+#endif
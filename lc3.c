@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
+#include <time.h>
 /* unix specific */
 #include <unistd.h>
 #include <fcntl.h>
@@ -10,116 +12,12 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/termios.h>
-#include <sys/mman.h>
-
-#define FLAG_COUNT 3
-#define TRAP_VECT_SZ 6
-#define TRAP_GETC_SZ 9
-#define TRAP_OUT_SZ 10
-#define TRAP_PUTS_SZ 20
-#define TRAP_IN_SZ 8
-#define TRAP_PUTSP_SZ 36
-#define TRAP_HALT_SZ 23
-
-/* The LC-3 has 65,536 available memory locations */
-uint16_t memory[UINT16_MAX];
-
-/* The LC-3 has 8 general purpose registers, 1 Program Counter, 1 Condition Flag */
-enum registers
-{
-    R_R0 = 0, /* 8 GENERAL PURPOSE REGISTERS*/
-    R_R1,
-    R_R2,
-    R_R3,
-    R_R4,
-    R_R5,
-    R_R6,
-    R_R7,
-    R_PC,   /* PROGRAM COUNTER (PC) */
-    R_COND, /* CONDITION FLAG */
-    R_PSR,
-    R_SSP,   /* SUPERVISOR STACK POINTER */
-    R_USP,   /* USER STACK POINTER */
-    R_COUNT, /* NUMBER OF TOTAL REGISTERS */
-};
-
-uint16_t reg[R_COUNT];
-
-/* The LC-3 has 16 different instructions */
-enum instruction_set
-{
-    OP_BR = 0,
-    OP_ADD,      /* OPCODE ADD*/
-    OP_LD,       /* LOAD */
-    OP_ST,       /* STORE */
-    OP_JSR,      /* JUMP SUB-ROUTINE */
-    OP_AND,      /* AND */
-    OP_LDR,      /* LOAD (PC-RELATIVE) */
-    OP_STR,      /* STORE (PC-RELATIVE) */
-    OP_RTI,      /* RETURN */
-    OP_NOT,      /* NOT */
-    OP_LDI,      /* LOAD INDIRECT */
-    OP_STI,      /* STORE INDIRECT */
-    OP_JMP,      /* JUMP */
-    OP_RESERVED, /* RESERVED INSTRUCTION*/
-    OP_LEA,      /* LOAD EFFECTIVE ADDRESS*/
-    OP_TRAP,     /* TRAP */
-};
-
-/* Conditional Flags */
-enum FLAGS
-{
-    FL_P = 1 << 0, /* Positive */
-    FL_Z = 1 << 1, /* Zero */
-    FL_N = 1 << 2, /* Negative */
-};
 
-/* TRAP Codes */
-enum
-{
-    TRAP_GETC = 0x20,  /* get character from keyboard, not echoed onto the terminal */
-    TRAP_OUT = 0x21,   /* output a character */
-    TRAP_PUTS = 0x22,  /* output a word string */
-    TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
-    TRAP_PUTSP = 0x24, /* output a byte string */
-    TRAP_HALT = 0x25   /* halt the program */
-};
-
-uint16_t flags[FLAG_COUNT];
-
-/* Memory Mapped registers */
-enum
-{
-    MR_KBSR = 0xFE00, /* keyboard status */
-    MR_KBDR = 0xFE02, /* keyboard data */
-    MR_DSR = 0xFE04,  /* display status */
-    MR_DDR = 0xFE06,  /* display data*/
-    MR_MCR = 0xFFFE   /* machine control*/
-};
-
-/* Print registers (Debugging )*/
-void print_registers()
-{
-    printf("PC: %x PSR: %x CC: %x\nR0: %x, R1 : %x, R2: %x, R3: %x\nR4 : %x, R5 : %x, R6 : %x, R7 : %x\n", reg[R_PC], reg[R_PSR], reg[R_COND], reg[R_R0], reg[R_R1], reg[R_R2], reg[R_R3], reg[R_R4], reg[R_R5], reg[R_R6], reg[R_R7]);
-}
-
-/* UNIX specific keyboard check */
-uint16_t check_key()
-{
-    fd_set readfds;
-    /*FD_ZERO(&fdset) initializes a descriptor set fdset to the null set.*/
-    FD_ZERO(&readfds);
-    /* FD_SET(fd, &fdset) : Include a particular descriptor fd in fdset (readfds) */
-    FD_SET(STDIN_FILENO, &readfds); /* include STDIN_FILENO in the readfds fd set */
-
-    /* maximum interval to wait for the below selection to complete */
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-
-    /* select call returns 1 if the readfds is ready for reading */
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
-}
+#include "lc3.h"
+#include "console.h"
+#include "batch.h"
+#include "server.h"
+#include "gdb.h"
 
 /* This is Unix specific code for setting up terminal input. */
 struct termios original_tio;
@@ -137,624 +35,430 @@ void restore_input_buffering()
     tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
 }
 
-/* Called when the user types in the 'interrupt' character */
-void handle_interrupt(int signal)
-{
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
-}
+/* Console output is written in chunks of this size at most */
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
 
-/* Swaps the bits of an input unsigned 16 bit integer */
-uint16_t swap16(uint16_t x)
-{
-    return (x << 8) | (x >> 8);
-}
+/* Instructions run between checks whether the program waits for input yet */
+#define SNAPSHOT_QUANTUM 100000
 
-/* Read image file and place instructions in the LC-3 VM memory*/
-void read_image_file(FILE *f)
-{
-    /* Origin informs us where in memory to place the image */
-    uint16_t orig;
-    fread(&orig, sizeof(orig), 1, f);
-    orig = swap16(orig);
+/* Instructions --save-snapshot runs at most without --max-instructions */
+#define SNAPSHOT_BUDGET 1000000000UL
 
-    /* Set PC equal to origin */
-    reg[R_PC] = orig;
+/* Default for how long output may sit in the buffer when stdout is a terminal */
+#define TERMINAL_LATENCY_MS 20
 
-    uint16_t max_read = UINT16_MAX - orig;
-    /* Declare pointer to current memory location to write */
-    uint16_t *p = memory + orig;
-    size_t read = fread(p, sizeof(uint16_t), max_read, f);
+/* Flushes stdout periodically, so output of a program that is busy computing still shows up */
+void *flush_output(void *arg)
+{
+    long ms = (long)arg;
+    struct timespec period = {ms / 1000, (ms % 1000) * 1000000};
 
-    /* While there are bytes to write to memory */
-    while (read-- > 0)
+    for (;;)
     {
-        /* The LC-3 uses big endian to interpret the instructions, 
-            however most modern computers are little endian. 
-            Therefore, it is necessary to swap the bits
-        */
-        *p = swap16(*p);
-        ++p;
+        nanosleep(&period, NULL);
+        fflush(stdout);
     }
+    return NULL;
 }
 
-/* Read image file into the LC-3 VM memory. Returns 1 on success, 0 otherwise */
-int read_image(char *file)
-{
-    /* Open the file with read binary permission */
-    FILE *f = fopen(file, "rb");
-
-    if (!f)
-        return 0;
+/* Machine and output path of --profile, the profile is written even if the program is interrupted */
+lc3_vm *profiled_vm;
+const char *profile_path;
 
-    read_image_file(f);
+void write_profile()
+{
+    char folded[4096];
+    snprintf(folded, sizeof(folded), "%s.folded", profile_path);
+    if (!lc3_write_profile(profiled_vm, profile_path, folded))
+        fprintf(stderr, "failed to write profile: %s\n", profile_path);
+}
 
-    fclose(f);
+/* Machine being traced by --trace */
+lc3_vm *traced_vm;
 
-    return 1;
+/* Where a program that ran into --max-instructions or --timeout was */
+void dump_state(lc3_vm *vm)
+{
+    uint16_t pc = lc3_get_reg(vm, R_PC);
+    uint16_t cond = lc3_get_reg(vm, R_COND);
+    fprintf(stderr, "PC x%04X", pc);
+    /* Reading a device register would change it */
+    if (pc < MR_KBSR)
+        fprintf(stderr, " (x%04X)", lc3_read(vm, pc));
+    fprintf(stderr, "  PSR x%04X  CC %s\n", lc3_get_reg(vm, R_PSR), cond & 4 ? "N" : cond & 2 ? "Z" : "P");
+    for (int r = R_R0; r <= R_R7; r++)
+        fprintf(stderr, "R%d x%04X%s", r, lc3_get_reg(vm, r), r == R_R7 ? "\n" : "  ");
 }
 
-uint16_t sign_extend(uint16_t n, int bit_count)
+uint64_t now_ms()
 {
-    /* If the most significant bit is set to 1, set the all bits to the left*/
-    if ((n >> (bit_count - 1)) & 1)
-        n |= (0xFFFF << bit_count);
-    return n;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-uint16_t mem_read(uint16_t addr)
+/* The console, noting when the program has read the end of input */
+int input_ended;
+
+int read_key(void *ctx)
 {
-    if (addr == MR_KBSR)
-    {
-        /* check if stdin has a key ready to be read */
-        if (check_key())
-        {
-            /* The ready bit (bit [15]) indicates if the keyboard has received a new character. */
-            memory[MR_KBSR] = (1 << 15);
-            /* Place the character in the KeyBoard Data Register */
-            memory[MR_KBDR] = getchar();
-        }
-        else
-        {
-            memory[MR_KBSR] = 0;
-        }
-    }
-    return memory[addr];
+    int key = stdio_io.read_key(ctx);
+    input_ended |= key < 0;
+    return key;
 }
 
-/* Memory Access */
-void mem_write(uint16_t address, uint16_t val)
+/* Called when the user types in the 'interrupt' character */
+void handle_interrupt(int signal)
 {
-    memory[address] = val;
-    
-    /*A character written in the low byte of the device data register will be displayed on the screen.*/
-    if (address == MR_DDR)
-    {
-        putc((char)val, stdout);
-        fflush(stdout);
-    }
+    restore_input_buffering();
+    printf("\n");
+    if (profile_path)
+        write_profile();
+    if (traced_vm && !lc3_stop_trace(traced_vm))
+        fprintf(stderr, "failed to write trace\n");
+    exit(-2);
 }
 
-/* Load LC3 OS */
-void load_lc3_os()
+int main(int argc, char **argv)
 {
-    uint16_t trap_vector_table_entries[TRAP_VECT_SZ] = {0x0020, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025};
-    uint16_t trap_vector_table_values[TRAP_VECT_SZ] = {0x0400, 0x0430, 0x0450, 0x04A0, 0x04E0, 0xFD70};
-
-    uint16_t trap_getc_entries[TRAP_GETC_SZ] = {0x0400, 0x0401, 0x0402, 0x0403, 0x0404, 0x0405, 0x0406, 0x0407, 0x0408};
-    uint16_t trap_getc_values[TRAP_GETC_SZ] = {0x3E07, 0xA004, 0x07FE, 0xA003, 0x2E03, 0xC1C0, 0xFE00, 0xFE02, 0x3003};
-
-    uint16_t trap_out_entries[TRAP_OUT_SZ] = {0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437, 0x0438, 0x0439};
-    uint16_t trap_out_values[TRAP_OUT_SZ] = {0x3E0A, 0x3208, 0xA205, 0x07FE, 0xB004, 0x2204, 0x2E04, 0xC1C0, 0xFE04, 0xFE06};
-
-    uint16_t trap_puts_entries[TRAP_PUTS_SZ] = {0x0450, 0x0451, 0x0452, 0x0453, 0x0454, 0x0455, 0x0456, 0x0457, 0x0458, 0x0459, 0x045A, 0x045B, 0x045C, 0x045D, 0x045E, 0x045F, 0x0460, 0x0461, 0x0462, 0x0463};
-    uint16_t trap_puts_values[TRAP_PUTS_SZ] = {0x3E16, 0x3012, 0x3212, 0x3412, 0x6200, 0x0405, 0xA409, 0x07FE, 0xB208, 0x1021, 0x0FF9, 0x2008, 0x2208, 0x2408, 0x2E08, 0xC1C0, 0xFE04, 0xFE06, 0xF3FD, 0xF3FE};
-
-    uint16_t trap_in_entries[TRAP_IN_SZ] = {0x04A0, 0x04A1, 0x04A2, 0x04A3, 0x04A4, 0x04A5, 0x04A6, 0x04A7};
-    uint16_t trap_in_values[TRAP_IN_SZ] = {0x3E06, 0xE006, 0xF022, 0xF020, 0xF021, 0x2E01, 0xC1C0, 0x3001};
-
-    uint16_t trap_putsp_entries[TRAP_PUTSP_SZ] = {0x04E0, 0x04E1, 0x04E2, 0x04E3, 0x04E4, 0x04E5, 0x04E6, 0x04E7, 0x04E8, 0x04E9, 0x04EA, 0x04EB, 0x04EC, 0x04ED, 0x04EE, 0x04EF, 0x04F0, 0x04F1, 0x04F2, 0x04F3, 0x04F4, 0x04F5, 0x04F6, 0x04F7, 0x04F8, 0x04F9, 0x04FA, 0x04FB, 0x04FC, 0x04FD, 0x04FE, 0x04FF, 0x0500, 0x0501, 0x0502, 0x0503};
-    uint16_t trap_putsp_values[TRAP_PUTSP_SZ] = {0x3E27, 0x3022, 0x3222, 0x3422, 0x3622, 0x1220, 0x6040, 0x0406, 0x480D, 0x2418, 0x5002, 0x0402, 0x1261, 0x0FF8, 0x2014, 0x4806, 0x2013, 0x2213, 0x2413, 0x2613, 0x2E13, 0xC1C0, 0x3E06, 0xA607, 0x0801, 0x0FFC, 0xB003, 0x2E01, 0xC1C0, 0xFE06, 0xFE04, 0xF3FD, 0xF3FE, 0xFF00};
-
-    uint16_t trap_halt_entries[TRAP_HALT_SZ] = {0xFD00, 0xFD01, 0xFD02, 0xFD03, 0xFD04, 0xFD05, 0xFD06, 0xFD07, 0xFD08, 0xFD09, 0xFD70, 0xFD71, 0xFD72, 0xFD73, 0xFD74, 0xFD75, 0xFD76, 0xFD77, 0xFD78, 0xFD79, 0xFD7A, 0xFD7B, 0xFD7C};
-    uint16_t trap_halt_values[TRAP_HALT_SZ] = {0x3E3E, 0x303C, 0x2007, 0xF021, 0xE006, 0xF022, 0xF025, 0x2036, 0x2E36, 0xC1C0, 0x3E0E, 0x320C, 0x300A, 0xE00C, 0xF022, 0xA22F, 0x202F, 0x5040, 0xB02C, 0x2003, 0x2203, 0x2E03, 0xC1C0};
-
-    /* Write trap vector to memory */
-    for (int i = 0; i < TRAP_VECT_SZ; i++)
+    int use_jit = 0;
+    int trap_mode = LC3_TRAPS_EMULATED;
+    int restored = 0;
+    const char *save_path = NULL;
+    const char *rom_path = NULL;
+    const char *batch_path = NULL;
+    const char *serve_path = NULL;
+    const char *gdb_addr = NULL;
+    long history_mb = 0;
+    const char *trace_path = NULL;
+    const char *record_path = NULL;
+    const char *disk_path = NULL;
+    long fps = -1;
+    unsigned long max_instructions = 0, max_ms = 0;
+    const char *replay_path = NULL;
+    int workers = 0;
+    long latency_ms = isatty(STDOUT_FILENO) ? TERMINAL_LATENCY_MS : 0;
+    int images = 0;
+
+    /* Create the machine, this loads the Operating System */
+    lc3_io io = stdio_io;
+    io.read_key = read_key;
+    lc3_vm *vm = lc3_create(&io);
+    if (!vm)
     {
-        mem_write(trap_vector_table_entries[i], trap_vector_table_values[i]);
+        printf("out of memory\n");
+        exit(1);
     }
 
-    for (int i = 0; i < TRAP_GETC_SZ; i++)
+    /* Load the obj files into memory */
+    for (int j = 1; j < argc; ++j)
     {
-        mem_write(trap_getc_entries[i], trap_getc_values[i]);
-    }
+        if (strcmp(argv[j], "--jit") == 0)
+        {
+            use_jit = 1;
+            continue;
+        }
+        if (strcmp(argv[j], "--native-traps") == 0)
+        {
+            trap_mode = LC3_TRAPS_NATIVE;
+            continue;
+        }
+        if (strcmp(argv[j], "--check-traps") == 0)
+        {
+            trap_mode = LC3_TRAPS_CHECK;
+            continue;
+        }
+        if (strcmp(argv[j], "--profile") == 0 && j + 1 < argc)
+        {
+            profile_path = argv[++j];
+            continue;
+        }
+        if (strcmp(argv[j], "--trace") == 0 && j + 1 < argc)
+        {
+            trace_path = argv[++j];
+            continue;
+        }
+        if (strcmp(argv[j], "--record") == 0 && j + 1 < argc)
+        {
+            record_path = argv[++j];
+            continue;
+        }
+        if (strcmp(argv[j], "--replay") == 0 && j + 1 < argc)
+        {
+            replay_path = argv[++j];
+            continue;
+        }
+        if (strcmp(argv[j], "--disk") == 0 && j + 1 < argc)
+        {
+            disk_path = argv[++j];
+            continue;
+        }
+        if (strcmp(argv[j], "--framebuffer") == 0 && j + 1 < argc)
+        {
+            fps = atol(argv[++j]);
+            continue;
+        }
+        if (strcmp(argv[j], "--max-instructions") == 0 && j + 1 < argc)
+        {
+            max_instructions = strtoul(argv[++j], NULL, 0);
+            continue;
+        }
+        if (strcmp(argv[j], "--timeout") == 0 && j + 1 < argc)
+        {
+            max_ms = strtoul(argv[++j], NULL, 0);
+            continue;
+        }
+        if (strcmp(argv[j], "--output-latency") == 0 && j + 1 < argc)
+        {
+            latency_ms = atol(argv[++j]);
+            continue;
+        }
+        if (strcmp(argv[j], "--rom") == 0 && j + 1 < argc)
+        {
+            /* Replaces all of memory, so it has to come before the images */
+            ++j;
+            if (images > 0 || restored || !lc3_load_rom(vm, argv[j]))
+            {
+                printf("failed to load ROM: %s\n", argv[j]);
+                exit(1);
+            }
+            rom_path = argv[j];
+            continue;
+        }
+        if (strcmp(argv[j], "--batch") == 0 && j + 1 < argc)
+        {
+            batch_path = argv[++j];
+            continue;
+        }
+        if (strcmp(argv[j], "--serve") == 0 && j + 1 < argc)
+        {
+            serve_path = argv[++j];
+            continue;
+        }
+        if (strcmp(argv[j], "--gdb") == 0 && j + 1 < argc)
+        {
+            gdb_addr = argv[++j];
+            continue;
+        }
+        if (strcmp(argv[j], "--history") == 0 && j + 1 < argc)
+        {
+            history_mb = atol(argv[++j]);
+            continue;
+        }
+        if (strcmp(argv[j], "--jobs") == 0 && j + 1 < argc)
+        {
+            workers = atoi(argv[++j]);
+            continue;
+        }
+        if (strcmp(argv[j], "--save-snapshot") == 0 && j + 1 < argc)
+        {
+            save_path = argv[++j];
+            continue;
+        }
+        if (strcmp(argv[j], "--snapshot") == 0 && j + 1 < argc)
+        {
+            lc3_snapshot *snap = lc3_snapshot_open(argv[++j]);
+            if (!snap || !lc3_restore(vm, snap))
+            {
+                printf("failed to restore snapshot: %s\n", argv[j]);
+                exit(1);
+            }
+            lc3_snapshot_close(snap);
+            restored = 1;
+            continue;
+        }
 
-    for (int i = 0; i < TRAP_OUT_SZ; i++)
-    {
-        mem_write(trap_out_entries[i], trap_out_values[i]);
+        if (!lc3_load_image(vm, argv[j]))
+        {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+        images++;
     }
 
-    for (int i = 0; i < TRAP_PUTS_SZ; i++)
+    /* Headless: every job gets its own VM and console, the terminal is left alone */
+    if (batch_path)
     {
-        mem_write(trap_puts_entries[i], trap_puts_values[i]);
+        batch_options opt = {trap_mode, workers, rom_path, max_ms};
+        lc3_destroy(vm);
+        return run_batch(batch_path, &opt);
     }
 
-    for (int i = 0; i < TRAP_IN_SZ; i++)
+    if (images == 0 && !restored)
     {
-        mem_write(trap_in_entries[i], trap_in_values[i]);
+        /* Hassle user */
+        printf("lc3 [--jit] [--native-traps | --check-traps] [--output-latency ms] [--max-instructions n] [--timeout ms] [--profile file] [--trace file] [--record file | --replay file] [--disk file] [--framebuffer fps] [--rom file] [--snapshot file] [--save-snapshot file] [--gdb [host]:port [--history mb]] <image-file> \n");
+        printf("lc3 --batch manifest [--jobs n] [--timeout ms] [--native-traps | --check-traps] [--rom file]\n");
+        printf("lc3 --serve socket [--jobs n] [--native-traps | --check-traps] [--rom file] [--snapshot file] <image-file>\n");
+        exit(2);
     }
 
-    for (int i = 0; i < TRAP_PUTSP_SZ; i++)
+    /* Every connection gets a clone of the machine as loaded, the terminal is left alone */
+    if (serve_path)
     {
-        mem_write(trap_putsp_entries[i], trap_putsp_values[i]);
+        server_options opt = {trap_mode, workers};
+        if (!restored)
+            lc3_set_reg(vm, R_PC, PC_START);
+        return run_server(serve_path, vm, &opt);
     }
 
-    for (int i = 0; i < TRAP_HALT_SZ; i++)
+    if (use_jit && !lc3_enable_jit(vm))
     {
-        mem_write(trap_halt_entries[i], trap_halt_values[i]);
+        printf("the JIT is not available on this host\n");
+        exit(1);
     }
 
-    /* the "halting the processor" message goes here */
-    mem_write(0xFDA5, 0xFFFE);
-    mem_write(0xFDA6, 0x7FFF);
-    // Display status register
-    mem_write(0xFE04, 0x8000);
-    // Machine control register
-    mem_write(0xFFFE, 0xFFFF);
-
-    // Fill in bad TRAPs
-    for (int i = 0; i < 0xFF; i++)
+    /* Replay counts instructions with lc3_step, nothing else may hook into the interpreter */
+    if ((record_path || replay_path) && (profile_path || trace_path || (record_path && replay_path)))
     {
-        if (!mem_read(i))
-        {
-            mem_write(i, 0xFD00);
-        }
+        printf("--record and --replay can't be combined with each other, --profile or --trace\n");
+        exit(2);
     }
 
-    // Fill in input prompt
-    char *inputPrompt = "Input a character> \0";
-    int i = 0;
-
-    for (char *p = inputPrompt; *p != '\0'; p++)
+    if ((max_instructions || max_ms) && (profile_path || trace_path))
     {
-        mem_write(0x04A8 + i, *p);
-        i++;
+        printf("--max-instructions and --timeout can't be combined with --profile or --trace\n");
+        exit(2);
     }
 
-    i = 0;
-
-    // Fill in halt message
-    char *haltMessage = "\n----- Halting the processor ----- \n\0";
-    for (char *p = haltMessage; *p != '\0'; p++)
+    /* The debugger runs the program in slices of its own */
+    if (gdb_addr && (max_instructions || max_ms || profile_path || trace_path))
     {
-        mem_write(0xFD80 + i, *p);
-        i++;
+        printf("--gdb can't be combined with --max-instructions, --timeout, --profile or --trace\n");
+        exit(2);
     }
-}
 
-/* Print a section of memory */
-void print_mem(uint16_t start, uint16_t end)
-{
-    for (int i = start; i <= end; i++)
+    /* Only the debugger can go back */
+    if (history_mb && (!gdb_addr || history_mb < 0 || record_path || replay_path))
     {
-        printf("%x : %x\n", i, mem_read(i));
+        printf("--history needs --gdb and a size in MiB, and can't be combined with --record or --replay\n");
+        exit(2);
     }
-}
 
-/* Update Flags given the register */
-void update_flags(uint16_t r)
-{
-    if (reg[r] == 0)
+    lc3_set_trap_mode(vm, trap_mode);
+
+    if (!lc3_attach_timer(vm))
     {
-        reg[R_COND] = FL_Z;
+        printf("out of memory\n");
+        exit(1);
     }
-    else if (reg[r] >> 15) /* a 1 in the left-most bit indicates negative */
+    if (disk_path && !lc3_attach_disk(vm, disk_path))
     {
-        reg[R_COND] = FL_N;
+        printf("failed to open disk: %s\n", disk_path);
+        exit(1);
     }
-    else
+    if (fps >= 0 && !lc3_attach_framebuffer(vm, STDOUT_FILENO, fps))
     {
-        reg[R_COND] = FL_P;
+        printf("failed to start the framebuffer\n");
+        exit(1);
     }
-}
 
-/* Keep the CPU Running */
-int running;
+    /* Setup */
+    signal(SIGINT, handle_interrupt); /* handle the interrupt signal by calling the handle_interrupt function*/
+    disable_input_buffering();
 
-/* Handle Trap System Call */
-void trap(uint16_t trap_vect)
-{
-    switch (trap_vect)
-    {
-    case TRAP_GETC:
-    {
-        /* Read a single character from the keyboard. The character is not echoed onto the
-console. Its ASCII code is copied into RO. The high eight bits of RO are cleared. 
-        */
-        reg[R_R0] = (uint16_t)getchar();
-    }
-    break;
-    case TRAP_HALT:
-    {
-        /* Halt execution and print a message on the console. */
-        puts("HALT");
-        fflush(stdout);
-        mem_write(MR_MCR, 0);
-    }
-    break;
-    case TRAP_IN:
-    {
-        /*
-            Print a prompt on the screen and read a single character from the keyboard. The
-character is echoed onto the console monitor, and its ASCII code is copied into RO.
-The high eight bits of RO are cleared.
-        */
-        printf("Enter a character: ");
-        reg[R_R0] = (uint16_t)getchar();
-        putc((char)reg[R_R0], stdout);
-    }
-    break;
-    case TRAP_OUT:
+    /*
+        Output is flushed when the program polls the keyboard, when it halts, once the
+        buffer is full, and every latency_ms if that is not 0.
+    */
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    pthread_t flusher;
+    if (latency_ms > 0)
+        pthread_create(&flusher, NULL, flush_output, (void *)latency_ms);
+
+    /* Programs start at PC_START whatever their origin, a snapshot continues where it was taken */
+    if (!restored)
+        lc3_set_reg(vm, R_PC, PC_START);
+
+    if (save_path)
     {
         /*
-            Write a character in R0[7:0] to the console display.
+            Run the program's initialisation, until it first waits for a key or halts. A
+            program reading past the end of its input never waits, and one may never stop
+            computing: --max-instructions (SNAPSHOT_BUDGET by default) and --timeout end it too
         */
-        putc((char)reg[R_R0], stdout);
-        fflush(stdout);
+        unsigned long begin = lc3_retired(vm);
+        unsigned long budget = max_instructions ? max_instructions : SNAPSHOT_BUDGET;
+        uint64_t deadline = max_ms ? now_ms() + max_ms : 0;
+        while (lc3_step(vm, SNAPSHOT_QUANTUM) && !lc3_idle(vm) && !input_ended &&
+               lc3_retired(vm) - begin < budget && !(deadline && now_ms() >= deadline))
+            ;
+        if (!lc3_save_snapshot(vm, save_path))
+            fprintf(stderr, "failed to save snapshot: %s\n", save_path);
     }
-    break;
-    case TRAP_PUTS:
-    {
-        /*
-            Write a string of ASCII characters to the console display. The characters are contained
-            in consecutive memory locations, one character per memory location, starting with
-            the address specified in RO. Writing terminates with the occurrence of xOOOO in a
-            memory location.
-        */
 
-        uint16_t *ptr = memory + reg[R_R0];
-        while (*ptr)
+    if (profile_path)
+    {
+        if (!lc3_enable_profile(vm))
         {
-            putc((char)*ptr, stdout);
-            ptr++;
+            printf("out of memory\n");
+            exit(1);
         }
-        fflush(stdout);
+        profiled_vm = vm;
     }
-    break;
-    case TRAP_PUTSP:
-    {
-        /*
-            Write a string of ASCII characters to the console. The characters are contained in
-            consecutive memory locations, two characters per memory location, starting with the
-            address specified in RO. The ASCII code contained in bits [7:0] of a memory location
-            is written to the console first. Then the ASCII code contained in bits [15:8] of that
-            memory location is written to the console. (A character string consisting of an odd
-            number of characters to be written will have xOO in bits [15:8J of the memory
-            location containing the last character to be written.) Writing terminates with the
-            occurrence of xOOOO in a memory location.
-        */
-
-        uint16_t *ptr = memory + reg[R_R0];
 
-        while (*ptr)
+    if (trace_path)
+    {
+        if (!lc3_start_trace(vm, trace_path))
         {
-            uint16_t start_c = (*ptr) & 0x00FF;
-            uint16_t end_c = *ptr >> 8;
-            putc((char)start_c, stdout);
-            if (!end_c)
-                break;
-            putc((char)end_c, stdout);
-            ptr++;
+            printf("failed to create trace: %s\n", trace_path);
+            exit(1);
         }
-        fflush(stdout);
+        traced_vm = vm;
     }
-    break;
 
-    default:
-        break;
+    /* Recorded keys are written as they are read, an interrupted recording is complete */
+    if (record_path && !lc3_record_input(vm, record_path))
+    {
+        printf("failed to create input log: %s\n", record_path);
+        exit(1);
     }
-}
-
-int main(int argc, char **argv)
-{
-    if (argc < 2)
+    if (replay_path && !lc3_replay_input(vm, replay_path))
     {
-        /* Hassle user */
-        printf("lc3 <image-file> \n");
-        exit(2);
+        printf("failed to read input log: %s\n", replay_path);
+        exit(1);
     }
 
-    /* Load the Operating System */
-    load_lc3_os();
-
-    /* Load the obj files into memory */
-    for (int j = 1; j < argc; ++j)
+    /* Recorded from the first instruction the debugger sees */
+    if (history_mb && !lc3_enable_history(vm, (size_t)history_mb << 20, 0))
     {
-        if (!read_image(argv[j]))
-        {
-            printf("failed to load image: %s\n", argv[j]);
-            exit(1);
-        }
+        printf("out of memory\n");
+        exit(1);
     }
 
-    /* Setup */
-    signal(SIGINT, handle_interrupt); /* handle the interrupt signal by calling the handle_interrupt function*/
-    disable_input_buffering();
-
-    /* By default the starting address for the LC-3 is 0x3000 */
-    uint16_t PC_START = 0x3000;
-    reg[R_PC] = PC_START;
-
-    /* PSR set initially to x8002*/
-    reg[R_PSR] = 0x8002;
-
-    running = 1;
-
-    /* While the Machine Control Register bit 15 is set */
-    while (mem_read(MR_MCR) & 1 << 15)
+    lc3_set_limits(vm, max_instructions, max_ms);
+    unsigned long start = lc3_retired(vm);
+    if (!gdb_addr)
+        lc3_run(vm);
+    else if (!run_gdb(gdb_addr, vm))
     {
-       /* Fetch the instruction from memory and increment PC */
-        uint16_t instr = mem_read(reg[R_PC]++);
-        uint16_t op_code = instr >> 12;
-
-        switch (op_code)
-        {
-        case OP_BR:
-        {
-            /*
-                The condition codes specified by the state of bits [11:9] are tested. If bit [11] is
-                set, N is tested; if bit [11] is clear, N is not tested. If bit [10] is set, Z is tested, etc.
-                If any of the condition codes tested is set, the program branches to the location
-                specified by adding the sign-extended PCoffset9 field to the incremented PC.
-            */
-            uint16_t cond_flag = (instr >> 9) & 0x7;
-            if (cond_flag & reg[R_COND])
-            {
-                reg[R_PC] += sign_extend(instr & 0x1FF, 9);
-            }
-        }
-        break;
-        case OP_ADD:
-        {
-            /*
-                If bit [5] is 0, the second source operand is obtained from SR2. If bit [5] is 1, the
-                second source operand is obtained by sign-extending the imm5 field to 16 bits.
-                In both cases, the second source operand is added to the contents of SRI and the
-                result stored in DR. The condition codes are set, based on whether the result is
-                negative, zero, or positive.
-            */
-            uint16_t R_DR = (instr >> 9) & 0x7;
-            uint16_t R_SR1 = (instr >> 6) & 0x7;
-            /* are we in immediate mode? */
-            uint16_t imm_flag = (instr >> 5) & 0x1;
-
-            if (imm_flag)
-            {
-                reg[R_DR] = reg[R_SR1] + sign_extend(instr & 0x01F, 5);
-            }
-            else
-            {
-                reg[R_DR] = reg[R_SR1] + reg[instr & 0x7];
-            }
-
-            update_flags(R_DR);
-        }
-        break;
-        case OP_LD:
-        {
-            /* 
-                An address is computed by sign-extending bits [8:0] to 16 bits and adding this
-                value to the incremented PC. The contents of memory at this address are loaded
-                into DR. The condition codes are set, based on whether the value loaded is
-                negative, zero, or positive. 
-            */
-            uint16_t R_DEST = (instr >> 9) & 0x7;
-            uint16_t PC_OFFSET = sign_extend(instr & 0x1FF, 9);
-            reg[R_DEST] = mem_read(reg[R_PC] + PC_OFFSET);
-            update_flags(R_DEST);
-        }
-        break;
-        case OP_ST:
-        {
-            /*  
-                The contents of the register specified by SR are stored in the memory location
-                whose address is computed by sign-extending bits [8:0] to 16 bits and adding this
-                value to the incremented PC.
-            */
-            uint16_t R_SR = (instr >> 9) & 0x7;
-            uint16_t PC_OFFSET = sign_extend(0x1FF & instr, 9);
-            mem_write(reg[R_PC] + PC_OFFSET, reg[R_SR]);
-        }
-        break;
-        case OP_JSR:
-        {
-            uint16_t pc_off_flag = (instr >> 11) & 1;
-            reg[R_R7] = reg[R_PC];
-
-            if (pc_off_flag)
-            {
-                /* JSR */
-                reg[R_PC] += sign_extend(0x7FF & instr, 11);
-            }
-            else
-            {
-                /* JSRR */
-                reg[R_PC] = reg[(instr >> 6) & 0x7];
-            }
-            break;
-        }
-        break;
-        case OP_AND:
-        {
-            uint16_t R_DR = (instr >> 9) & 0x7;
-            uint16_t R_SR1 = (instr >> 6) & 0x7;
-            /* are we in immediate mode? */
-            uint16_t imm_flag = (instr >> 5) & 0x1;
-
-            if (imm_flag)
-            {
-                uint16_t imm_5 = sign_extend(instr & 0x1F, 5);
-                reg[R_DR] = reg[R_SR1] & imm_5;
-            }
-            else
-            {
-                uint16_t R_SR2 = instr & 0x7;
-                reg[R_DR] = reg[R_SR1] & reg[R_SR2];
-            }
-
-            update_flags(R_DR);
-        }
-
-        break;
-        case OP_LDR:
-        {
-            /*
-                An address is computed by sign-extending bits [5:0] to 16 bits and adding this
-                value to the contents of the register specified by bits [8:6]. The contents of memory
-                at this address are loaded into DR. The condition codes are set, based on whether
-                the value loaded is negative, zero, or positive.
-            */
-            uint16_t R_DR = (instr >> 9) & 0x7;
-            uint16_t R_BASE = (instr >> 6) & 0x7;
-            reg[R_DR] = mem_read(reg[R_BASE] + sign_extend(instr & 0x3F, 6));
-            update_flags(R_DR);
-        }
-        break;
-        case OP_STR:
-        { 
-            /*
-                The contents of the register specified by SR are stored in the memory location
-                whose address is computed by sign-extending bits [5:0] to 16 bits and adding this
-                value to the contents of the register specified by bits [8:6].
-            */
-            uint16_t R_SR = (instr >> 9) & 0x7;
-            uint16_t R_BASE = (instr >> 6) & 0x7;
-            mem_write(reg[R_BASE] + sign_extend(instr & 0x3F, 6), reg[R_SR]);
-        }
-        break;
-        case OP_RTI:
-            { 
-            /*
-                If the processor is running in Supervisor mode, the top two elements on the
-                Supervisor Stack are popped and loaded into PC, PSR. If the processor is running
-                in User mode, a privilege mode violation exception occurs.
-            */
-            
-            uint16_t sup_mode = (reg[R_PSR] >> 15) & 1;
-            // PSR[15] = 0 in Supervisor Mode
-            if (sup_mode == 0)
-            {
-                // Pop PC from supervisor stack
-                reg[R_PC] = mem_read(reg[R_R6]);
-                reg[R_R6]++;
-                // Pop PSR from supervisor stack
-                reg[R_PSR] = mem_read(reg[R_R6]);
-                reg[R_R6]++;
-                // Restore User Stack Pointer
-                reg[R_R6] = reg[R_USP];
-            }
-            else
-            {
-                /* Privilege mode violation occurs if the processor encounters the RTI instruction while running in User Mode, throwing an illegal opcode exception */
-                // The processor sets the privilege mode to Supervisor mode (PSR[15] = 0).
-                reg[R_PSR] &= ~(1 << 15);
-                // R6 is loaded with the Supervisor Stack Pointer (SSP) if it does not already contain the SSP
-                reg[R_R6] = reg[R_SSP];
-                // The PSR and PC of the interrupted process are pushed onto the Supervisor Stack
-                mem_write(reg[R_R6]--, reg[R_PSR]);
-                mem_write(reg[R_R6]--, reg[R_PC]);
-                // The exception supplies its 8-bit vector. In the case of the Privilege mode violation, that vector is x00
-
-                // The processor expands that vector to x0100, the corresponding 16-bit address in the interrupt vector table.
-
-                /* The PC is loaded with the contents of memory location x0100,
-                the address of the first instruction in the corresponding exception service
-                routine. */
-                reg[R_PC] = 0x0100;
-                printf("illegal opcode exception: An RTI instruction was executed while in user mode. The machine has been halted.\n");
-                running = 0;
-            }
-        }
-
-        break;
-        case OP_NOT:
-        {
-            /*The bit-wise complement of the contents of SR is stored in DR. The condition
-codes are set, based on whether the binary value produced, taken as a 2's
-complement integer, is negative, zero, or positive.*/
-            uint16_t R_DR = (instr >> 9) & 0x7;
-            uint16_t R_SR = (instr >> 6) & 0x7;
-            reg[R_DR] = ~reg[R_SR];
-            update_flags(R_DR);
-        }
-        break;
-        case OP_LDI:
-        { /* An address is computed by sign-extending bits [8:0] to 16 bits and adding this
-value to the incremented PC. What is stored in memory at this address is the
-address of the data to be loaded into DR. The condition codes are set, based on
-whether the value loaded is negative, zero, or positive. */
-            uint16_t R_DR = (instr >> 9) & 0x7;
-            reg[R_DR] = mem_read(mem_read(reg[R_PC] + sign_extend(instr & 0x1FF, 9)));
-            update_flags(R_DR);
-        }
-        break;
-        case OP_STI:
-        {
-            /*The contents of the register specified by SR are stored in the memory location
-whose address is obtained as follows: Bits [8:0] are sign-extended to 16 bits and
-added to the incremented PC. What is in memory at this address is the address of
-the location to which the data in SR is stored.*/
-            uint16_t R_SR = (instr >> 9) & 0x7;
-            mem_write(mem_read(reg[R_PC] + sign_extend(instr & 0x1FF, 9)), reg[R_SR]);
-        }
-        break;
-        case OP_JMP:
-        { /* The program unconditionally jumps to the location specified by the contents of
-the base register. Bits [8:6] identify the base register.
-            */
-            reg[R_PC] = reg[(instr >> 6) & 0x7];
-
-            /*The RET instruction is a special case of the JMP instruction. The PC is loaded
-with the contents of R7, which contains the linkage back to the instruction
-following the subroutine call instruction.*/}
-            break;
-            case OP_RESERVED:
-                break;
-            case OP_LEA:
-            {
-                /* An address is computed by sign-extending bits [8:0] to 16 bits and adding this
-value to the incremented PC. This address is loaded into DR.4" The condition
-codes are set, based on whether the value loaded is negative, zero, or positive.*/
-                uint16_t R_DR = (instr >> 9) & 0x7;
-                reg[R_DR] = reg[R_PC] + sign_extend(instr & 0x01FF, 9);
-                update_flags(R_DR);
-            }
-            break;
-            case OP_TRAP:
-            { /*
-                    First R7 is loaded with the incremented PC. (This enables a return to the instruction
-                    physically following the TRAP instruction in the original program after the service
-                    routine has completed execution.) Then the PC is loaded with the starting address
-                    of the system call specified by trapvector8. The starting address is contained in
-                    the memory location whose address is obtained by zero-extending trapvector8 to
-                    16 bits.
-                */
-                uint16_t trap_vect = (instr & 0xFF);
-                reg[R_R7] = reg[R_PC];
-                reg[R_PC] = mem_read(trap_vect);
-
-                /* Handle trap instructions natively */
-                //trap(trap_vect);
-            }
-            break;
-            default:
-                // Bad Opcode
-                return 0;
-            }
+        restore_input_buffering();
+        exit(1);
     }
 
     /* Shutdown */
     restore_input_buffering();
-}
\ No newline at end of file
+    if (profile_path)
+        write_profile();
+    traced_vm = NULL;
+    if (trace_path && !lc3_stop_trace(vm))
+        fprintf(stderr, "failed to write trace: %s\n", trace_path);
+    if (record_path && !lc3_stop_input(vm))
+        fprintf(stderr, "failed to write input log: %s\n", record_path);
+    if (record_path || replay_path)
+        fprintf(stderr, "%lu instructions\n", lc3_retired(vm) - start);
+    if (trap_mode == LC3_TRAPS_CHECK)
+        fprintf(stderr, "%lu native traps differed from the OS routines\n", lc3_trap_mismatches(vm));
+
+    /* A program stopped by a limit did not finish, show where it was */
+    int status = 0;
+    if (lc3_stop_reason(vm) == LC3_STOP_INSTRUCTIONS || lc3_stop_reason(vm) == LC3_STOP_TIMEOUT)
+    {
+        fprintf(stderr, "%s limit reached after %lu instructions\n",
+                lc3_stop_reason(vm) == LC3_STOP_TIMEOUT ? "time" : "instruction", lc3_retired(vm) - start);
+        dump_state(vm);
+        status = 3;
+    }
+    lc3_destroy(vm);
+    return status;
+}
@@ -0,0 +1,376 @@
+#ifndef LC3_H
+#define LC3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    liblc3: an embeddable LC-3 virtual machine.
+
+    Every machine lives in its own lc3_vm, so one process can host as many as it likes.
+    A VM is not thread safe, but different VMs may run on different threads.
+*/
+
+/* The LC-3 has 65,536 available memory locations */
+#define MEMORY_MAX (1 << 16)
+
+/* The LC-3 has 8 general purpose registers, 1 Program Counter, 1 Condition Flag */
+enum registers
+{
+    R_R0 = 0, /* 8 GENERAL PURPOSE REGISTERS*/
+    R_R1,
+    R_R2,
+    R_R3,
+    R_R4,
+    R_R5,
+    R_R6,
+    R_R7,
+    R_PC,   /* PROGRAM COUNTER (PC) */
+    R_COND, /* CONDITION FLAG */
+    R_PSR,
+    R_SSP,   /* SUPERVISOR STACK POINTER */
+    R_USP,   /* USER STACK POINTER */
+    R_COUNT, /* NUMBER OF TOTAL REGISTERS */
+};
+
+/* Memory Mapped registers */
+enum
+{
+    MR_KBSR = 0xFE00, /* keyboard status */
+    MR_KBDR = 0xFE02, /* keyboard data */
+    MR_DSR = 0xFE04,  /* display status */
+    MR_DDR = 0xFE06,  /* display data*/
+    MR_TMSR = 0xFE08, /* timer status, see lc3_attach_timer */
+    MR_TMIR = 0xFE0A, /* timer interval in milliseconds */
+    MR_DKSR = 0xFE10, /* disk status, see lc3_attach_disk */
+    MR_DKBR = 0xFE12, /* disk block number */
+    MR_DKAR = 0xFE14, /* disk memory address */
+    MR_DKCR = 0xFE16, /* disk command */
+    MR_FBCR = 0xFE18, /* framebuffer control, see lc3_attach_framebuffer */
+    MR_FBAR = 0xFE1A, /* framebuffer address */
+    MR_MCR = 0xFFFE   /* machine control*/
+};
+
+/* Memory mapped devices live on the page from here to the end of memory */
+#define LC3_DEVICE_PAGE 0xFE00
+
+/* By default the starting address for the LC-3 is 0x3000 */
+#define PC_START 0x3000
+
+typedef struct lc3_vm lc3_vm;
+
+/*
+    Console I/O of a VM. The keyboard status register polls key_ready and the keyboard
+    data register is filled from read_key, characters written to the display data
+    register go to write_char. write_char may buffer: the VM calls flush when the program
+    polls the keyboard and no key is ready, and before lc3_run or lc3_step return.
+*/
+typedef struct
+{
+    void *ctx;                           /* passed back to every callback */
+    int (*key_ready)(void *ctx);         /* 1 if read_key would not block */
+    int (*read_key)(void *ctx);          /* next character, -1 at end of input */
+    void (*write_char)(void *ctx, int c);
+    void (*flush)(void *ctx);
+
+    /*
+        Optional: block until key_ready would return 1 or timeout_ms passed (forever if
+        negative), returns key_ready. Lets a program waiting for input in a polling loop
+        park its thread instead of spinning.
+    */
+    int (*wait_key)(void *ctx, long timeout_ms);
+
+    /* Optional: same as write_char for each of the len characters of s */
+    void (*write)(void *ctx, const char *s, size_t len);
+} lc3_io;
+
+/* Devices a VM can have, the keyboard, display and machine control register included */
+#define LC3_MAX_DEVICES 16
+
+/*
+    A memory mapped device. A load from one of its addresses returns read (the word in
+    memory if read is NULL), a store writes memory and then calls write. destroy, if
+    not NULL, is called with ctx when the VM is destroyed. interrupt, if not NULL, is
+    polled for a request: it returns the priority level (1 to 7) and sets the vector, 0
+    if there is none, or -1 if there can't be one before the next store to the device
+    page. A request stays pending until the device withdraws it.
+*/
+typedef struct
+{
+    void *ctx;
+    uint16_t (*read)(void *ctx, lc3_vm *vm, uint16_t addr);
+    void (*write)(void *ctx, lc3_vm *vm, uint16_t addr, uint16_t val);
+    void (*destroy)(void *ctx);
+    int (*interrupt)(void *ctx, lc3_vm *vm, uint8_t *vector);
+} lc3_device;
+
+/*
+    Interrupts. Devices are polled between basic blocks, every few hundred of them, and
+    while the program waits in a BR to itself. A request above the priority in PSR[10:8]
+    pushes the PSR (with the condition codes in bits [2:0]) and the PC onto the supervisor
+    stack, raises the priority to its level and jumps through the vector table at
+    x0100 + vector; RTI returns. The keyboard requests one while bit 14 of MR_KBSR is set
+    and a key is ready, until MR_KBDR is read.
+*/
+#define LC3_INTERRUPT_ENABLE (1 << 14)
+#define LC3_KEYBOARD_VECTOR 0x80
+#define LC3_KEYBOARD_PRIORITY 4
+#define LC3_TIMER_VECTOR 0x81
+#define LC3_TIMER_PRIORITY 6
+
+/* Create a VM with the LC-3 OS loaded. Console I/O goes to stdin/stdout if io is NULL */
+lc3_vm *lc3_create(const lc3_io *io);
+void lc3_destroy(lc3_vm *vm);
+
+/* Load an object file (big-endian origin followed by words). Returns 1 on success, 0 otherwise */
+int lc3_load_image(lc3_vm *vm, const char *path);
+int lc3_load_image_data(lc3_vm *vm, const void *data, size_t size);
+
+/*
+    Replace all of memory with a ROM image: 65,536 words in host byte order, as written
+    by mkrom -b. The file is mapped copy-on-write. Returns 1 on success, 0 otherwise
+*/
+int lc3_load_rom(lc3_vm *vm, const char *path);
+
+/*
+    Map a device at the addresses first to last, which must be on the device page and
+    not taken by another device. Returns 1 on success, 0 otherwise
+*/
+int lc3_map_device(lc3_vm *vm, uint16_t first, uint16_t last, const lc3_device *dev);
+
+/*
+    For a device that follows the host's clock: whether an event that the clock says is
+    due (or not) happens now. That is due itself, except with recorded or replayed input:
+    a recording logs the events along with the keys, and a replay has them happen at the
+    instructions they happened at, whatever the clock says
+*/
+int lc3_device_event(lc3_vm *vm, int due);
+
+/*
+    Interval timer. Writing MR_TMIR starts it with that many milliseconds between ticks,
+    0 stops it. Bit 15 of MR_TMSR is set once a tick is due and cleared by reading it; the
+    next interval counts from when the tick was noticed. The other bits of MR_TMSR read
+    back as written, with bit 14 set a due tick requests LC3_TIMER_VECTOR.
+*/
+int lc3_attach_timer(lc3_vm *vm);
+
+/*
+    Block storage backed by a file of LC3_DISK_BLOCK words per block, big-endian like
+    object files. Write the block number to MR_DKBR and the memory address to MR_DKAR,
+    then LC3_DISK_READ or LC3_DISK_WRITE to MR_DKCR. Transfers complete at once: bit 15
+    of MR_DKSR (ready) is always set, bit 0 is set if the last transfer failed, e.g.
+    because it would touch the device page. Blocks past the end of the file read as zero.
+*/
+#define LC3_DISK_BLOCK 256
+#define LC3_DISK_READ 1
+#define LC3_DISK_WRITE 2
+int lc3_attach_disk(lc3_vm *vm, const char *path);
+
+/*
+    Text framebuffer of LC3_FB_ROWS rows of LC3_FB_COLS words in memory from the address
+    in MR_FBAR (LC3_FB_BASE at first). A word holds a character in bits [7:0] and its
+    colour in bits [11:8]: 0 for the terminal's default, 1 to 15 for the ANSI colours.
+    Writing a word with bit 0 set to MR_FBCR presents the frame, and a thread draws it
+    on fd, at most fps (0 for 30) frames a second, with ANSI escape sequences rewriting
+    only the cells that changed. Bit 15 of MR_FBCR is set once every frame presented was
+    drawn.
+*/
+#define LC3_FB_COLS 80
+#define LC3_FB_ROWS 24
+#define LC3_FB_BASE 0xF000
+int lc3_attach_framebuffer(lc3_vm *vm, int fd, unsigned fps);
+
+/* Run hot code through the x86-64 JIT. Returns 1 on success, 0 if it is unavailable */
+int lc3_enable_jit(lc3_vm *vm);
+
+/*
+    Run code translated ahead of time by lc3-aot: run executes from a PC it translated
+    and returns the PC the interpreter continues at, count instructions at addr were
+    translated from word. Memory must hold those words, loading or restoring memory or a
+    store into them goes back to interpreting. Not together with the JIT. Returns 1 on
+    success, 0 otherwise
+*/
+typedef uint16_t (*lc3_aot_fn)(lc3_vm *vm, uint16_t pc);
+int lc3_enable_aot(lc3_vm *vm, lc3_aot_fn run, size_t count, const uint16_t *addr, const uint16_t *word);
+
+/* How TRAP instructions are run */
+enum lc3_trap_mode
+{
+    LC3_TRAPS_EMULATED = 0, /* jump to the service routines of the OS loaded into memory */
+    LC3_TRAPS_NATIVE,       /* run the built-in OS routines on the host, with the same results */
+    LC3_TRAPS_CHECK,        /* like LC3_TRAPS_NATIVE, and compare every trap with the OS routine */
+};
+
+void lc3_set_trap_mode(lc3_vm *vm, int mode);
+
+/* Number of traps whose native result differed from the OS routine in LC3_TRAPS_CHECK mode */
+unsigned long lc3_trap_mismatches(const lc3_vm *vm);
+
+/*
+    Profiling: lc3_run counts the instructions executed at each address and follows
+    JSR, JSRR and TRAP calls and their JMP R7 returns into a call tree. The JIT is not
+    used while profiling, runs without a profile are not slowed down. Profiling starts
+    with the routine at the current PC. Returns 1 on success, 0 if out of memory
+*/
+int lc3_enable_profile(lc3_vm *vm);
+
+/*
+    Write the hottest routines and addresses to report and the call stacks in folded
+    format (for flame graph tools) to folded, either may be NULL. Returns 1 on success, 0 otherwise
+*/
+int lc3_write_profile(const lc3_vm *vm, const char *report, const char *folded);
+
+/*
+    Tracing: lc3_run records every instruction it executes, with the registers and
+    memory it wrote, into a compressed trace file that lc3-trace can query. Traps run
+    natively are one instruction. The JIT and the profile are not used while tracing.
+    Returns 1 on success, 0 otherwise
+*/
+int lc3_start_trace(lc3_vm *vm, const char *path);
+
+/*
+    Write the rest of the trace and close it. Returns 1 if all of the trace was written.
+    May be called from a signal handler that interrupted lc3_run and ends the process
+*/
+int lc3_stop_trace(lc3_vm *vm);
+
+/*
+    Deterministic input: every key the program reads is logged with the number of
+    instructions executed before it, and a replay hands out the same keys at the same
+    instruction without reading the console. lc3_run then runs lc3_step, which neither
+    translates, profiles nor traces. Returns 1 on success, 0 otherwise
+*/
+int lc3_record_input(lc3_vm *vm, const char *path);
+int lc3_replay_input(lc3_vm *vm, const char *path);
+
+/* Read keys from the console again. Returns 1 if all of a recording was written */
+int lc3_stop_input(lc3_vm *vm);
+
+/*
+    Execute at most n instructions, fewer if a breakpoint or watchpoint stops it (see
+    lc3_stop_reason). Returns 1 while the machine is still running
+*/
+int lc3_step(lc3_vm *vm, unsigned long n);
+
+/* Instructions executed by lc3_step and limited lc3_runs since the VM was created */
+unsigned long lc3_retired(const lc3_vm *vm);
+
+/* Execute until the Machine Control Register is cleared, or a limit is reached */
+void lc3_run(lc3_vm *vm);
+
+enum lc3_stop_reason
+{
+    LC3_STOP_HALT = 0,     /* the Machine Control Register was cleared */
+    LC3_STOP_INSTRUCTIONS, /* the instruction limit was reached */
+    LC3_STOP_TIMEOUT,      /* the time limit ran out */
+    LC3_STOP_NO_INPUT,     /* a replay ran out of keys while the program waits for one */
+    LC3_STOP_BREAKPOINT,   /* the PC reached a breakpoint, its instruction has not run */
+    LC3_STOP_WATCHPOINT,   /* an instruction stored to a watched address */
+    LC3_STOP_HISTORY,      /* going back reached the oldest instruction of the history */
+};
+
+/*
+    Limits for each lc3_run: how many instructions it may execute and how many
+    milliseconds it may take, 0 for no limit. Instructions are counted at the end of
+    every basic block, so up to one more block may run, and the clock is read every
+    million instructions and while the program waits for a key. A limited run counts
+    its instructions in lc3_retired, translated code included; tracing and profiling are
+    not limited.
+*/
+void lc3_set_limits(lc3_vm *vm, unsigned long instructions, unsigned long ms);
+
+/* Why the last lc3_run or lc3_step returned, an lc3_stop_reason */
+int lc3_stop_reason(const lc3_vm *vm);
+
+int lc3_running(const lc3_vm *vm);
+
+/* 1 if the last lc3_step ended because the program is waiting for a key in a polling loop */
+int lc3_idle(const lc3_vm *vm);
+
+uint16_t lc3_get_reg(const lc3_vm *vm, int r);
+void lc3_set_reg(lc3_vm *vm, int r, uint16_t val);
+
+/* Memory access as seen by the program, including memory mapped devices */
+uint16_t lc3_read(lc3_vm *vm, uint16_t addr);
+void lc3_write(lc3_vm *vm, uint16_t addr, uint16_t val);
+
+/* Memory as stored, device registers and watchpoints are left alone. For debuggers */
+uint16_t lc3_peek(const lc3_vm *vm, uint16_t addr);
+void lc3_poke(lc3_vm *vm, uint16_t addr, uint16_t val);
+
+/*
+    Debugging. lc3_run and lc3_step stop at a breakpoint before the instruction at its
+    address runs, and after an instruction that stored to a watched address, with stop
+    reason LC3_STOP_BREAKPOINT or LC3_STOP_WATCHPOINT; running on from a breakpoint runs
+    its instruction first. Breakpoints are decoded in place of the instruction and
+    watchpoints use the check stores already make for translated code, so a VM without
+    any runs exactly as before. While there are any, the VM is interpreted. Set or
+    clear one with on = 1 or 0. Returns 1 on success, 0 if out of memory
+*/
+int lc3_set_breakpoint(lc3_vm *vm, uint16_t addr, int on);
+int lc3_set_watchpoint(lc3_vm *vm, uint16_t addr, int on);
+
+/* The address whose store stopped the machine at a watchpoint */
+uint16_t lc3_watch_address(const lc3_vm *vm);
+
+/*
+    Time travel. A recorded VM keeps an undo record of every instruction lc3_run and
+    lc3_step execute, a few bytes for the registers and memory it changed, and a
+    checkpoint of the whole machine every interval instructions (0 for
+    LC3_HISTORY_INTERVAL), with the memory of checkpoints shared page by page. Once
+    records and checkpoints take more than size bytes, the oldest are dropped.
+
+    Instructions are numbered like lc3_retired. lc3_seek puts the machine in its state
+    before instruction n by restoring the checkpoint after it and undoing records back
+    to it, so nothing runs again and seeking takes about as long wherever n is. Going
+    back stops at breakpoints like running does, and after undoing a store to a watched
+    address, before the instruction that made it. Running from the past goes forward
+    through the history up to the present and executes on from there. Only the machine
+    goes back: what devices keep themselves, the console and disks are not undone.
+
+    Recording interprets every instruction and can't be combined with tracing,
+    profiling, recorded or replayed input, or ahead-of-time code. Changing the machine
+    with lc3_set_reg, lc3_write or lc3_poke, or loading an image, starts the history
+    over from its new state. Returns 1 on success, 0 otherwise
+*/
+#define LC3_HISTORY_INTERVAL (1 << 18)
+
+int lc3_enable_history(lc3_vm *vm, size_t size, unsigned long interval);
+void lc3_disable_history(lc3_vm *vm);
+
+/* Numbers of the oldest state in the history and of the present. Returns 0 if not recorded */
+int lc3_history_range(const lc3_vm *vm, unsigned long *begin, unsigned long *end);
+
+/* Go to the state before instruction n. Returns 0 if it is not in the history */
+int lc3_seek(lc3_vm *vm, unsigned long n);
+
+/* Undo up to n instructions, or until a stop, see lc3_stop_reason */
+void lc3_reverse_step(lc3_vm *vm, unsigned long n);
+void lc3_reverse_run(lc3_vm *vm);
+
+/*
+    Snapshots of the whole machine: registers and memory, which includes the memory
+    mapped device registers. A snapshot is an open file; restoring maps its memory
+    copy-on-write, so restoring and cloning cost a few system calls however much of
+    the memory the program goes on to use.
+*/
+typedef struct lc3_snapshot lc3_snapshot;
+
+/* Write a snapshot file, replacing path only once it is whole. Returns 1 on success, 0 otherwise */
+int lc3_save_snapshot(lc3_vm *vm, const char *path);
+
+/* Open a snapshot file, or take an in-memory snapshot. NULL on failure */
+lc3_snapshot *lc3_snapshot_open(const char *path);
+lc3_snapshot *lc3_snapshot_take(lc3_vm *vm);
+void lc3_snapshot_close(lc3_snapshot *snap);
+
+/* Put the VM in the snapshot's state. Returns 1 on success, 0 otherwise */
+int lc3_restore(lc3_vm *vm, const lc3_snapshot *snap);
+
+/*
+    New VM in the snapshot's state, sharing the snapshot's pages until it writes to them.
+    Only the console devices are attached
+*/
+lc3_vm *lc3_clone(const lc3_snapshot *snap, const lc3_io *io);
+
+#endif
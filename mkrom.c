@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rom.h"
+
+/*
+    Build tool: lays out the LC3 OS and prints it as rom.c, or with -b <file> writes it
+    as a raw ROM image (65,536 words in host byte order) for lc3 --rom.
+*/
+
+static uint16_t memory[MEMORY_MAX];
+
+int main(int argc, char **argv)
+{
+    build_lc3_os(memory);
+
+    if (argc == 3 && strcmp(argv[1], "-b") == 0)
+    {
+        FILE *f = fopen(argv[2], "wb");
+        if (!f || fwrite(memory, sizeof(memory), 1, f) != 1 || fclose(f) != 0)
+        {
+            printf("failed to write %s\n", argv[2]);
+            exit(1);
+        }
+        return 0;
+    }
+
+    printf("/* Generated by mkrom from os.c, do not edit */\n");
+    printf("#include \"rom.h\"\n\n");
+    printf("const uint16_t lc3_os_rom[MEMORY_MAX] __attribute__((aligned(ROM_PAGE_WORDS * 2))) = {");
+
+    /* Only runs of non-zero words are written, each one after a designator */
+    int run = 0;
+    for (int i = 0; i < MEMORY_MAX; i++)
+    {
+        if (!memory[i])
+        {
+            run = 0;
+            continue;
+        }
+        if (!run || run % 8 == 0)
+            printf(run ? "\n       " : "\n    [0x%04X] =", i);
+        printf(" 0x%04X,", memory[i]);
+        run++;
+    }
+    printf("\n};\n\n");
+
+    printf("const uint8_t lc3_os_rom_used[ROM_PAGES] = {");
+    for (int page = 0; page < ROM_PAGES; page++)
+    {
+        int used = 0;
+        for (int i = 0; i < ROM_PAGE_WORDS; i++)
+            used |= memory[page * ROM_PAGE_WORDS + i] != 0;
+        printf(page % 16 ? " %d," : "\n    %d,", used);
+    }
+    printf("\n};\n");
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdint.h>
+
+#include "rom.h"
+
+#define TRAP_VECT_SZ 6
+#define TRAP_GETC_SZ 9
+#define TRAP_OUT_SZ 10
+#define TRAP_PUTS_SZ 20
+#define TRAP_IN_SZ 8
+#define TRAP_PUTSP_SZ 36
+#define TRAP_HALT_SZ 23
+
+/* Lay out the LC3 OS in memory */
+void build_lc3_os(uint16_t *memory)
+{
+    uint16_t trap_vector_table_entries[TRAP_VECT_SZ] = {0x0020, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025};
+    uint16_t trap_vector_table_values[TRAP_VECT_SZ] = {0x0400, 0x0430, 0x0450, 0x04A0, 0x04E0, 0xFD70};
+
+    uint16_t trap_getc_entries[TRAP_GETC_SZ] = {0x0400, 0x0401, 0x0402, 0x0403, 0x0404, 0x0405, 0x0406, 0x0407, 0x0408};
+    uint16_t trap_getc_values[TRAP_GETC_SZ] = {0x3E07, 0xA004, 0x07FE, 0xA003, 0x2E03, 0xC1C0, 0xFE00, 0xFE02, 0x3003};
+
+    uint16_t trap_out_entries[TRAP_OUT_SZ] = {0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437, 0x0438, 0x0439};
+    uint16_t trap_out_values[TRAP_OUT_SZ] = {0x3E0A, 0x3208, 0xA205, 0x07FE, 0xB004, 0x2204, 0x2E04, 0xC1C0, 0xFE04, 0xFE06};
+
+    uint16_t trap_puts_entries[TRAP_PUTS_SZ] = {0x0450, 0x0451, 0x0452, 0x0453, 0x0454, 0x0455, 0x0456, 0x0457, 0x0458, 0x0459, 0x045A, 0x045B, 0x045C, 0x045D, 0x045E, 0x045F, 0x0460, 0x0461, 0x0462, 0x0463};
+    uint16_t trap_puts_values[TRAP_PUTS_SZ] = {0x3E16, 0x3012, 0x3212, 0x3412, 0x6200, 0x0405, 0xA409, 0x07FE, 0xB208, 0x1021, 0x0FF9, 0x2008, 0x2208, 0x2408, 0x2E08, 0xC1C0, 0xFE04, 0xFE06, 0xF3FD, 0xF3FE};
+
+    uint16_t trap_in_entries[TRAP_IN_SZ] = {0x04A0, 0x04A1, 0x04A2, 0x04A3, 0x04A4, 0x04A5, 0x04A6, 0x04A7};
+    uint16_t trap_in_values[TRAP_IN_SZ] = {0x3E06, 0xE006, 0xF022, 0xF020, 0xF021, 0x2E01, 0xC1C0, 0x3001};
+
+    uint16_t trap_putsp_entries[TRAP_PUTSP_SZ] = {0x04E0, 0x04E1, 0x04E2, 0x04E3, 0x04E4, 0x04E5, 0x04E6, 0x04E7, 0x04E8, 0x04E9, 0x04EA, 0x04EB, 0x04EC, 0x04ED, 0x04EE, 0x04EF, 0x04F0, 0x04F1, 0x04F2, 0x04F3, 0x04F4, 0x04F5, 0x04F6, 0x04F7, 0x04F8, 0x04F9, 0x04FA, 0x04FB, 0x04FC, 0x04FD, 0x04FE, 0x04FF, 0x0500, 0x0501, 0x0502, 0x0503};
+    uint16_t trap_putsp_values[TRAP_PUTSP_SZ] = {0x3E27, 0x3022, 0x3222, 0x3422, 0x3622, 0x1220, 0x6040, 0x0406, 0x480D, 0x2418, 0x5002, 0x0402, 0x1261, 0x0FF8, 0x2014, 0x4806, 0x2013, 0x2213, 0x2413, 0x2613, 0x2E13, 0xC1C0, 0x3E06, 0xA607, 0x0801, 0x0FFC, 0xB003, 0x2E01, 0xC1C0, 0xFE06, 0xFE04, 0xF3FD, 0xF3FE, 0xFF00};
+
+    uint16_t trap_halt_entries[TRAP_HALT_SZ] = {0xFD00, 0xFD01, 0xFD02, 0xFD03, 0xFD04, 0xFD05, 0xFD06, 0xFD07, 0xFD08, 0xFD09, 0xFD70, 0xFD71, 0xFD72, 0xFD73, 0xFD74, 0xFD75, 0xFD76, 0xFD77, 0xFD78, 0xFD79, 0xFD7A, 0xFD7B, 0xFD7C};
+    uint16_t trap_halt_values[TRAP_HALT_SZ] = {0x3E3E, 0x303C, 0x2007, 0xF021, 0xE006, 0xF022, 0xF025, 0x2036, 0x2E36, 0xC1C0, 0x3E0E, 0x320C, 0x300A, 0xE00C, 0xF022, 0xA22F, 0x202F, 0x5040, 0xB02C, 0x2003, 0x2203, 0x2E03, 0xC1C0};
+
+    /* Write trap vector to memory */
+    for (int i = 0; i < TRAP_VECT_SZ; i++)
+    {
+        memory[trap_vector_table_entries[i]] = trap_vector_table_values[i];
+    }
+
+    for (int i = 0; i < TRAP_GETC_SZ; i++)
+    {
+        memory[trap_getc_entries[i]] = trap_getc_values[i];
+    }
+
+    for (int i = 0; i < TRAP_OUT_SZ; i++)
+    {
+        memory[trap_out_entries[i]] = trap_out_values[i];
+    }
+
+    for (int i = 0; i < TRAP_PUTS_SZ; i++)
+    {
+        memory[trap_puts_entries[i]] = trap_puts_values[i];
+    }
+
+    for (int i = 0; i < TRAP_IN_SZ; i++)
+    {
+        memory[trap_in_entries[i]] = trap_in_values[i];
+    }
+
+    for (int i = 0; i < TRAP_PUTSP_SZ; i++)
+    {
+        memory[trap_putsp_entries[i]] = trap_putsp_values[i];
+    }
+
+    for (int i = 0; i < TRAP_HALT_SZ; i++)
+    {
+        memory[trap_halt_entries[i]] = trap_halt_values[i];
+    }
+
+    /* the "halting the processor" message goes here */
+    memory[0xFDA5] = 0xFFFE;
+    memory[0xFDA6] = 0x7FFF;
+    // Display status register
+    memory[0xFE04] = 0x8000;
+    // Machine control register
+    memory[0xFFFE] = 0xFFFF;
+
+    // Fill in bad TRAPs
+    for (int i = 0; i < 0xFF; i++)
+    {
+        if (!memory[i])
+        {
+            memory[i] = 0xFD00;
+        }
+    }
+
+    // Fill in input prompt
+    char *inputPrompt = "Input a character> \0";
+    int i = 0;
+
+    for (char *p = inputPrompt; *p != '\0'; p++)
+    {
+        memory[0x04A8 + i] = *p;
+        i++;
+    }
+
+    i = 0;
+
+    // Fill in halt message
+    char *haltMessage = "\n----- Halting the processor ----- \n\0";
+    for (char *p = haltMessage; *p != '\0'; p++)
+    {
+        memory[0xFD80 + i] = *p;
+        i++;
+    }
+}
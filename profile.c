@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "vm.h"
+#include "profile.h"
+
+/*
+    Guest profiler. The profiling interpreter loop counts every instruction at its address
+    and in the call tree node of the routine that runs it. JSR, JSRR and TRAP descend into
+    the callee's node, JMP R7 back to the instruction after a call climbs back out. At the
+    end the counts are written as a report of hot routines and addresses, and as folded
+    stacks ("caller;callee count" lines) for flame graph tools.
+*/
+
+/* Lines of each table in the report */
+#define REPORT_ROUTINES 30
+#define REPORT_ADDRESSES 30
+
+static const char *op_names[16] = {"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+                                   "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"};
+
+struct profile *profile_create(uint16_t entry)
+{
+    struct profile *p = calloc(1, sizeof(struct profile));
+    if (!p)
+        return NULL;
+
+    p->node_max = 64;
+    p->nodes = calloc(p->node_max, sizeof(call_node));
+    if (!p->nodes)
+    {
+        free(p);
+        return NULL;
+    }
+    p->nodes[0].entry = entry;
+    p->nodes[0].trap = -1;
+    p->node_count = 1;
+    p->self = &p->nodes[0].self;
+    return p;
+}
+
+void profile_destroy(struct profile *p)
+{
+    free(p->nodes);
+    free(p);
+}
+
+void profile_call(struct profile *p, uint16_t entry, int trap, uint16_t ret)
+{
+    /* Too deep to track: the callee counts as part of its caller */
+    if (p->depth == PROFILE_MAX_DEPTH)
+        return;
+
+    call_node *caller = &p->nodes[p->current];
+    uint32_t n = caller->child;
+    while (n && (p->nodes[n].entry != entry || p->nodes[n].trap != trap))
+        n = p->nodes[n].sibling;
+
+    /* First call of this routine from this stack */
+    if (!n)
+    {
+        if (p->node_count == p->node_max)
+        {
+            call_node *nodes = realloc(p->nodes, 2 * p->node_max * sizeof(call_node));
+            if (!nodes)
+                return;
+            p->nodes = nodes;
+            p->node_max *= 2;
+            caller = &p->nodes[p->current];
+        }
+        n = p->node_count++;
+        p->nodes[n] = (call_node){entry, trap, p->current, 0, caller->child, 0, 0};
+        caller->child = n;
+    }
+
+    p->stack[p->depth].ret = ret;
+    p->stack[p->depth].node = p->current;
+    p->depth++;
+    p->current = n;
+    p->nodes[n].calls++;
+    p->self = &p->nodes[n].self;
+}
+
+void profile_return(struct profile *p, uint16_t target)
+{
+    /* Usually the innermost call, further out if routines were left without returning */
+    for (int i = p->depth - 1; i >= 0; i--)
+    {
+        if (p->stack[i].ret == target)
+        {
+            p->current = p->stack[i].node;
+            p->depth = i;
+            p->self = &p->nodes[p->current].self;
+            return;
+        }
+    }
+}
+
+static void node_name(const call_node *n, char *buf, size_t size)
+{
+    if (n->trap >= 0)
+        snprintf(buf, size, "TRAP_x%02X", n->trap);
+    else
+        snprintf(buf, size, "x%04X", n->entry);
+}
+
+/* Sort addresses by descending count */
+static const uint64_t *sort_counts;
+
+static int by_count(const void *a, const void *b)
+{
+    uint64_t x = sort_counts[*(const uint16_t *)a], y = sort_counts[*(const uint16_t *)b];
+    return (x < y) - (x > y);
+}
+
+static uint16_t *sorted_addresses(const uint64_t *counts, int *n)
+{
+    uint16_t *addrs = malloc(MEMORY_MAX * sizeof(uint16_t));
+    if (!addrs)
+        return NULL;
+
+    *n = 0;
+    for (int a = 0; a < MEMORY_MAX; a++)
+    {
+        if (counts[a])
+            addrs[(*n)++] = a;
+    }
+    sort_counts = counts;
+    qsort(addrs, *n, sizeof(uint16_t), by_count);
+    return addrs;
+}
+
+int profile_write_report(const struct profile *p, const lc3_vm *vm, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    uint64_t *node_total = calloc(p->node_count, sizeof(uint64_t));
+    uint64_t *self = calloc(MEMORY_MAX, sizeof(uint64_t));
+    uint64_t *total = calloc(MEMORY_MAX, sizeof(uint64_t));
+    uint64_t *calls = calloc(MEMORY_MAX, sizeof(uint64_t));
+    int16_t *trap = malloc(MEMORY_MAX * sizeof(int16_t));
+    int ok = f && node_total && self && total && calls && trap;
+    if (!ok)
+        goto done;
+
+    /* Callees are created after their callers, so one backwards pass sums up the subtrees */
+    for (uint32_t i = 0; i < p->node_count; i++)
+        node_total[i] = p->nodes[i].self;
+    for (uint32_t i = p->node_count - 1; i > 0; i--)
+        node_total[p->nodes[i].parent] += node_total[i];
+
+    /* Per routine, whatever it was called from. Recursive calls are already in the outermost total */
+    memset(trap, 0xFF, MEMORY_MAX * sizeof(int16_t));
+    for (uint32_t i = 0; i < p->node_count; i++)
+    {
+        const call_node *n = &p->nodes[i];
+        self[n->entry] += n->self;
+        calls[n->entry] += n->calls;
+        if (n->trap >= 0)
+            trap[n->entry] = n->trap;
+
+        uint32_t up = i;
+        while (up && p->nodes[p->nodes[up].parent].entry != n->entry)
+            up = p->nodes[up].parent;
+        if (!up)
+            total[n->entry] += node_total[i];
+    }
+
+    uint64_t all = node_total[0];
+    double pct = all ? 100.0 / all : 0;
+    fprintf(f, "%llu instructions\n\n", (unsigned long long)all);
+
+    int n;
+    uint16_t *addrs = sorted_addresses(self, &n);
+    if (!addrs)
+    {
+        ok = 0;
+        goto done;
+    }
+    fprintf(f, "%14s %7s %14s %7s %10s  routine\n", "self", "%", "with callees", "%", "calls");
+    for (int i = 0; i < n && i < REPORT_ROUTINES; i++)
+    {
+        uint16_t a = addrs[i];
+        char name[16];
+        node_name(&(call_node){.entry = a, .trap = trap[a]}, name, sizeof(name));
+        fprintf(f, "%14llu %6.2f%% %14llu %6.2f%% %10llu  %s\n",
+                (unsigned long long)self[a], self[a] * pct, (unsigned long long)total[a], total[a] * pct,
+                (unsigned long long)calls[a], name);
+    }
+    free(addrs);
+
+    addrs = sorted_addresses(p->count, &n);
+    if (!addrs)
+    {
+        ok = 0;
+        goto done;
+    }
+    fprintf(f, "\n%14s %7s  address  instruction\n", "count", "%");
+    for (int i = 0; i < n && i < REPORT_ADDRESSES; i++)
+    {
+        uint16_t a = addrs[i];
+        uint16_t instr = vm->memory[a];
+        fprintf(f, "%14llu %6.2f%%  x%04X    x%04X %s\n",
+                (unsigned long long)p->count[a], p->count[a] * pct, a, instr, op_names[instr >> 12]);
+    }
+    free(addrs);
+
+done:
+    if (f && fclose(f) != 0)
+        ok = 0;
+    free(node_total);
+    free(self);
+    free(total);
+    free(calls);
+    free(trap);
+    return ok;
+}
+
+int profile_write_folded(const struct profile *p, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return 0;
+
+    uint32_t *path_nodes = malloc(p->node_count * sizeof(uint32_t));
+    if (!path_nodes)
+    {
+        fclose(f);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < p->node_count; i++)
+    {
+        if (!p->nodes[i].self)
+            continue;
+
+        int depth = 0;
+        for (uint32_t n = i; n; n = p->nodes[n].parent)
+            path_nodes[depth++] = n;
+        path_nodes[depth++] = 0;
+
+        while (depth--)
+        {
+            char name[16];
+            node_name(&p->nodes[path_nodes[depth]], name, sizeof(name));
+            fprintf(f, "%s%c", name, depth ? ';' : ' ');
+        }
+        fprintf(f, "%llu\n", (unsigned long long)p->nodes[i].self);
+    }
+
+    free(path_nodes);
+    return fclose(f) == 0;
+}
@@ -0,0 +1,54 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/* Deepest guest call stack that is tracked, deeper calls are charged to their caller */
+#define PROFILE_MAX_DEPTH 256
+
+/* A routine as reached through one particular chain of calls */
+typedef struct
+{
+    uint16_t entry;    /* address the routine was called at */
+    int16_t trap;      /* trap vector if it was entered by TRAP, -1 otherwise */
+    uint32_t parent;   /* caller's node, the root is its own parent */
+    uint32_t child;    /* first callee, 0 if none */
+    uint32_t sibling;  /* next callee of the same caller, 0 if none */
+    uint64_t self;     /* instructions executed in the routine itself */
+    uint64_t calls;
+} call_node;
+
+/* Execution counts of one VM, filled in by the profiling interpreter loop */
+struct profile
+{
+    uint64_t count[MEMORY_MAX]; /* instructions executed at each address */
+    uint64_t *self;             /* self count of the current node */
+
+    call_node *nodes; /* call tree, node 0 is the code running when profiling started */
+    uint32_t node_count, node_max;
+    uint32_t current;
+
+    /* Shadow call stack: where each active call returns to, and the caller's node */
+    struct
+    {
+        uint16_t ret;
+        uint32_t node;
+    } stack[PROFILE_MAX_DEPTH];
+    int depth;
+};
+
+struct profile *profile_create(uint16_t entry);
+void profile_destroy(struct profile *p);
+
+/* Control went to entry by JSR, JSRR or TRAP (trap vector, else -1) and comes back to ret */
+void profile_call(struct profile *p, uint16_t entry, int trap, uint16_t ret);
+
+/* JMP R7 to target: returns from the innermost call that returns there, if any */
+void profile_return(struct profile *p, uint16_t target);
+
+int profile_write_report(const struct profile *p, const lc3_vm *vm, const char *path);
+int profile_write_folded(const struct profile *p, const char *path);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef ROM_H
+#define ROM_H
+
+#include <stdint.h>
+
+#include "lc3.h"
+
+/*
+    Boot ROM: the memory image every VM starts with, i.e. the LC3 OS. It is built once,
+    by mkrom at build time, and mapped copy-on-write into new VMs.
+*/
+
+#define ROM_PAGE_WORDS 2048 /* 4 KiB */
+#define ROM_PAGES (MEMORY_MAX / ROM_PAGE_WORDS)
+
+/* Generated into rom.c */
+extern const uint16_t lc3_os_rom[MEMORY_MAX];
+extern const uint8_t lc3_os_rom_used[ROM_PAGES]; /* 1 for pages that are not all zero */
+
+/* Lay out the LC3 OS in memory, used by mkrom */
+void build_lc3_os(uint16_t *memory);
+
+#endif
@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+/* unix specific */
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "lc3.h"
+#include "server.h"
+
+/*
+    Session server. The main thread runs an epoll loop over the listening socket and
+    every connection, and only moves bytes between sockets and session buffers. A pool
+    of worker threads runs the sessions round robin, SERVER_QUANTUM instructions at a
+    turn, so a session that has input waits for at most one turn of every other running
+    session. A session whose program polls the keyboard with no key buffered, or whose
+    client doesn't take its output, is parked until the event loop sees its connection
+    become readable or writable again. Every session is a clone of one snapshot and
+    shares its pages until it writes to them.
+*/
+
+/* Instructions a session runs per turn */
+#define SERVER_QUANTUM 100000
+
+/* Keys read ahead of the program */
+#define SESSION_IN_SIZE 1024
+
+/* Output the program writes before it is handed to the connection */
+#define SESSION_STAGE_SIZE 1024
+
+/* Output the client has not taken yet that parks the session, and that resumes it */
+#define SESSION_OUT_HIGH (64 * 1024)
+#define SESSION_OUT_LOW (16 * 1024)
+
+/* epoll events handled per wait */
+#define SERVER_EVENTS 64
+
+enum session_state
+{
+    S_QUEUED,      /* on the run queue */
+    S_RUNNING,     /* on a worker */
+    S_WAIT_INPUT,  /* the program polls the keyboard and no key is buffered */
+    S_WAIT_OUTPUT, /* the client is behind on output */
+    S_FINISHED,    /* halted or disconnected, on the finished list */
+    S_DRAINING,    /* halted, the rest of the output is being sent */
+};
+
+typedef struct server server;
+
+typedef struct session
+{
+    server *srv;
+    int fd;
+    lc3_vm *vm;
+
+    /* Under the server lock */
+    int state; /* a session_state */
+    struct session *next; /* on the run queue or the finished list */
+
+    /* Only touched by the thread running the VM */
+    char stage[SESSION_STAGE_SIZE];
+    size_t staged;
+
+    /* Under lock, shared by the thread running the VM and the event loop */
+    pthread_mutex_t lock;
+    uint8_t in[SESSION_IN_SIZE]; /* ring of keys */
+    size_t in_start, in_len;
+    char *out;
+    size_t out_len, out_cap;
+    uint32_t events; /* the connection is registered for */
+    int closed;      /* the client is gone */
+} session;
+
+struct server
+{
+    int epfd;
+    int listener;
+    int wake; /* eventfd, signalled when a session is put on the finished list */
+    lc3_snapshot *snap;
+    const server_options *opt;
+
+    /* The server lock, taken before any session's */
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    session *head, *tail; /* run queue */
+    session *finished;
+};
+
+/* Register the connection for what the session can take: keys while there is room, output while some is left */
+static void session_watch(session *s)
+{
+    uint32_t events = (s->in_len < SESSION_IN_SIZE ? EPOLLIN : 0) | (s->out_len ? EPOLLOUT : 0);
+    if (s->closed || events == s->events)
+        return;
+    struct epoll_event ev = {events, {.ptr = s}};
+    epoll_ctl(s->srv->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+    s->events = events;
+}
+
+/* The client is gone: stop watching the connection and drop whatever it didn't take */
+static void session_close(session *s)
+{
+    if (s->closed)
+        return;
+    s->closed = 1;
+    s->out_len = 0;
+    epoll_ctl(s->srv->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+}
+
+/* Write as much output as the connection takes */
+static void session_send(session *s)
+{
+    size_t done = 0;
+    while (done < s->out_len && !s->closed)
+    {
+        ssize_t n = send(s->fd, s->out + done, s->out_len - done, MSG_NOSIGNAL);
+        if (n >= 0)
+            done += n;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        else if (errno != EINTR)
+            session_close(s);
+    }
+    if (s->closed)
+        return;
+    memmove(s->out, s->out + done, s->out_len - done);
+    s->out_len -= done;
+    /* An idle session keeps no more than a small output buffer */
+    if (!s->out_len && s->out_cap > SESSION_STAGE_SIZE)
+    {
+        free(s->out);
+        s->out = NULL;
+        s->out_cap = 0;
+    }
+    session_watch(s);
+}
+
+/* Read as many keys as there is room for */
+static void session_receive(session *s)
+{
+    while (s->in_len < SESSION_IN_SIZE && !s->closed)
+    {
+        size_t end = (s->in_start + s->in_len) % SESSION_IN_SIZE;
+        size_t space = end >= s->in_start ? SESSION_IN_SIZE - end : s->in_start - end;
+        ssize_t n = recv(s->fd, s->in + end, space, 0);
+        if (n > 0)
+            s->in_len += n;
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else if (n == 0 || errno != EINTR)
+            session_close(s);
+    }
+    session_watch(s);
+}
+
+static int session_key_ready(void *ctx)
+{
+    session *s = ctx;
+    pthread_mutex_lock(&s->lock);
+    int ready = s->in_len > 0;
+    pthread_mutex_unlock(&s->lock);
+    return ready;
+}
+
+static int session_read_key(void *ctx)
+{
+    session *s = ctx;
+    int key = -1;
+    pthread_mutex_lock(&s->lock);
+    if (s->in_len)
+    {
+        key = s->in[s->in_start];
+        s->in_start = (s->in_start + 1) % SESSION_IN_SIZE;
+        s->in_len--;
+        session_watch(s);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return key;
+}
+
+/* Hand the staged output to the connection */
+static void session_flush(void *ctx)
+{
+    session *s = ctx;
+    if (!s->staged)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->out_len + s->staged > s->out_cap)
+    {
+        size_t cap = s->out_cap ? s->out_cap : SESSION_STAGE_SIZE;
+        while (cap < s->out_len + s->staged)
+            cap *= 2;
+        char *out = realloc(s->out, cap);
+        if (out)
+        {
+            s->out = out;
+            s->out_cap = cap;
+        }
+    }
+    if (s->out_len + s->staged <= s->out_cap && !s->closed)
+    {
+        memcpy(s->out + s->out_len, s->stage, s->staged);
+        s->out_len += s->staged;
+        session_send(s);
+    }
+    pthread_mutex_unlock(&s->lock);
+    s->staged = 0;
+}
+
+static void session_write_char(void *ctx, int c)
+{
+    session *s = ctx;
+    if (s->staged == SESSION_STAGE_SIZE)
+        session_flush(s);
+    s->stage[s->staged++] = c;
+}
+
+static void session_write(void *ctx, const char *str, size_t len)
+{
+    session *s = ctx;
+    while (len > 0)
+    {
+        if (s->staged == SESSION_STAGE_SIZE)
+            session_flush(s);
+        size_t n = SESSION_STAGE_SIZE - s->staged;
+        if (n > len)
+            n = len;
+        memcpy(s->stage + s->staged, str, n);
+        s->staged += n;
+        str += n;
+        len -= n;
+    }
+}
+
+static void session_destroy(session *s)
+{
+    if (!s->closed)
+        epoll_ctl(s->srv->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    if (s->vm)
+        lc3_destroy(s->vm);
+    pthread_mutex_destroy(&s->lock);
+    free(s->out);
+    free(s);
+}
+
+/* Under the server lock */
+static void enqueue(server *srv, session *s)
+{
+    s->state = S_QUEUED;
+    s->next = NULL;
+    if (srv->tail)
+        srv->tail->next = s;
+    else
+        srv->head = s;
+    srv->tail = s;
+    pthread_cond_signal(&srv->queued);
+}
+
+/* Under the server lock: give the session back to the event loop to be closed */
+static void finish(server *srv, session *s)
+{
+    uint64_t one = 1;
+    s->state = S_FINISHED;
+    s->next = srv->finished;
+    srv->finished = s;
+    if (write(srv->wake, &one, sizeof(one)) < 0)
+        perror("eventfd");
+}
+
+static void *server_work(void *arg)
+{
+    server *srv = arg;
+
+    pthread_mutex_lock(&srv->lock);
+    for (;;)
+    {
+        while (!srv->head)
+            pthread_cond_wait(&srv->queued, &srv->lock);
+        session *s = srv->head;
+        srv->head = s->next;
+        if (!srv->head)
+            srv->tail = NULL;
+        s->state = S_RUNNING;
+        pthread_mutex_unlock(&srv->lock);
+
+        int running = lc3_step(s->vm, SERVER_QUANTUM);
+
+        /* Park the session only if nothing it waits for arrived meanwhile, the event loop looks at the state after */
+        pthread_mutex_lock(&srv->lock);
+        pthread_mutex_lock(&s->lock);
+        if (!running || s->closed)
+            finish(srv, s);
+        else if (s->out_len >= SESSION_OUT_HIGH)
+            s->state = S_WAIT_OUTPUT;
+        else if (lc3_idle(s->vm) && !s->in_len)
+            s->state = S_WAIT_INPUT;
+        else
+            enqueue(srv, s);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+static void server_accept(server *srv)
+{
+    for (;;)
+    {
+        int fd = accept4(srv->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0 && errno == EINTR)
+            continue;
+        if (fd < 0)
+            return;
+
+        session *s = calloc(1, sizeof(session));
+        if (!s)
+        {
+            close(fd);
+            continue;
+        }
+        s->srv = srv;
+        s->fd = fd;
+        s->events = EPOLLIN;
+        pthread_mutex_init(&s->lock, NULL);
+
+        lc3_io io = {s, session_key_ready, session_read_key, session_write_char, session_flush, NULL, session_write};
+        s->vm = lc3_clone(srv->snap, &io);
+        struct epoll_event ev = {EPOLLIN, {.ptr = s}};
+        if (!s->vm || !lc3_attach_timer(s->vm) || epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            s->closed = 1;
+            session_destroy(s);
+            continue;
+        }
+        lc3_set_trap_mode(s->vm, srv->opt->trap_mode);
+
+        pthread_mutex_lock(&srv->lock);
+        enqueue(srv, s);
+        pthread_mutex_unlock(&srv->lock);
+    }
+}
+
+/* Keys arrived, output was taken or the client is gone: resume or close a parked session */
+static void server_session_event(server *srv, session *s, uint32_t events)
+{
+    pthread_mutex_lock(&s->lock);
+    if (events & (EPOLLHUP | EPOLLERR))
+        session_close(s);
+    if (events & EPOLLIN)
+        session_receive(s);
+    if (events & EPOLLOUT)
+        session_send(s);
+    int closed = s->closed;
+    int input = s->in_len > 0;
+    size_t left = s->out_len;
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_mutex_lock(&srv->lock);
+    switch (s->state)
+    {
+    case S_WAIT_INPUT:
+        if (closed)
+            session_destroy(s);
+        else if (input)
+            enqueue(srv, s);
+        break;
+    case S_WAIT_OUTPUT:
+        if (closed)
+            session_destroy(s);
+        else if (left < SESSION_OUT_LOW)
+            enqueue(srv, s);
+        break;
+    case S_DRAINING:
+        if (closed || !left)
+            session_destroy(s);
+        break;
+    }
+    pthread_mutex_unlock(&srv->lock);
+}
+
+/* Close the sessions the workers finished, once their output is sent */
+static void server_reap(server *srv)
+{
+    uint64_t count;
+    if (read(srv->wake, &count, sizeof(count)) < 0)
+        return;
+
+    pthread_mutex_lock(&srv->lock);
+    session *s = srv->finished;
+    srv->finished = NULL;
+    while (s)
+    {
+        session *next = s->next;
+        pthread_mutex_lock(&s->lock);
+        int done = s->closed || !s->out_len;
+        pthread_mutex_unlock(&s->lock);
+        if (done)
+            session_destroy(s);
+        else
+            s->state = S_DRAINING;
+        s = next;
+    }
+    pthread_mutex_unlock(&srv->lock);
+}
+
+static int server_listen(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int run_server(const char *path, lc3_vm *vm, const server_options *opt)
+{
+    server srv = {.opt = opt, .lock = PTHREAD_MUTEX_INITIALIZER, .queued = PTHREAD_COND_INITIALIZER};
+
+    srv.snap = lc3_snapshot_take(vm);
+    lc3_destroy(vm);
+    if (!srv.snap)
+    {
+        printf("failed to take a snapshot of the program\n");
+        return 1;
+    }
+
+    srv.listener = server_listen(path);
+    if (srv.listener < 0)
+    {
+        printf("failed to listen on %s\n", path);
+        return 1;
+    }
+    srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+    srv.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event listen_ev = {EPOLLIN, {.ptr = &srv.listener}};
+    struct epoll_event wake_ev = {EPOLLIN, {.ptr = &srv.wake}};
+    if (srv.epfd < 0 || srv.wake < 0 ||
+        epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.listener, &listen_ev) < 0 ||
+        epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.wake, &wake_ev) < 0)
+    {
+        printf("failed to set up the event loop\n");
+        return 1;
+    }
+
+    int workers = opt->workers > 0 ? opt->workers : sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1)
+        workers = 1;
+    for (int i = 0; i < workers; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_work, &srv) != 0)
+        {
+            printf("failed to start the workers\n");
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+    fprintf(stderr, "serving on %s with %d workers\n", path, workers);
+
+    struct epoll_event events[SERVER_EVENTS];
+    for (;;)
+    {
+        int n = epoll_wait(srv.epfd, events, SERVER_EVENTS, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            perror("epoll_wait");
+            return 1;
+        }
+
+        /* Finished sessions are closed last, one of them may have an event in this batch */
+        int woken = 0;
+        for (int i = 0; i < n; i++)
+        {
+            void *p = events[i].data.ptr;
+            if (p == &srv.listener)
+                server_accept(&srv);
+            else if (p == &srv.wake)
+                woken = 1;
+            else
+                server_session_event(&srv, p, events[i].events);
+        }
+        if (woken)
+            server_reap(&srv);
+    }
+}
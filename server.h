@@ -0,0 +1,21 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "lc3.h"
+
+/* Settings of a session server */
+typedef struct
+{
+    int trap_mode; /* an lc3_trap_mode */
+    int workers;   /* threads to run sessions on, 0 for one per online CPU */
+} server_options;
+
+/*
+    Listen on the Unix socket at path and run a session for every connection: a clone of
+    vm, whose keyboard reads from the connection and whose display writes to it. The
+    connection is closed when the program halts. Returns the process exit status if the
+    socket can't be set up, otherwise serves until the process is killed.
+*/
+int run_server(const char *path, lc3_vm *vm, const server_options *opt);
+
+#endif
@@ -0,0 +1,311 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "simd.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+/*
+    simd_hash: four 64 bit lanes, each 32 byte stripe of input adds to them the way XXH3
+    does, a product of the two halves of a word mixed with a key plus the neighbouring
+    word. Only needs 32x32->64 bit multiplies, which SSE2 has. Words past the last full
+    stripe are mixed in one at a time.
+*/
+#define HASH_STRIPE 16 /* words */
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+
+static const uint64_t hash_key[4] = {0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL,
+                                     0x1f67b3b7a4a44072ULL, 0x78e5c0cc4ee679cbULL};
+static const uint64_t hash_seed[4] = {PRIME3, PRIME1, PRIME2, ~PRIME3};
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t hash_finish(const uint64_t acc[4], const uint16_t *p, size_t n)
+{
+    uint64_t h = (uint64_t)n * PRIME1;
+    for (int k = 0; k < 4; k++)
+        h = rotl64(h ^ (acc[k] * PRIME2), 31) * PRIME1;
+    for (size_t i = n - n % HASH_STRIPE; i < n; i++)
+        h = rotl64(h ^ (p[i] * PRIME3), 23) * PRIME2;
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Portable versions */
+
+static void swap16_scalar(uint16_t *dst, const uint16_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        dst[i] = (src[i] << 8) | (src[i] >> 8);
+}
+
+static size_t find_zero_scalar(const uint16_t *p, size_t n, uint16_t mask)
+{
+    size_t i = 0;
+    while (i < n && (p[i] & mask))
+        i++;
+    return i;
+}
+
+static void narrow_scalar(char *dst, const uint16_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        dst[i] = src[i] & 0xFF;
+}
+
+static int equal_scalar(const uint16_t *a, const uint16_t *b, size_t n)
+{
+    return memcmp(a, b, n * sizeof(uint16_t)) == 0;
+}
+
+static uint64_t hash_scalar(const uint16_t *p, size_t n)
+{
+    uint64_t acc[4];
+    memcpy(acc, hash_seed, sizeof(acc));
+    for (size_t s = 0; s + HASH_STRIPE <= n; s += HASH_STRIPE)
+    {
+        uint64_t d[4];
+        memcpy(d, p + s, sizeof(d));
+        for (int k = 0; k < 4; k++)
+        {
+            uint64_t dk = d[k] ^ hash_key[k];
+            acc[k ^ 1] += d[k];
+            acc[k] += (dk & 0xFFFFFFFF) * (dk >> 32);
+        }
+    }
+    return hash_finish(acc, p, n);
+}
+
+#if defined(__x86_64__)
+
+/* SSE2, every x86-64 CPU has it */
+
+static void swap16_sse2(uint16_t *dst, const uint16_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+    swap16_scalar(dst + i, src + i, n - i);
+}
+
+static size_t find_zero_sse2(const uint16_t *p, size_t n, uint16_t mask)
+{
+    const __m128i m = _mm_set1_epi16(mask);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + i)), m);
+        unsigned bits = _mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_setzero_si128()));
+        if (bits)
+            return i + __builtin_ctz(bits) / 2;
+    }
+    return i + find_zero_scalar(p + i, n - i, mask);
+}
+
+static void narrow_sse2(char *dst, const uint16_t *src, size_t n)
+{
+    const __m128i low = _mm_set1_epi16(0xFF);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i)), low);
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i + 8)), low);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+    }
+    narrow_scalar(dst + i, src + i, n - i);
+}
+
+static int equal_sse2(const uint16_t *a, const uint16_t *b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+            return 0;
+    }
+    return equal_scalar(a + i, b + i, n - i);
+}
+
+static inline __m128i hash_step_sse2(__m128i acc, __m128i d, __m128i key)
+{
+    __m128i dk = _mm_xor_si128(d, key);
+    __m128i product = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+    __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+    return _mm_add_epi64(acc, _mm_add_epi64(swapped, product));
+}
+
+static uint64_t hash_sse2(const uint16_t *p, size_t n)
+{
+    __m128i a0 = _mm_loadu_si128((const __m128i *)hash_seed);
+    __m128i a1 = _mm_loadu_si128((const __m128i *)(hash_seed + 2));
+    const __m128i k0 = _mm_loadu_si128((const __m128i *)hash_key);
+    const __m128i k1 = _mm_loadu_si128((const __m128i *)(hash_key + 2));
+    for (size_t s = 0; s + HASH_STRIPE <= n; s += HASH_STRIPE)
+    {
+        a0 = hash_step_sse2(a0, _mm_loadu_si128((const __m128i *)(p + s)), k0);
+        a1 = hash_step_sse2(a1, _mm_loadu_si128((const __m128i *)(p + s + 8)), k1);
+    }
+
+    uint64_t acc[4];
+    _mm_storeu_si128((__m128i *)acc, a0);
+    _mm_storeu_si128((__m128i *)(acc + 2), a1);
+    return hash_finish(acc, p, n);
+}
+
+/* AVX2 */
+
+AVX2 static void swap16_avx2(uint16_t *dst, const uint16_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    swap16_sse2(dst + i, src + i, n - i);
+}
+
+AVX2 static size_t find_zero_avx2(const uint16_t *p, size_t n, uint16_t mask)
+{
+    const __m256i m = _mm256_set1_epi16(mask);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + i)), m);
+        unsigned bits = _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, _mm256_setzero_si256()));
+        if (bits)
+            return i + __builtin_ctz(bits) / 2;
+    }
+    return i + find_zero_sse2(p + i, n - i, mask);
+}
+
+AVX2 static void narrow_avx2(char *dst, const uint16_t *src, size_t n)
+{
+    const __m256i low = _mm256_set1_epi16(0xFF);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i)), low);
+        __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i + 16)), low);
+        /* packus works within 128 bit lanes, put the quarters back in order */
+        __m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    narrow_sse2(dst + i, src + i, n - i);
+}
+
+AVX2 static int equal_avx2(const uint16_t *a, const uint16_t *b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != 0xFFFFFFFF)
+            return 0;
+    }
+    return equal_sse2(a + i, b + i, n - i);
+}
+
+AVX2 static uint64_t hash_avx2(const uint16_t *p, size_t n)
+{
+    __m256i acc = _mm256_loadu_si256((const __m256i *)hash_seed);
+    const __m256i key = _mm256_loadu_si256((const __m256i *)hash_key);
+    for (size_t s = 0; s + HASH_STRIPE <= n; s += HASH_STRIPE)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(p + s));
+        __m256i dk = _mm256_xor_si256(d, key);
+        __m256i product = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+        __m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        acc = _mm256_add_epi64(acc, _mm256_add_epi64(swapped, product));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return hash_finish(lanes, p, n);
+}
+
+#endif
+
+static struct
+{
+    void (*swap16)(uint16_t *dst, const uint16_t *src, size_t n);
+    size_t (*find_zero)(const uint16_t *p, size_t n, uint16_t mask);
+    void (*narrow)(char *dst, const uint16_t *src, size_t n);
+    int (*equal)(const uint16_t *a, const uint16_t *b, size_t n);
+    uint64_t (*hash)(const uint16_t *p, size_t n);
+} ops = {swap16_scalar, find_zero_scalar, narrow_scalar, equal_scalar, hash_scalar};
+static pthread_once_t ops_once = PTHREAD_ONCE_INIT;
+
+static void pick_ops()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        ops.swap16 = swap16_avx2;
+        ops.find_zero = find_zero_avx2;
+        ops.narrow = narrow_avx2;
+        ops.equal = equal_avx2;
+        ops.hash = hash_avx2;
+    }
+    else
+    {
+        ops.swap16 = swap16_sse2;
+        ops.find_zero = find_zero_sse2;
+        ops.narrow = narrow_sse2;
+        ops.equal = equal_sse2;
+        ops.hash = hash_sse2;
+    }
+#endif
+}
+
+void simd_swap16(uint16_t *dst, const uint16_t *src, size_t n)
+{
+    pthread_once(&ops_once, pick_ops);
+    ops.swap16(dst, src, n);
+}
+
+size_t simd_find_zero(const uint16_t *p, size_t n, uint16_t mask)
+{
+    pthread_once(&ops_once, pick_ops);
+    return ops.find_zero(p, n, mask);
+}
+
+void simd_narrow(char *dst, const uint16_t *src, size_t n)
+{
+    pthread_once(&ops_once, pick_ops);
+    ops.narrow(dst, src, n);
+}
+
+int simd_equal(const uint16_t *a, const uint16_t *b, size_t n)
+{
+    pthread_once(&ops_once, pick_ops);
+    return ops.equal(a, b, n);
+}
+
+uint64_t simd_hash(const uint16_t *p, size_t n)
+{
+    pthread_once(&ops_once, pick_ops);
+    return ops.hash(p, n);
+}
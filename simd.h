@@ -0,0 +1,28 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Kernels over blocks of memory words. Each has a scalar, an SSE2 and an AVX2 version,
+    the best one the CPU supports is picked on first use. All versions give the same
+    results, simd_hash included.
+*/
+
+/* dst[i] = src[i] with its two bytes swapped, dst may be src */
+void simd_swap16(uint16_t *dst, const uint16_t *src, size_t n);
+
+/* Index of the first word w of p[0..n) with (w & mask) == 0, n if there is none */
+size_t simd_find_zero(const uint16_t *p, size_t n, uint16_t mask);
+
+/* dst[i] = the low byte of src[i] */
+void simd_narrow(char *dst, const uint16_t *src, size_t n);
+
+/* 1 if the n words at a and b are equal, 0 otherwise */
+int simd_equal(const uint16_t *a, const uint16_t *b, size_t n);
+
+/* 64 bit hash of the n words at p */
+uint64_t simd_hash(const uint16_t *p, size_t n);
+
+#endif
@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+/* unix specific */
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "vm.h"
+#include "history.h"
+
+/*
+    Snapshot file layout: a header with the registers, then at SNAPSHOT_MEMORY_OFFSET the
+    65,536 memory words in host byte order. The offset is a multiple of every page size
+    in use, so the memory can be mapped straight over a VM's memory. Memory mapped
+    device registers are part of the memory image.
+*/
+#define SNAPSHOT_MAGIC "LC3SNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define SNAPSHOT_MEMORY_OFFSET (64 * 1024)
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; /* SNAPSHOT_BYTE_ORDER as written by the host that took the snapshot */
+    uint16_t reg[R_COUNT];
+} snapshot_header;
+
+struct lc3_snapshot
+{
+    int fd;
+    snapshot_header header;
+};
+
+/* Write the machine state to fd, which must be empty */
+static int write_snapshot(lc3_vm *vm, int fd, snapshot_header *header)
+{
+    *header = (snapshot_header){SNAPSHOT_MAGIC, SNAPSHOT_VERSION, SNAPSHOT_BYTE_ORDER};
+    memcpy(header->reg, vm->reg, sizeof(header->reg));
+
+    /* The gap between the header and the memory is left as a hole */
+    return pwrite(fd, header, sizeof(*header), 0) == sizeof(*header) &&
+           pwrite(fd, vm->memory, sizeof(vm->memory), SNAPSHOT_MEMORY_OFFSET) == sizeof(vm->memory);
+}
+
+/*
+    The file at path may be the one the VM's memory is mapped from, and truncating a
+    mapped file kills the process on the next access. The snapshot is written to a new
+    file next to it and renamed over it, so the old one stays whole until then
+*/
+int lc3_save_snapshot(lc3_vm *vm, const char *path)
+{
+    size_t len = strlen(path);
+    char *tmp = malloc(len + sizeof(".XXXXXX"));
+    if (!tmp)
+        return 0;
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".XXXXXX", sizeof(".XXXXXX"));
+
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+    {
+        free(tmp);
+        return 0;
+    }
+
+    snapshot_header header;
+    int ok = fchmod(fd, 0644) == 0 && write_snapshot(vm, fd, &header) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok && rename(tmp, path) == 0;
+    if (!ok)
+        unlink(tmp);
+    free(tmp);
+    return ok;
+}
+
+lc3_snapshot *lc3_snapshot_take(lc3_vm *vm)
+{
+    lc3_snapshot *snap = malloc(sizeof(lc3_snapshot));
+    if (!snap)
+        return NULL;
+
+    /* An anonymous file: clones map it privately and share its pages until they write */
+    snap->fd = memfd_create("lc3-snapshot", MFD_CLOEXEC);
+    if (snap->fd < 0 || !write_snapshot(vm, snap->fd, &snap->header))
+    {
+        lc3_snapshot_close(snap);
+        return NULL;
+    }
+
+    return snap;
+}
+
+lc3_snapshot *lc3_snapshot_open(const char *path)
+{
+    lc3_snapshot *snap = malloc(sizeof(lc3_snapshot));
+    if (!snap)
+        return NULL;
+
+    snap->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (snap->fd < 0 ||
+        pread(snap->fd, &snap->header, sizeof(snap->header), 0) != sizeof(snap->header) ||
+        memcmp(snap->header.magic, SNAPSHOT_MAGIC, sizeof(snap->header.magic)) != 0 ||
+        snap->header.version != SNAPSHOT_VERSION ||
+        snap->header.byte_order != SNAPSHOT_BYTE_ORDER ||
+        lseek(snap->fd, 0, SEEK_END) < SNAPSHOT_MEMORY_OFFSET + (off_t)(MEMORY_MAX * sizeof(uint16_t)))
+    {
+        lc3_snapshot_close(snap);
+        return NULL;
+    }
+
+    return snap;
+}
+
+void lc3_snapshot_close(lc3_snapshot *snap)
+{
+    if (snap->fd >= 0)
+        close(snap->fd);
+    free(snap);
+}
+
+int lc3_restore(lc3_vm *vm, const lc3_snapshot *snap)
+{
+    /* Copy-on-write mapping over the VM's memory, pages are read in when first touched */
+    if (!map_memory(vm, snap->fd, SNAPSHOT_MEMORY_OFFSET))
+        return 0;
+
+    memcpy(vm->reg, snap->header.reg, sizeof(vm->reg));
+    if (vm->history)
+        history_restart(vm->history, vm);
+    return 1;
+}
+
+lc3_vm *lc3_clone(const lc3_snapshot *snap, const lc3_io *io)
+{
+    lc3_vm *vm = vm_alloc(io);
+    if (!vm)
+        return NULL;
+
+    if (!lc3_restore(vm, snap))
+    {
+        lc3_destroy(vm);
+        return NULL;
+    }
+    return vm;
+}
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+/* unix specific */
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "vm.h"
+#include "trace.h"
+
+/*
+    Execution trace recorder. The tracing interpreter loop appends records to a block in
+    memory; full blocks go to a thread that compresses them and writes them out, so the
+    interpreter only waits when TRACE_QUEUE blocks are behind.
+*/
+
+/* Blocks filled but not written yet, plus the one being filled */
+#define TRACE_QUEUE 8
+
+/* How often closing the trace looks whether the writer is done */
+#define TRACE_POLL_MS 1
+
+/* Hash table of the compressor, indexed by 4 bytes of input */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+
+struct trace_buffer
+{
+    int fd;
+    int failed;
+    uint8_t raw[TRACE_QUEUE][TRACE_BLOCK_SIZE];
+    trace_block block[TRACE_QUEUE];
+    uint8_t packed[TRACE_COMPRESS_BOUND(TRACE_BLOCK_SIZE)];
+
+    /*
+        Blocks head - tail are waiting for the writer. Only the recorder moves head and
+        only the writer tail, each posts its semaphore after it did. Semaphores rather
+        than a lock, because the trace may be closed by a signal handler.
+    */
+    atomic_ulong head, tail;
+    atomic_int done, finished;
+    sem_t queued, written;
+    pthread_t thread;
+};
+
+/* Length field of a sequence: 4 bits in the token, then bytes of 255 while it does not fit */
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+    for (len -= 15; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/*
+    Sequences of a token byte (literal count in the high nibble, match length - 4 in the
+    low one), the literals, then a 2 byte offset back to the match. The last sequence is
+    literals only.
+*/
+size_t trace_compress(const uint8_t *src, size_t size, uint8_t *dst)
+{
+    uint32_t table[1 << LZ_HASH_BITS] = {0}; /* last position + 1 with each hash */
+    size_t ip = 0, anchor = 0;
+    uint8_t *op = dst;
+
+    while (ip + LZ_MIN_MATCH <= size)
+    {
+        uint32_t seq;
+        memcpy(&seq, src + ip, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t cand = table[h];
+        table[h] = ip + 1;
+
+        if (!cand-- || ip - cand > LZ_MAX_OFFSET || memcmp(src + cand, src + ip, LZ_MIN_MATCH) != 0)
+        {
+            ip++;
+            continue;
+        }
+
+        size_t len = LZ_MIN_MATCH;
+        while (ip + len < size && src[cand + len] == src[ip + len])
+            len++;
+
+        size_t lit = ip - anchor;
+        uint8_t *token = op++;
+        *token = (lit < 15 ? lit : 15) << 4 | (len - LZ_MIN_MATCH < 15 ? len - LZ_MIN_MATCH : 15);
+        if (lit >= 15)
+            op = put_length(op, lit);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        uint16_t offset = ip - cand;
+        memcpy(op, &offset, 2);
+        op += 2;
+        if (len - LZ_MIN_MATCH >= 15)
+            op = put_length(op, len - LZ_MIN_MATCH);
+
+        ip += len;
+        anchor = ip;
+    }
+
+    size_t lit = size - anchor;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15)
+        op = put_length(op, lit);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+    if (*len < 15)
+        return 1;
+    uint8_t b;
+    do
+    {
+        if (*ip == end)
+            return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+size_t trace_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t max)
+{
+    const uint8_t *ip = src, *end = src + size;
+    size_t op = 0;
+
+    while (ip < end)
+    {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (!get_length(&ip, end, &lit) || lit > (size_t)(end - ip) || lit > max - op)
+            return 0;
+        memcpy(dst + op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == end)
+            break;
+
+        uint16_t offset;
+        size_t len = token & 15;
+        if (end - ip < 2)
+            return 0;
+        memcpy(&offset, ip, 2);
+        ip += 2;
+        if (!get_length(&ip, end, &len) || offset == 0 || offset > op || len + LZ_MIN_MATCH > max - op)
+            return 0;
+
+        /* Byte by byte, the match may overlap what it produces */
+        for (len += LZ_MIN_MATCH; len; len--, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    while (size)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+            return 0;
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+/* Compresses and writes blocks in the order they were filled */
+static void *write_blocks(void *arg)
+{
+    struct trace_buffer *w = arg;
+
+    for (;;)
+    {
+        unsigned long tail = atomic_load(&w->tail);
+        if (tail == atomic_load(&w->head))
+        {
+            /* done is set after the last block was queued */
+            if (atomic_load(&w->done) && tail == atomic_load(&w->head))
+                break;
+            sem_wait(&w->queued);
+            continue;
+        }
+
+        int slot = tail % TRACE_QUEUE;
+        trace_block *b = &w->block[slot];
+        const uint8_t *data = w->raw[slot];
+        b->compressed = trace_compress(w->raw[slot], b->size, w->packed);
+        if (b->compressed < b->size)
+            data = w->packed;
+        else
+            b->compressed = b->size;
+        if (!write_all(w->fd, b, sizeof(*b)) || !write_all(w->fd, data, b->compressed))
+            w->failed = 1;
+
+        atomic_store(&w->tail, tail + 1);
+        sem_post(&w->written);
+    }
+
+    atomic_store(&w->finished, 1);
+    return NULL;
+}
+
+/* Record the pending instruction, now that its results are in the registers */
+void trace_record(struct trace *t, const lc3_vm *vm)
+{
+    if (t->end - t->p < TRACE_RECORD_MAX)
+        trace_submit(t);
+
+    uint8_t *p = t->p + 1;
+    uint8_t f = (vm->reg[R_COND] & 7) << TRACE_CC_SHIFT;
+
+    if (t->pc != t->next_pc)
+    {
+        f |= TRACE_PC;
+        memcpy(p, &t->pc, 2);
+        p += 2;
+    }
+
+    /* Compare R0-R7 four at a time, most instructions write one register or none */
+    uint64_t now[2], before[2];
+    memcpy(now, vm->reg, sizeof(now));
+    memcpy(before, t->reg, sizeof(before));
+    if ((now[0] ^ before[0]) | (now[1] ^ before[1]))
+    {
+        uint8_t *mask = p++;
+        uint8_t written = 0;
+        for (int half = 0; half < 2; half++)
+        {
+            for (uint64_t diff = now[half] ^ before[half]; diff; )
+            {
+                int lane = __builtin_ctzll(diff) / 16;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                int r = half * 4 + 3 - lane;
+#else
+                int r = half * 4 + lane;
+#endif
+                written |= 1 << r;
+                memcpy(p, &vm->reg[r], 2);
+                p += 2;
+                diff &= ~(0xFFFFull << (lane * 16));
+            }
+        }
+        memcpy(t->reg, now, sizeof(now));
+        f |= TRACE_REGS;
+        *mask = written;
+    }
+
+    if (t->has_store)
+    {
+        f |= TRACE_STORE;
+        memcpy(p, &t->store_addr, 2);
+        memcpy(p + 2, &t->store_val, 2);
+        p += 4;
+        t->has_store = 0;
+    }
+
+    if (vm->reg[R_COND] != t->cond)
+    {
+        f |= TRACE_CC;
+        t->cond = vm->reg[R_COND];
+    }
+
+    memcpy(p, &t->instr, 2);
+    p += 2;
+    *t->p = f;
+
+    /* A signal handler closing the trace sees the record complete or not at all */
+    atomic_signal_fence(memory_order_seq_cst);
+    t->p = p;
+    t->next_pc = t->pc + 1;
+    t->count++;
+    t->pending = 0;
+}
+
+/* Point the recorder at the block the writer has to take next */
+static void start_block(struct trace *t)
+{
+    struct trace_buffer *w = t->writer;
+    t->block = atomic_load(&w->head);
+    t->p = w->raw[t->block % TRACE_QUEUE];
+    t->end = t->p + TRACE_BLOCK_SIZE;
+    t->count = 0;
+
+    /* The first record of a block carries its pc */
+    t->next_pc = t->pc + 1;
+}
+
+/* Describe the block being filled and queue it for the writer */
+static void queue_block(struct trace *t)
+{
+    struct trace_buffer *w = t->writer;
+    int slot = t->block % TRACE_QUEUE;
+    w->block[slot].first = t->retired;
+    w->block[slot].count = t->count;
+    w->block[slot].size = t->p - w->raw[slot];
+    atomic_store(&w->head, t->block + 1);
+    sem_post(&w->queued);
+}
+
+void trace_submit(struct trace *t)
+{
+    struct trace_buffer *w = t->writer;
+    queue_block(t);
+    t->retired += t->count;
+
+    /* Throttle the interpreter while the writer is a whole queue behind */
+    while (atomic_load(&w->head) - atomic_load(&w->tail) == TRACE_QUEUE)
+        sem_wait(&w->written);
+
+    start_block(t);
+}
+
+struct trace *trace_open(const char *path, const lc3_vm *vm)
+{
+    struct trace *t = calloc(1, sizeof(struct trace));
+    struct trace_buffer *w = calloc(1, sizeof(struct trace_buffer));
+    if (!t || !w)
+    {
+        free(w);
+        free(t);
+        return NULL;
+    }
+
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0)
+        goto fail;
+
+    trace_header header = {TRACE_MAGIC, TRACE_VERSION, TRACE_BYTE_ORDER};
+    memcpy(header.reg, vm->reg, sizeof(header.reg));
+    if (!write_all(w->fd, &header, sizeof(header)))
+        goto fail;
+
+    sem_init(&w->queued, 0, 0);
+    sem_init(&w->written, 0, 0);
+    t->writer = w;
+    start_block(t);
+    if (pthread_create(&w->thread, NULL, write_blocks, w) != 0)
+        goto fail;
+
+    memcpy(t->reg, vm->reg, sizeof(t->reg));
+    t->cond = vm->reg[R_COND];
+    return t;
+
+fail:
+    if (w->fd >= 0)
+        close(w->fd);
+    free(w);
+    free(t);
+    return NULL;
+}
+
+/*
+    Only atomics, sem_post and system calls until the writer is gone: this also runs in
+    a signal handler that interrupted the recorder, a record or block it was in the
+    middle of adding is left out then.
+*/
+int trace_close(struct trace *t)
+{
+    struct trace_buffer *w = t->writer;
+    struct timespec poll = {0, TRACE_POLL_MS * 1000000L};
+
+    /* Queue the block being filled unless it is empty or already queued */
+    if (t->count && atomic_load(&w->head) == t->block)
+    {
+        while (atomic_load(&w->head) - atomic_load(&w->tail) == TRACE_QUEUE)
+            nanosleep(&poll, NULL);
+        queue_block(t);
+    }
+
+    atomic_store(&w->done, 1);
+    sem_post(&w->queued);
+    while (!atomic_load(&w->finished))
+        nanosleep(&poll, NULL);
+    pthread_join(w->thread, NULL);
+
+    /* The semaphores are not destroyed, the recorder may be waiting on one under the signal handler */
+    int ok = !w->failed && close(w->fd) == 0;
+    free(w);
+    free(t);
+    return ok;
+}
@@ -0,0 +1,122 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+    Execution trace file layout: a trace_header with the registers when tracing started,
+    then blocks of records, each a trace_block followed by its records compressed with
+    trace_compress. Every instruction retired is one record:
+
+        flags   1 byte, TRACE_* bits and the condition codes in bits 4-6
+        pc      2 bytes if TRACE_PC, otherwise the previous record's pc + 1
+        regs    if TRACE_REGS a byte with a bit per register R0-R7 written,
+                then 2 bytes per register set
+        store   if TRACE_STORE the address and value, 2 bytes each
+        instr   2 bytes, the instruction word
+
+    Numbers are in the byte order of the host that wrote the trace. The first record of a
+    block always has TRACE_PC, so blocks can be decoded on their own.
+*/
+#define TRACE_MAGIC "LC3TRACE"
+#define TRACE_VERSION 1
+#define TRACE_BYTE_ORDER 0x01020304
+
+/* Uncompressed size of a block, the interpreter fills one while the previous ones are compressed */
+#define TRACE_BLOCK_SIZE (64 * 1024)
+
+/* Longest record */
+#define TRACE_RECORD_MAX (1 + 2 + 1 + 8 * 2 + 4 + 2)
+
+enum
+{
+    TRACE_PC = 1 << 0,    /* the pc does not follow the previous record's */
+    TRACE_REGS = 1 << 1,  /* general purpose registers were written */
+    TRACE_STORE = 1 << 2, /* memory was written */
+    TRACE_CC = 1 << 3,    /* the condition codes changed */
+};
+#define TRACE_CC_SHIFT 4
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; /* TRACE_BYTE_ORDER as written by the host that recorded the trace */
+    uint16_t reg[R_COUNT];
+} trace_header;
+
+typedef struct
+{
+    uint64_t first;      /* number of the first instruction in the block, counting from 0 */
+    uint32_t count;      /* records in the block, there may be one more at the end */
+    uint32_t size;       /* uncompressed size */
+    uint32_t compressed; /* size in the file, equal to size if the block is stored as is */
+} trace_block;
+
+struct trace_buffer;
+
+/* Recorder of one VM, filled by the tracing interpreter loop */
+struct trace
+{
+    /* Block being filled: its number, the end of the last complete record */
+    unsigned long block;
+    uint8_t *p, *end;
+    uint32_t count;
+    uint64_t retired;
+
+    /* The last instruction fetched, recorded once its effects are known */
+    int pending;
+    uint16_t pc, instr;
+    int has_store;
+    uint16_t store_addr, store_val;
+
+    /* What the previous record left behind */
+    uint16_t next_pc;
+    uint16_t reg[8];
+    uint16_t cond;
+
+    struct trace_buffer *writer;
+};
+
+struct trace *trace_open(const char *path, const lc3_vm *vm);
+
+/*
+    Write the rest of the trace and close the file. Returns 1 if all of it was written.
+    Instructions are recorded as the next one is fetched, the caller records the last one
+*/
+int trace_close(struct trace *t);
+
+/* Hand the block over to the compression thread and start the next one */
+void trace_submit(struct trace *t);
+
+/* Record the pending instruction, now that its results are in the registers */
+void trace_record(struct trace *t, const lc3_vm *vm);
+
+/* The instruction at pc is about to run: record the one before it */
+static inline void trace_fetch(struct trace *t, const lc3_vm *vm, uint16_t pc)
+{
+    if (t->pending)
+        trace_record(t, vm);
+    t->pending = 1;
+    t->pc = pc;
+    t->instr = vm->memory[pc];
+}
+
+static inline void trace_store(struct trace *t, uint16_t addr, uint16_t val)
+{
+    t->has_store = 1;
+    t->store_addr = addr;
+    t->store_val = val;
+}
+
+/* LZ77 compression of a block, dst needs room for TRACE_COMPRESS_BOUND(size) bytes */
+#define TRACE_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+size_t trace_compress(const uint8_t *src, size_t size, uint8_t *dst);
+
+/* Returns the decompressed size, 0 if src is corrupt or does not fit into max bytes */
+size_t trace_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t max);
+
+#endif
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "vm.h"
+#include "trace.h"
+
+/*
+    lc3-trace: prints the instructions of a trace file written by `lc3 --trace` that match
+    every filter given. Blocks outside --from/--to are skipped without decompressing them.
+*/
+
+static const char *op_names[16] = {"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+                                   "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"};
+
+typedef struct
+{
+    uint64_t from, to; /* instructions from <= n < to */
+    int pc, writes;    /* address, -1 for any */
+    int reg;           /* register written, -1 for any */
+    int summary;
+} query;
+
+/* x3000, 0x3000 or a decimal number */
+static long parse_number(const char *s)
+{
+    if (s[0] == 'x' || s[0] == 'X')
+        return strtol(s + 1, NULL, 16);
+    return strtol(s, NULL, 0);
+}
+
+static void usage()
+{
+    printf("lc3-trace trace-file [--from n] [--to n] [--pc addr] [--writes addr] [--reg r] [--summary]\n");
+    exit(2);
+}
+
+/* Decode the records of one block, print those that match. Returns 0 if the block is corrupt */
+static int scan_block(const trace_block *b, const uint8_t *data, const query *q)
+{
+    const uint8_t *p = data, *end = data + b->size;
+    uint16_t pc = 0;
+
+    for (uint64_t n = b->first; n < b->first + b->count; n++)
+    {
+        if (end - p < 3)
+            return 0;
+        uint8_t f = *p++;
+        if (f & TRACE_PC)
+        {
+            memcpy(&pc, p, 2);
+            p += 2;
+        }
+        else if (n == b->first)
+            return 0;
+
+        uint8_t written = 0;
+        uint16_t val[8];
+        if (f & TRACE_REGS)
+        {
+            written = *p++;
+            for (int r = 0; r < 8; r++)
+            {
+                if (!(written & (1 << r)))
+                    continue;
+                if (end - p < 2)
+                    return 0;
+                memcpy(&val[r], p, 2);
+                p += 2;
+            }
+        }
+
+        uint16_t store_addr = 0, store_val = 0;
+        if (f & TRACE_STORE)
+        {
+            if (end - p < 4)
+                return 0;
+            memcpy(&store_addr, p, 2);
+            memcpy(&store_val, p + 2, 2);
+            p += 4;
+        }
+
+        if (end - p < 2)
+            return 0;
+        uint16_t instr;
+        memcpy(&instr, p, 2);
+        p += 2;
+
+        if (n >= q->from && n < q->to &&
+            (q->pc < 0 || q->pc == pc) &&
+            (q->writes < 0 || ((f & TRACE_STORE) && store_addr == q->writes)) &&
+            (q->reg < 0 || (written & (1 << q->reg))))
+        {
+            printf("%10llu  x%04X  x%04X  %-4s", (unsigned long long)n, pc, instr, op_names[instr >> 12]);
+            for (int r = 0; r < 8; r++)
+            {
+                if (written & (1 << r))
+                    printf("  R%d=x%04X", r, val[r]);
+            }
+            if (f & TRACE_STORE)
+                printf("  [x%04X]=x%04X", store_addr, store_val);
+            if (f & TRACE_CC)
+            {
+                int cc = (f >> TRACE_CC_SHIFT) & 7;
+                printf("  CC=%c", cc & FL_N ? 'N' : cc & FL_Z ? 'Z' : 'P');
+            }
+            printf("\n");
+        }
+        pc++;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    query q = {0, UINT64_MAX, -1, -1, -1, 0};
+    const char *path = NULL;
+
+    for (int j = 1; j < argc; ++j)
+    {
+        if (strcmp(argv[j], "--from") == 0 && j + 1 < argc)
+            q.from = strtoull(argv[++j], NULL, 10);
+        else if (strcmp(argv[j], "--to") == 0 && j + 1 < argc)
+            q.to = strtoull(argv[++j], NULL, 10);
+        else if (strcmp(argv[j], "--pc") == 0 && j + 1 < argc)
+            q.pc = parse_number(argv[++j]) & 0xFFFF;
+        else if (strcmp(argv[j], "--writes") == 0 && j + 1 < argc)
+            q.writes = parse_number(argv[++j]) & 0xFFFF;
+        else if (strcmp(argv[j], "--reg") == 0 && j + 1 < argc)
+        {
+            const char *r = argv[++j];
+            q.reg = atoi(r[0] == 'R' || r[0] == 'r' ? r + 1 : r) & 7;
+        }
+        else if (strcmp(argv[j], "--summary") == 0)
+            q.summary = 1;
+        else if (!path && argv[j][0] != '-')
+            path = argv[j];
+        else
+            usage();
+    }
+    if (!path)
+        usage();
+
+    FILE *f = fopen(path, "rb");
+    trace_header header;
+    if (!f || fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, 8) != 0 ||
+        header.version != TRACE_VERSION)
+    {
+        fprintf(stderr, "not a trace file: %s\n", path);
+        return 1;
+    }
+    if (header.byte_order != TRACE_BYTE_ORDER)
+    {
+        fprintf(stderr, "trace was recorded on a host with another byte order: %s\n", path);
+        return 1;
+    }
+
+    static uint8_t packed[TRACE_COMPRESS_BOUND(TRACE_BLOCK_SIZE)];
+    static uint8_t data[TRACE_BLOCK_SIZE];
+    uint64_t instructions = 0, raw = 0, stored = 0;
+    unsigned long blocks = 0;
+    trace_block b;
+
+    while (fread(&b, sizeof(b), 1, f) == 1)
+    {
+        blocks++;
+        instructions = b.first + b.count;
+        raw += b.size;
+        stored += b.compressed;
+        if (b.size > TRACE_BLOCK_SIZE || b.compressed > sizeof(packed))
+        {
+            fprintf(stderr, "corrupt block at instruction %llu\n", (unsigned long long)b.first);
+            return 1;
+        }
+
+        if (q.summary || b.first + b.count <= q.from || b.first >= q.to)
+        {
+            if (fseek(f, b.compressed, SEEK_CUR) != 0)
+                break;
+            continue;
+        }
+
+        if (fread(packed, 1, b.compressed, f) != b.compressed)
+            break;
+        const uint8_t *block = packed;
+        if (b.compressed < b.size)
+        {
+            if (trace_decompress(packed, b.compressed, data, sizeof(data)) != b.size)
+            {
+                fprintf(stderr, "corrupt block at instruction %llu\n", (unsigned long long)b.first);
+                return 1;
+            }
+            block = data;
+        }
+        if (!scan_block(&b, block, &q))
+        {
+            fprintf(stderr, "corrupt block at instruction %llu\n", (unsigned long long)b.first);
+            return 1;
+        }
+    }
+
+    if (q.summary)
+    {
+        printf("instructions  %llu\n", (unsigned long long)instructions);
+        printf("start pc      x%04X\n", header.reg[R_PC]);
+        printf("blocks        %lu\n", blocks);
+        printf("record bytes  %llu (%.2f per instruction)\n", (unsigned long long)raw,
+               instructions ? (double)raw / instructions : 0);
+        printf("file bytes    %llu (%.3f per instruction)\n", (unsigned long long)stored,
+               instructions ? (double)stored / instructions : 0);
+    }
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,1839 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+/* unix specific */
+#include <unistd.h>
+
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "vm.h"
+#include "jit.h"
+#include "profile.h"
+#include "trace.h"
+#include "input.h"
+#include "console.h"
+#include "rom.h"
+#include "simd.h"
+#include "history.h"
+
+
+/* TRAP Codes */
+enum
+{
+    TRAP_GETC = 0x20,  /* get character from keyboard, not echoed onto the terminal */
+    TRAP_OUT = 0x21,   /* output a character */
+    TRAP_PUTS = 0x22,  /* output a word string */
+    TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
+    TRAP_PUTSP = 0x24, /* output a byte string */
+    TRAP_HALT = 0x25   /* halt the program */
+};
+
+/* Nothing is translated while the JIT is disabled */
+static const uint8_t no_code[MEMORY_MAX];
+
+/* Print registers (Debugging )*/
+void print_registers(lc3_vm *vm)
+{
+    printf("PC: %x PSR: %x CC: %x\nR0: %x, R1 : %x, R2: %x, R3: %x\nR4 : %x, R5 : %x, R6 : %x, R7 : %x\n", vm->reg[R_PC], vm->reg[R_PSR], vm->reg[R_COND], vm->reg[R_R0], vm->reg[R_R1], vm->reg[R_R2], vm->reg[R_R3], vm->reg[R_R4], vm->reg[R_R5], vm->reg[R_R6], vm->reg[R_R7]);
+}
+
+/* Write len characters to the console, in one call if the console can take them at once */
+static void io_write(lc3_vm *vm, const char *s, size_t len)
+{
+    if (vm->io.write)
+        vm->io.write(vm->io.ctx, s, len);
+    else
+        while (len-- > 0)
+            vm->io.write_char(vm->io.ctx, *s++);
+}
+
+/* Write a string to the console */
+void io_puts(lc3_vm *vm, const char *s)
+{
+    io_write(vm, s, strlen(s));
+    vm->io.flush(vm->io.ctx);
+}
+
+/* Swaps the bits of an input unsigned 16 bit integer */
+uint16_t swap16(uint16_t x)
+{
+    return (x << 8) | (x >> 8);
+}
+
+/* Place an image (origin followed by instructions) in the LC-3 VM memory. Returns 1 on success, 0 otherwise */
+int read_image_data(lc3_vm *vm, const uint8_t *data, size_t size)
+{
+    if (size < sizeof(uint16_t))
+        return 0;
+
+    /* Origin informs us where in memory to place the image */
+    uint16_t orig;
+    memcpy(&orig, data, sizeof(orig));
+    orig = swap16(orig);
+
+    /* Set PC equal to origin */
+    vm->reg[R_PC] = orig;
+
+    size_t read = (size - sizeof(orig)) / sizeof(uint16_t);
+    uint16_t max_read = UINT16_MAX - orig;
+    if (read > max_read)
+        read = max_read;
+
+    /* Declare pointer to current memory location to write */
+    uint16_t *p = vm->memory + orig;
+    memcpy(p, data + sizeof(orig), read * sizeof(uint16_t));
+
+    /* The LC-3 uses big endian to interpret the instructions,
+        however most modern computers are little endian.
+        Therefore, it is necessary to swap the bits
+    */
+    simd_swap16(p, p, read);
+    return 1;
+}
+
+/* Read image file into the LC-3 VM memory. Returns 1 on success, 0 otherwise */
+int read_image(lc3_vm *vm, const char *file)
+{
+    /* Map the file instead of copying it through stdio buffers */
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return 0;
+
+    int ok = read_image_data(vm, data, st.st_size);
+    munmap(data, st.st_size);
+    return ok;
+}
+
+/* Map size bytes of fd at offset copy-on-write over the VM's memory, or read them if that fails */
+int map_memory(lc3_vm *vm, int fd, off_t offset)
+{
+    void *mem = mmap(vm->memory, sizeof(vm->memory), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+    if (mem == MAP_FAILED &&
+        pread(fd, vm->memory, sizeof(vm->memory), offset) != sizeof(vm->memory))
+        return 0;
+
+    vm->running = (vm->memory[MR_MCR] >> 15) & 1;
+    memory_changed(vm);
+    return 1;
+}
+
+uint16_t sign_extend(uint16_t n, int bit_count)
+{
+    /* If the most significant bit is set to 1, set the all bits to the left*/
+    if ((n >> (bit_count - 1)) & 1)
+        n |= (0xFFFF << bit_count);
+    return n;
+}
+
+/*
+    Memory mapped devices. Only the device page is looked up in the device map, every
+    other page is plain memory. Reads and writes of an address no device was mapped at
+    behave like memory.
+*/
+static uint16_t device_read(lc3_vm *vm, uint16_t addr)
+{
+    const lc3_device *dev = &vm->devices[vm->device_map[addr - LC3_DEVICE_PAGE]];
+    return dev->read ? dev->read(dev->ctx, vm, addr) : vm->memory[addr];
+}
+
+static void device_write(lc3_vm *vm, uint16_t addr, uint16_t val)
+{
+    const lc3_device *dev = &vm->devices[vm->device_map[addr - LC3_DEVICE_PAGE]];
+    if (dev->write)
+        dev->write(dev->ctx, vm, addr, val);
+    /* The store may have enabled an interrupt */
+    vm->armed = 1;
+}
+
+/* Memory access helpers are on the interpreter's hot path, keep them inline */
+static inline uint16_t mem_read(lc3_vm *vm, uint16_t addr)
+{
+    if (addr >= LC3_DEVICE_PAGE)
+        return device_read(vm, addr);
+    return vm->memory[addr];
+}
+
+/*
+    The map of addresses whose stores take mem_write's slow path: all of them while the VM
+    is recorded, else its watchpoints while it is debugged, else its translated code
+*/
+static void set_code_map(lc3_vm *vm)
+{
+    if (vm->history)
+        vm->code_map = vm->history->map;
+    else if (vm->debug)
+        vm->code_map = vm->debug->watch;
+    else if (vm->jit)
+        vm->code_map = vm->jit->code_map;
+    else if (vm->aot)
+        vm->code_map = vm->aot_map;
+    else
+        vm->code_map = no_code;
+}
+
+/* A store hit translated code: the JIT translates again, ahead-of-time code is given up */
+static void code_written(lc3_vm *vm)
+{
+    if (vm->jit)
+        jit_flush(vm->jit);
+    else
+    {
+        vm->aot = NULL;
+        vm->code_map = no_code;
+    }
+}
+
+/* A store to a watched address: the loop stops after the instruction, like after a halt */
+static void watch_hit(lc3_vm *vm, uint16_t addr)
+{
+    vm->debug->stop = LC3_STOP_WATCHPOINT;
+    vm->debug->watch_address = addr;
+    vm->running = 0;
+}
+
+/*
+    A store to an address marked in code_map: while the VM is recorded the map marks
+    every address and the old value goes to the history first, while it is debugged the
+    map holds its watchpoints instead of translated code
+*/
+static void marked_write(lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    if (vm->history)
+        history_store(vm->history, vm, address);
+
+    vm->memory[address] = val;
+    vm->dcache[address].handler = 0;
+    if (address >= LC3_DEVICE_PAGE)
+        device_write(vm, address, val);
+
+    if (vm->debug)
+    {
+        if (vm->debug->watch[address])
+            watch_hit(vm, address);
+    }
+    else if (!vm->history)
+        code_written(vm);
+}
+
+/* Memory Access */
+static inline void mem_write(lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    if (vm->code_map[address])
+    {
+        marked_write(vm, address, val);
+        return;
+    }
+
+    vm->memory[address] = val;
+    /*
+        The location may hold code, it is decoded again the next time it is executed.
+        Data stores leave the decoded cache untouched, its pages stay unbacked
+    */
+    if (vm->dcache[address].handler)
+        vm->dcache[address].handler = 0;
+
+    if (address >= LC3_DEVICE_PAGE)
+        device_write(vm, address, val);
+}
+
+/*
+    The keyboard and the native traps set device registers themselves, a recorded VM
+    keeps their old values like for a store
+*/
+static void device_set(lc3_vm *vm, uint16_t addr, uint16_t val)
+{
+    if (vm->history)
+        history_store(vm->history, vm, addr);
+    vm->memory[addr] = val;
+}
+
+/*
+    Keyboard: reading the status register polls the console, reading the data register
+    clears the ready bit. A key that requested an interrupt stays ready until it is read.
+*/
+static uint16_t keyboard_read(void *ctx, lc3_vm *vm, uint16_t addr)
+{
+    uint16_t enable = vm->memory[MR_KBSR] & LC3_INTERRUPT_ENABLE;
+
+    if (addr == MR_KBDR)
+    {
+        if (vm->memory[MR_KBSR] != enable)
+            device_set(vm, MR_KBSR, enable);
+    }
+    else if (addr == MR_KBSR && !(enable && vm->memory[MR_KBSR] >> 15))
+    {
+        /* check if the console has a key ready to be read */
+        if (vm->io.key_ready(vm->io.ctx))
+        {
+            /* The ready bit (bit [15]) indicates if the keyboard has received a new character. */
+            device_set(vm, MR_KBSR, (1 << 15) | enable);
+            /* Place the character in the KeyBoard Data Register */
+            device_set(vm, MR_KBDR, vm->io.read_key(vm->io.ctx));
+        }
+        else
+        {
+            /* Polling must not copy a device page the VM still shares with others */
+            if (vm->memory[MR_KBSR] != enable)
+                device_set(vm, MR_KBSR, enable);
+            /* The program is about to wait for input, show everything it wrote before */
+            vm->io.flush(vm->io.ctx);
+        }
+    }
+    return vm->memory[addr];
+}
+
+static int keyboard_interrupt(void *ctx, lc3_vm *vm, uint8_t *vector)
+{
+    uint16_t status = vm->memory[MR_KBSR];
+    if (!(status & LC3_INTERRUPT_ENABLE))
+        return -1;
+    if (!(status >> 15) && !(keyboard_read(ctx, vm, MR_KBSR) >> 15))
+        return 0;
+
+    /* The end of input (read_key returned -1) is no key to interrupt for */
+    if (vm->memory[MR_KBDR] == 0xFFFF)
+    {
+        device_set(vm, MR_KBSR, status & LC3_INTERRUPT_ENABLE);
+        return 0;
+    }
+    *vector = LC3_KEYBOARD_VECTOR;
+    return LC3_KEYBOARD_PRIORITY;
+}
+
+/*
+    A character written in the low byte of the device data register will be displayed on the screen.
+    The console buffers it until the program polls the keyboard or stops running.
+*/
+static void display_write(void *ctx, lc3_vm *vm, uint16_t addr, uint16_t val)
+{
+    if (addr == MR_DDR)
+        vm->io.write_char(vm->io.ctx, val & 0xFF);
+}
+
+static void mcr_write(void *ctx, lc3_vm *vm, uint16_t addr, uint16_t val)
+{
+    vm->running = (val >> 15) & 1;
+}
+
+/* Basic blocks between polls of the devices for interrupts */
+#define INTERRUPT_POLL 256
+
+/* Longest the host sleeps at a time while the program waits for an interrupt */
+#define INTERRUPT_WAIT_MS 1
+
+/*
+    Most urgent interrupt requested above the current priority, as level << 8 | vector,
+    -1 if none. Polling stops until the next store to the device page once no device
+    may request one.
+*/
+static int poll_interrupts(lc3_vm *vm)
+{
+    int priority = (vm->reg[R_PSR] >> 8) & 0x7;
+    int request = -1;
+
+    vm->armed = 0;
+    for (int i = 1; i < vm->device_count; i++)
+    {
+        const lc3_device *dev = &vm->devices[i];
+        uint8_t vector;
+        int level = dev->interrupt ? dev->interrupt(dev->ctx, vm, &vector) : -1;
+        if (level >= 0)
+            vm->armed = 1;
+        if (level > priority)
+        {
+            priority = level;
+            request = level << 8 | vector;
+        }
+    }
+    return request;
+}
+
+/*
+    The program waits for an interrupt in a BR to itself, nothing else could happen:
+    sleep until a key arrives (unless the input ended) or a little while passed.
+*/
+static void wait_interrupt(lc3_vm *vm)
+{
+    vm->io.flush(vm->io.ctx);
+    if (vm->io.wait_key && (vm->memory[MR_KBSR] & LC3_INTERRUPT_ENABLE) && vm->memory[MR_KBDR] != 0xFFFF)
+        vm->io.wait_key(vm->io.ctx, INTERRUPT_WAIT_MS);
+    else
+        nanosleep(&(struct timespec){0, INTERRUPT_WAIT_MS * 1000000}, NULL);
+}
+
+/* Print a section of vm->memory */
+void print_mem(lc3_vm *vm, uint16_t start, uint16_t end)
+{
+    for (int i = start; i <= end; i++)
+    {
+        printf("%x : %x\n", i, mem_read(vm, i));
+    }
+}
+
+/* Update Flags given the register */
+static inline void update_flags(lc3_vm *vm, uint16_t r)
+{
+    if (vm->reg[r] == 0)
+    {
+        vm->reg[R_COND] = FL_Z;
+    }
+    else if (vm->reg[r] >> 15) /* a 1 in the left-most bit indicates negative */
+    {
+        vm->reg[R_COND] = FL_N;
+    }
+    else
+    {
+        vm->reg[R_COND] = FL_P;
+    }
+}
+
+/*
+    Native trap routines. Each one stands in for the routine of the built-in OS and leaves
+    the same registers, condition codes and memory behind, including the words the OS
+    routine saves registers to. They only run while the trap vector still points at the
+    OS routine, and return -1 to leave the TRAP to the emulated routine when it would
+    have to wait for a device.
+*/
+
+/* Entry points of the OS routines, indexed by trap vector - TRAP_GETC */
+static const uint16_t os_trap_routine[] = {0x0400, 0x0430, 0x0450, 0x04A0, 0x04E0, 0xFD70};
+
+static int os_vector(lc3_vm *vm, uint16_t trap_vect)
+{
+    return vm->memory[trap_vect] == os_trap_routine[trap_vect - TRAP_GETC];
+}
+
+/* Load a register like the LD the OS routines restore it with */
+static void native_load(lc3_vm *vm, uint16_t r, uint16_t addr)
+{
+    vm->reg[r] = mem_read(vm, addr);
+    update_flags(vm, r);
+}
+
+/* OUT once the display is ready, R7 holds the return address */
+static void native_out(lc3_vm *vm)
+{
+    mem_write(vm, 0x043B, vm->reg[R_R7]);
+    mem_write(vm, 0x043A, vm->reg[R_R1]);
+    mem_write(vm, MR_DDR, vm->reg[R_R0]);
+    native_load(vm, R_R1, 0x043A);
+    native_load(vm, R_R7, 0x043B);
+}
+
+/* Words of a string the native PUTS and PUTSP write to the console at once */
+#define STRING_BLOCK 256
+
+/*
+    Write the string at addr to the console like PUTS, or like PUTSP if packed: two
+    characters per word, low byte first, a word with a zero high byte is the last. Plain
+    memory is searched for the end of the string and narrowed to characters a block at a
+    time. Device registers are read one word at a time, reading them has side effects.
+*/
+static void write_string(lc3_vm *vm, uint16_t addr, int packed)
+{
+    char buf[2 * STRING_BLOCK];
+    for (;;)
+    {
+        uint16_t c;
+        if (addr >= LC3_DEVICE_PAGE)
+        {
+            if (!(c = mem_read(vm, addr++)))
+                return;
+            buf[0] = c & 0xFF;
+            buf[1] = c >> 8;
+            size_t bytes = packed && (c >> 8) ? 2 : 1;
+            device_set(vm, MR_DDR, packed ? (uint8_t)buf[bytes - 1] : c);
+            io_write(vm, buf, bytes);
+            if (packed && bytes == 1)
+                return;
+            continue;
+        }
+
+        size_t n = LC3_DEVICE_PAGE - addr;
+        if (n > STRING_BLOCK)
+            n = STRING_BLOCK;
+        const uint16_t *p = vm->memory + addr;
+        size_t len = simd_find_zero(p, n, packed ? 0xFF00 : 0xFFFF);
+        if (packed)
+        {
+            /* On a little endian host the words are the characters in order */
+            size_t bytes = 2 * len + (len < n && p[len]);
+            memcpy(buf, p, bytes);
+            if (bytes)
+            {
+                device_set(vm, MR_DDR, (uint8_t)buf[bytes - 1]);
+                io_write(vm, buf, bytes);
+            }
+            if (len < n)
+                return;
+        }
+        else
+        {
+            simd_narrow(buf, p, len);
+            if (len)
+            {
+                device_set(vm, MR_DDR, p[len - 1]);
+                io_write(vm, buf, len);
+            }
+            if (len < n)
+                return;
+        }
+        addr += n;
+    }
+}
+
+/* PUTS once the display is ready, R7 holds the return address */
+static void native_puts(lc3_vm *vm)
+{
+    mem_write(vm, 0x0467, vm->reg[R_R7]);
+    mem_write(vm, 0x0464, vm->reg[R_R0]);
+    mem_write(vm, 0x0465, vm->reg[R_R1]);
+    mem_write(vm, 0x0466, vm->reg[R_R2]);
+
+    /*
+        Write a string of ASCII characters to the console display. The characters are contained
+        in consecutive memory locations, one character per memory location, starting with
+        the address specified in RO. Writing terminates with the occurrence of xOOOO in a
+        memory location.
+    */
+    write_string(vm, vm->reg[R_R0], 0);
+
+    native_load(vm, R_R0, 0x0464);
+    native_load(vm, R_R1, 0x0465);
+    native_load(vm, R_R2, 0x0466);
+    native_load(vm, R_R7, 0x0467);
+}
+
+/* Run the trap natively. Returns the PC to continue at, or -1 to run the OS routine instead */
+static int native_trap(lc3_vm *vm, uint16_t trap_vect)
+{
+    uint16_t *reg = vm->reg;
+    int display_ready = vm->memory[MR_DSR] >> 15;
+
+    if (trap_vect < TRAP_GETC || trap_vect > TRAP_HALT || !os_vector(vm, trap_vect))
+        return -1;
+
+    switch (trap_vect)
+    {
+    case TRAP_GETC:
+    {
+        /* Read a single character from the keyboard. The character is not echoed onto the
+console. Its ASCII code is copied into RO. The high eight bits of RO are cleared. 
+        */
+        if (!(mem_read(vm, MR_KBSR) >> 15))
+            return -1;
+        mem_write(vm, 0x0408, reg[R_R7]);
+        reg[R_R0] = mem_read(vm, MR_KBDR);
+        native_load(vm, R_R7, 0x0408);
+    }
+    break;
+    case TRAP_OUT:
+    {
+        /*
+            Write a character in R0[7:0] to the console display.
+        */
+        if (!display_ready)
+            return -1;
+        native_out(vm);
+    }
+    break;
+    case TRAP_PUTS:
+    {
+        if (!display_ready)
+            return -1;
+        native_puts(vm);
+    }
+    break;
+    case TRAP_IN:
+    {
+        /*
+            Print a prompt on the screen and read a single character from the keyboard. The
+character is echoed onto the console monitor, and its ASCII code is copied into RO.
+The high eight bits of RO are cleared.
+
+            The OS routine calls PUTS, GETC and OUT through their trap vectors.
+        */
+        if (!display_ready || !os_vector(vm, TRAP_GETC) || !os_vector(vm, TRAP_OUT) || !os_vector(vm, TRAP_PUTS))
+            return -1;
+        /* GETC polls the keyboard exactly once when a key is ready, do it before the prompt */
+        if (!(mem_read(vm, MR_KBSR) >> 15))
+            return -1;
+        mem_write(vm, 0x04A7, reg[R_R7]);
+        reg[R_R0] = 0x04A8;
+        reg[R_R7] = 0x04A3;
+        native_puts(vm);
+        reg[R_R7] = 0x04A4;
+        mem_write(vm, 0x0408, reg[R_R7]);
+        reg[R_R0] = mem_read(vm, MR_KBDR);
+        native_load(vm, R_R7, 0x0408);
+        reg[R_R7] = 0x04A5;
+        native_out(vm);
+        native_load(vm, R_R7, 0x04A7);
+    }
+    break;
+    case TRAP_PUTSP:
+    {
+        /*
+            Write a string of ASCII characters to the console. The characters are contained in
+            consecutive memory locations, two characters per memory location, starting with the
+            address specified in RO. The ASCII code contained in bits [7:0] of a memory location
+            is written to the console first. Then the ASCII code contained in bits [15:8] of that
+            memory location is written to the console. (A character string consisting of an odd
+            number of characters to be written will have xOO in bits [15:8J of the vm->memory
+            location containing the last character to be written.) Writing terminates with the
+            occurrence of xOOOO in a memory location.
+
+            The OS routine never returns (its DSR pointer is off by one word), so this follows
+            the specification and saves registers where the routine would.
+        */
+        if (!display_ready)
+            return -1;
+        mem_write(vm, 0x0508, reg[R_R7]);
+        mem_write(vm, 0x0504, reg[R_R0]);
+        mem_write(vm, 0x0505, reg[R_R1]);
+        mem_write(vm, 0x0506, reg[R_R2]);
+        mem_write(vm, 0x0507, reg[R_R3]);
+
+        write_string(vm, reg[R_R0], 1);
+
+        native_load(vm, R_R0, 0x0504);
+        native_load(vm, R_R1, 0x0505);
+        native_load(vm, R_R2, 0x0506);
+        native_load(vm, R_R3, 0x0507);
+        native_load(vm, R_R7, 0x0508);
+    }
+    break;
+    case TRAP_HALT:
+    {
+        /* Halt execution and print a message on the console. */
+        if (!display_ready || !os_vector(vm, TRAP_PUTS))
+            return -1;
+        mem_write(vm, 0xFD7F, reg[R_R7]);
+        mem_write(vm, 0xFD7E, reg[R_R1]);
+        mem_write(vm, 0xFD7D, reg[R_R0]);
+        reg[R_R0] = 0xFD80;
+        reg[R_R7] = 0xFD75;
+        native_puts(vm);
+
+        /* Clear bit [15] of the Machine Control Register through the pointer at xFDA5 */
+        native_load(vm, R_R1, mem_read(vm, 0xFDA5));
+        native_load(vm, R_R0, 0xFDA6);
+        reg[R_R0] &= reg[R_R1];
+        update_flags(vm, R_R0);
+        mem_write(vm, mem_read(vm, 0xFDA5), reg[R_R0]);
+        if (!vm->running)
+            return 0xFD79;
+
+        native_load(vm, R_R0, 0xFD7D);
+        native_load(vm, R_R1, 0xFD7E);
+        native_load(vm, R_R7, 0xFD7F);
+    }
+    break;
+    }
+
+    /* Every routine returns with JMP R7 */
+    return reg[R_R7];
+}
+
+/* Console of the reference VM in a conformance check */
+typedef struct
+{
+    char *out;
+    size_t len, cap;
+    int keys[2]; /* characters the native routine read, replayed to the OS routine */
+    int key_count, next_key;
+    lc3_io host; /* console of the checked VM, output is forwarded to it */
+} check_io;
+
+static void check_record(check_io *c, int ch)
+{
+    if (c->len == c->cap)
+    {
+        c->cap = c->cap ? c->cap * 2 : 256;
+        c->out = realloc(c->out, c->cap);
+    }
+    c->out[c->len++] = ch;
+}
+
+static int check_key_ready(void *ctx)
+{
+    check_io *c = ctx;
+    return c->next_key < c->key_count;
+}
+
+static int check_read_key(void *ctx)
+{
+    check_io *c = ctx;
+    return c->next_key < c->key_count ? c->keys[c->next_key++] : -1;
+}
+
+static void check_write_char(void *ctx, int ch)
+{
+    check_record(ctx, ch);
+}
+
+static void check_flush(void *ctx)
+{
+}
+
+/* The checked VM's console: keys are remembered for the reference, output is recorded and forwarded */
+static int tee_key_ready(void *ctx)
+{
+    check_io *c = ctx;
+    return c->host.key_ready(c->host.ctx);
+}
+
+static int tee_read_key(void *ctx)
+{
+    check_io *c = ctx;
+    int key = c->host.read_key(c->host.ctx);
+    if (c->key_count < 2)
+        c->keys[c->key_count++] = key;
+    return key;
+}
+
+static void tee_write_char(void *ctx, int ch)
+{
+    check_io *c = ctx;
+    check_record(c, ch);
+    c->host.write_char(c->host.ctx, ch);
+}
+
+static void tee_flush(void *ctx)
+{
+    check_io *c = ctx;
+    c->host.flush(c->host.ctx);
+}
+
+static void run_steps(lc3_vm *vm);
+
+/* Instructions the OS routine may take before the check gives up on it */
+#define CHECK_STEP_LIMIT 1000000
+
+/* Run the trap natively and the OS routine on a copy of the VM, report any difference on stderr */
+static int checked_trap(lc3_vm *vm, uint16_t trap_vect)
+{
+    /* The OS routine of PUTSP never returns, there is nothing to compare it with */
+    if (trap_vect == TRAP_PUTSP)
+        return native_trap(vm, trap_vect);
+
+    lc3_vm *ref = malloc(sizeof(lc3_vm));
+    if (!ref)
+        return native_trap(vm, trap_vect);
+    memcpy(ref, vm, sizeof(lc3_vm));
+
+    check_io native_io = {NULL, 0, 0, {0}, 0, 0, vm->io};
+    check_io ref_io = {NULL, 0, 0, {0}, 0, 0, vm->io};
+    vm->io = (lc3_io){&native_io, tee_key_ready, tee_read_key, tee_write_char, tee_flush};
+
+    uint16_t ret = vm->reg[R_R7];
+    int pc = native_trap(vm, trap_vect);
+    vm->io = native_io.host;
+
+    if (pc >= 0)
+    {
+        lc3_vm *r = ref;
+        memcpy(ref_io.keys, native_io.keys, sizeof(ref_io.keys));
+        ref_io.key_count = native_io.key_count;
+        r->io = (lc3_io){&ref_io, check_key_ready, check_read_key, check_write_char, check_flush};
+        r->jit = NULL;
+        r->aot = NULL;
+        r->code_map = no_code;
+        r->history = NULL;
+        /* Breakpoints are for the machine being debugged, not for the routine it is checked against */
+        if (r->debug)
+        {
+            memset(r->dcache, 0, sizeof(r->dcache));
+            r->dcache_owner = NULL;
+            r->debug = NULL;
+        }
+        r->trap_mode = LC3_TRAPS_EMULATED;
+        r->reg[R_PC] = mem_read(r, trap_vect);
+        r->running = 1;
+        /* The OS routine runs as the native one did, without being interrupted */
+        r->poll = INT_MAX;
+
+        /* Single step until the routine jumps back or halts the machine */
+        unsigned long n = 0;
+        while (r->running && r->reg[R_PC] != ret && n++ < CHECK_STEP_LIMIT)
+        {
+            r->steps = 1;
+            run_steps(r);
+        }
+
+        /* The interpreter saves the PC when it leaves, the native PC is only known here */
+        vm->reg[R_PC] = pc;
+        int differs = n > CHECK_STEP_LIMIT;
+        for (int i = 0; i < R_COUNT; i++)
+            differs |= vm->reg[i] != r->reg[i];
+        differs |= vm->running != r->running;
+        differs |= !simd_equal(vm->memory, r->memory, MEMORY_MAX);
+        differs |= native_io.len != ref_io.len || (native_io.len && memcmp(native_io.out, ref_io.out, native_io.len) != 0);
+
+        if (differs)
+        {
+            vm->trap_mismatches++;
+            fprintf(stderr, "TRAP x%02X: native routine differs from the OS routine\n", trap_vect);
+            for (int i = 0; i < R_COUNT; i++)
+            {
+                if (vm->reg[i] != r->reg[i])
+                    fprintf(stderr, "  reg %d: native x%04X, OS x%04X\n", i, vm->reg[i], r->reg[i]);
+            }
+            for (int a = 0; a < MEMORY_MAX; a++)
+            {
+                if (vm->memory[a] != r->memory[a])
+                    fprintf(stderr, "  x%04X: native x%04X, OS x%04X\n", a, vm->memory[a], r->memory[a]);
+            }
+            if (native_io.len != ref_io.len || (native_io.len && memcmp(native_io.out, ref_io.out, native_io.len) != 0))
+                fprintf(stderr, "  output: native %zu bytes, OS %zu bytes\n", native_io.len, ref_io.len);
+            if (n > CHECK_STEP_LIMIT)
+                fprintf(stderr, "  the OS routine did not return\n");
+        }
+    }
+
+    free(native_io.out);
+    free(ref_io.out);
+    free(ref);
+    return pc;
+}
+
+/* Entry point of the TRAP handlers of the interpreter and the JIT while the trap mode is not LC3_TRAPS_EMULATED */
+int host_trap(lc3_vm *vm, uint16_t trap_vect)
+{
+    if (vm->trap_mode == LC3_TRAPS_CHECK)
+        return checked_trap(vm, trap_vect);
+    return native_trap(vm, trap_vect);
+}
+
+/* Decode the instruction at addr into its cache entry and return the handler to run it */
+int decode_instr(lc3_vm *vm, uint16_t addr, decoded_instr *d)
+{
+    uint16_t instr = vm->memory[addr];
+    /* PC-relative operands are relative to the incremented PC */
+    uint16_t next_pc = addr + 1;
+
+    d->r1 = (instr >> 9) & 0x7;
+    d->r2 = (instr >> 6) & 0x7;
+    d->arg = 0;
+
+    switch (instr >> 12)
+    {
+    case OP_BR:
+        d->arg = next_pc + sign_extend(instr & 0x1FF, 9);
+        if (d->r1 == 0)
+            return H_NOP;
+        /* BRnzp is taken regardless of the condition codes */
+        return d->r1 == (FL_N | FL_Z | FL_P) ? H_BR_ALWAYS : H_BR;
+    case OP_ADD:
+        if ((instr >> 5) & 0x1)
+        {
+            d->arg = sign_extend(instr & 0x1F, 5);
+            return H_ADD_IMM;
+        }
+        d->arg = instr & 0x7;
+        return H_ADD;
+    case OP_LD:
+        d->arg = next_pc + sign_extend(instr & 0x1FF, 9);
+        return H_LD;
+    case OP_ST:
+        d->arg = next_pc + sign_extend(instr & 0x1FF, 9);
+        return H_ST;
+    case OP_JSR:
+        if ((instr >> 11) & 1)
+        {
+            d->arg = next_pc + sign_extend(instr & 0x7FF, 11);
+            return H_JSR;
+        }
+        return H_JSRR;
+    case OP_AND:
+        if ((instr >> 5) & 0x1)
+        {
+            d->arg = sign_extend(instr & 0x1F, 5);
+            return H_AND_IMM;
+        }
+        d->arg = instr & 0x7;
+        return H_AND;
+    case OP_LDR:
+        d->arg = sign_extend(instr & 0x3F, 6);
+        return H_LDR;
+    case OP_STR:
+        d->arg = sign_extend(instr & 0x3F, 6);
+        return H_STR;
+    case OP_RTI:
+        return H_RTI;
+    case OP_NOT:
+        return H_NOT;
+    case OP_LDI:
+        d->arg = next_pc + sign_extend(instr & 0x1FF, 9);
+        return H_LDI;
+    case OP_STI:
+        d->arg = next_pc + sign_extend(instr & 0x1FF, 9);
+        return H_STI;
+    case OP_JMP:
+        return H_JMP;
+    case OP_LEA:
+        d->arg = next_pc + sign_extend(instr & 0x1FF, 9);
+        return H_LEA;
+    case OP_TRAP:
+        d->arg = instr & 0xFF;
+        return H_TRAP;
+    default:
+        /* OP_RESERVED does nothing */
+        return H_NOP;
+    }
+}
+
+/*
+    Faster handlers for the instruction at addr the loops decode: special cases of one
+    instruction and, given the loop's handler table, common pairs fused into one. The
+    second instruction of a pair is decoded into the next entry, where the fused handler
+    finds it; once a store clears that entry the pair is decoded again.
+*/
+static int specialize_instr(lc3_vm *vm, uint16_t addr, decoded_instr *d, int handler, const int32_t *fuse)
+{
+    if (vm->debug && vm->debug->breakpoint[addr])
+        return H_BREAK;
+    if (handler == H_AND_IMM && d->arg == 0)
+        return H_CLEAR;
+    if (handler == H_JMP && d->r2 == R_R7)
+        return H_RET;
+    if (!fuse || addr == MEMORY_MAX - 1)
+        return handler;
+    /* The second instruction of a pair has to stop at its own breakpoint */
+    if (vm->debug && vm->debug->breakpoint[addr + 1])
+        return handler;
+
+    decoded_instr next;
+    int second = decode_instr(vm, addr + 1, &next);
+    int fused;
+    if (handler == H_ADD_IMM && second == H_BR)
+        fused = H_ADD_IMM_BR; /* dec r; BRp loop */
+    else if (handler == H_LDR && second == H_ADD_IMM)
+        fused = H_LDR_ADD_IMM; /* LDR rv, rp, #0; ADD rp, rp, #1 */
+    else
+        return handler;
+
+    /* An entry already decoded holds the same, and maybe a pair of its own */
+    if (!d[1].handler)
+    {
+        next.handler = fuse[second];
+        d[1] = next;
+    }
+    return fused;
+}
+
+/*
+    A load at pc - 1 just found the keyboard not ready. Returns 1 if it is the polling
+    loop
+        poll:  LDI/LDR  Rn, [KBSR]
+               BRz*     poll
+    which only repeats the same load until a key arrives: every iteration leaves the
+    machine as it was, so it can be skipped.
+*/
+static int spin_loop(lc3_vm *vm, uint16_t pc)
+{
+    uint16_t poll = vm->memory[(uint16_t)(pc - 1)];
+    uint16_t br = vm->memory[pc];
+
+    /* A zero sets Z, the branch must be taken back to the load */
+    if (br >> 12 != OP_BR || !(br & (FL_Z << 9)) || (uint16_t)(pc + 1 + sign_extend(br & 0x1FF, 9)) != (uint16_t)(pc - 1))
+        return 0;
+
+    /* LDR that overwrites its own base register reads another address next time */
+    if (poll >> 12 == OP_LDR)
+        return ((poll >> 9) & 0x7) != ((poll >> 6) & 0x7);
+    return poll >> 12 == OP_LDI;
+}
+
+/*
+    Block the host thread in a polling loop until the console has a key. While a device
+    may request an interrupt, like a timer, only wait as long as for one and poll the
+    devices right after
+*/
+#define IDLE_WAIT()                                                      \
+    if (vm->io.wait_key && spin_loop(vm, pc))                            \
+    {                                                                    \
+        vm->io.wait_key(vm->io.ctx, vm->armed ? INTERRUPT_WAIT_MS : -1); \
+        if (vm->armed)                                                   \
+            poll = 0;                                                    \
+    }
+
+/* BRnzp #-1 */
+#define BR_SELF 0x0FFF
+
+/* Sleep while the program waits for an interrupt in a BR to itself, then poll again */
+#define INTERRUPT_WAIT()                                     \
+    if (vm->memory[pc] == BR_SELF)                           \
+    {                                                        \
+        wait_interrupt(vm);                                  \
+        poll = 0;                                            \
+    }
+
+/* Plain interpreter */
+#define RUN_FN run
+#define IDLE_HOOK() IDLE_WAIT()
+#define WAIT_HOOK() INTERRUPT_WAIT()
+#include "interp.h"
+
+/*
+    Interpreter that stops once vm->steps instructions have been executed. A polling
+    loop uses up the remaining steps at once: after an even number of them it is back
+    at the branch, after an odd number at the load. While a device may interrupt, the
+    devices are polled at the branch between two skips, so an interrupt can end the loop.
+*/
+#define RUN_FN run_steps
+#define FETCH_HOOK()          \
+    if (vm->steps-- == 0)     \
+    {                         \
+        vm->steps = 0;        \
+        goto leave;           \
+    }
+#define IDLE_HOOK()                                       \
+    if (spin_loop(vm, pc) && !(vm->armed && poll <= 0))   \
+    {                                                     \
+        pc -= vm->steps & 1;                              \
+        vm->steps = 0;                                    \
+        vm->idle = 1;                                     \
+        if (vm->armed)                                    \
+            poll = 0;                                     \
+        goto leave;                                       \
+    }
+#define BREAK_HOOK() vm->steps++
+#include "interp.h"
+
+/* Interpreter that hands basic blocks over to the JIT once they get hot */
+#define RUN_FN run_jit
+#define BLOCK_HOOK()                         \
+    if (++vm->jit->heat[pc] > JIT_THRESHOLD) \
+    {                                        \
+        SAVE_CC();                           \
+        vm->poll = poll;                     \
+        pc = jit_execute(vm, pc, NULL);      \
+        poll = vm->poll;                     \
+        LOAD_CC();                           \
+        if (!vm->running)                    \
+            goto leave;                      \
+    }
+#define IDLE_HOOK() IDLE_WAIT()
+#define WAIT_HOOK() INTERRUPT_WAIT()
+#include "interp.h"
+
+/* Interpreter that hands control to ahead-of-time translated code at every block it covers */
+#define RUN_FN run_aot
+#define BLOCK_HOOK()                         \
+    if (vm->code_map[pc])                    \
+    {                                        \
+        SAVE_CC();                           \
+        vm->poll = poll;                     \
+        pc = vm->aot(vm, pc);                \
+        poll = vm->poll;                     \
+        LOAD_CC();                           \
+    }
+#define IDLE_HOOK() IDLE_WAIT()
+#define WAIT_HOOK() INTERRUPT_WAIT()
+#include "interp.h"
+
+/* Interpreter that counts every instruction and follows calls and returns for the profile */
+#define RUN_FN run_profile
+#define FETCH_HOOK()                 \
+    vm->profile->count[pc]++;        \
+    (*vm->profile->self)++
+#define CALL_HOOK(trap) profile_call(vm->profile, pc, trap, reg[R_R7])
+#define RETURN_HOOK() profile_return(vm->profile, pc)
+#define BREAK_HOOK()                 \
+    vm->profile->count[pc]--;        \
+    (*vm->profile->self)--
+#define IDLE_HOOK() IDLE_WAIT()
+#define WAIT_HOOK() INTERRUPT_WAIT()
+#include "interp.h"
+
+/*
+    Interpreter that stops once vm->steps instructions have been executed, like run_steps,
+    and leaves an undo record of every one in the history. A polling loop is not skipped,
+    every instruction of it must be undone on the way back, it only returns for the caller
+    to wait.
+*/
+#define RUN_FN run_history
+#define EAGER_CC
+#define FETCH_HOOK()                                  \
+    if (vm->steps-- == 0)                             \
+    {                                                 \
+        vm->steps = 0;                                \
+        goto leave;                                   \
+    }                                                 \
+    history_fetch(vm->history, vm, pc)
+#define LEAVE_HOOK()                                  \
+    if (vm->history->pending)                         \
+        history_record(vm->history, vm, pc)
+#define IDLE_HOOK()                                   \
+    if (spin_loop(vm, pc))                            \
+    {                                                 \
+        vm->idle = 1;                                 \
+        goto leave;                                   \
+    }
+/* The instruction at pc did not run, there is nothing to record for it */
+#define BREAK_HOOK()                                  \
+    vm->steps++;                                      \
+    vm->history->pending = 0
+#include "interp.h"
+
+/* Interpreter that records every instruction with the registers and memory it wrote */
+#define RUN_FN run_trace
+#define EAGER_CC
+#define FETCH_HOOK() trace_fetch(vm->trace, vm, pc)
+#define STORE_HOOK(addr, val) trace_store(vm->trace, addr, val)
+#define IDLE_HOOK() IDLE_WAIT()
+#define WAIT_HOOK() INTERRUPT_WAIT()
+#include "interp.h"
+
+/* Instructions run_watched executes between looks at the clock, a few milliseconds */
+#define WATCH_QUANTUM 1000000
+
+/*
+    Interpreter that charges every basic block it finishes to vm->watch and returns once
+    that runs out, so limits are checked per block rather than per instruction. It also
+    returns when the program polls the keyboard in a loop, for its caller to wait.
+*/
+#define RUN_FN run_watched
+#define ENTER_HOOK() uint16_t block = pc
+#define BLOCK_HOOK()                                    \
+    vm->watch -= (uint16_t)(d - dcache - block) + 1;    \
+    block = pc;                                         \
+    if (vm->watch <= 0)                                 \
+        goto leave;
+#define LEAVE_HOOK()                                    \
+    if (block != pc)                                    \
+        vm->watch -= (uint16_t)(d - dcache - block) + 1
+#define IDLE_HOOK()                                     \
+    if (vm->io.wait_key && spin_loop(vm, pc))           \
+    {                                                   \
+        vm->idle = 1;                                   \
+        goto leave;                                     \
+    }
+/* The instruction d points to did not run, leave charges the block up to it */
+#define BREAK_HOOK() d--
+#define WAIT_HOOK() INTERRUPT_WAIT()
+#include "interp.h"
+
+/* run_watched that hands hot blocks over to the JIT, which charges them to vm->watch too */
+#define RUN_FN run_jit_watched
+#define ENTER_HOOK() uint16_t block = pc
+#define BLOCK_HOOK()                                    \
+    vm->watch -= (uint16_t)(d - dcache - block) + 1;    \
+    block = pc;                                         \
+    if (vm->watch <= 0)                                 \
+        goto leave;                                     \
+    if (++vm->jit->heat[pc] > JIT_THRESHOLD)            \
+    {                                                   \
+        SAVE_CC();                                      \
+        vm->poll = poll;                                \
+        pc = jit_execute(vm, pc, &vm->watch);           \
+        poll = vm->poll;                                \
+        LOAD_CC();                                      \
+        block = pc;                                     \
+        if (!vm->running || vm->watch <= 0)             \
+            goto leave;                                 \
+    }
+#define LEAVE_HOOK()                                    \
+    if (block != pc)                                    \
+        vm->watch -= (uint16_t)(d - dcache - block) + 1
+#define IDLE_HOOK()                                     \
+    if (vm->io.wait_key && spin_loop(vm, pc))           \
+    {                                                   \
+        vm->idle = 1;                                   \
+        goto leave;                                     \
+    }
+#define BREAK_HOOK() d--
+#define WAIT_HOOK() INTERRUPT_WAIT()
+#include "interp.h"
+
+/*
+    Memory was changed behind mem_write's back, forget everything derived from it. The
+    device registers may enable an interrupt again, poll the devices before going on
+*/
+void memory_changed(lc3_vm *vm)
+{
+    if (vm->dcache_owner)
+        memset(vm->dcache, 0, sizeof(vm->dcache));
+    vm->dcache_owner = NULL;
+    if (vm->jit || vm->aot)
+        code_written(vm);
+    vm->armed = 1;
+    vm->poll = 0;
+}
+
+lc3_vm *vm_alloc(const lc3_io *io)
+{
+    /* Page aligned and zeroed, pages are only backed once they are touched */
+    lc3_vm *vm = mmap(NULL, sizeof(lc3_vm), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (vm == MAP_FAILED)
+        return NULL;
+
+    vm->io = io ? *io : stdio_io;
+    vm->code_map = no_code;
+
+    /* Slot 0 of the device table stands for plain memory */
+    vm->device_count = 1;
+    lc3_map_device(vm, MR_KBSR, MR_KBDR, &(lc3_device){NULL, keyboard_read, .interrupt = keyboard_interrupt});
+    lc3_map_device(vm, MR_DSR, MR_DDR, &(lc3_device){NULL, NULL, display_write});
+    lc3_map_device(vm, MR_MCR, MR_MCR, &(lc3_device){NULL, NULL, mcr_write});
+    return vm;
+}
+
+int lc3_map_device(lc3_vm *vm, uint16_t first, uint16_t last, const lc3_device *dev)
+{
+    if (first < LC3_DEVICE_PAGE || last < first || vm->device_count == LC3_MAX_DEVICES)
+        return 0;
+    for (int addr = first; addr <= last; addr++)
+    {
+        if (vm->device_map[addr - LC3_DEVICE_PAGE])
+            return 0;
+    }
+
+    int slot = vm->device_count++;
+    vm->devices[slot] = *dev;
+    vm->armed |= dev->interrupt != NULL;
+    for (int addr = first; addr <= last; addr++)
+        vm->device_map[addr - LC3_DEVICE_PAGE] = slot;
+    return 1;
+}
+
+int lc3_device_event(lc3_vm *vm, int due)
+{
+    return vm->input ? input_device_event(vm->input, due) : due;
+}
+
+/* The boot ROM as a memory file, -1 if it could not be made */
+static int rom_fd = -1;
+static pthread_once_t rom_once = PTHREAD_ONCE_INIT;
+
+/* Write the pages of the boot ROM that hold anything, the others are holes that read as zero */
+static void make_rom_file()
+{
+    int fd = memfd_create("lc3-rom", MFD_CLOEXEC);
+    if (fd < 0)
+        return;
+    int ok = ftruncate(fd, sizeof(lc3_os_rom)) == 0;
+    for (int page = 0; ok && page < ROM_PAGES; page++)
+    {
+        size_t size = ROM_PAGE_WORDS * sizeof(uint16_t);
+        if (lc3_os_rom_used[page])
+            ok = pwrite(fd, lc3_os_rom + page * ROM_PAGE_WORDS, size, page * size) == (ssize_t)size;
+    }
+    if (ok)
+        rom_fd = fd;
+    else
+        close(fd);
+}
+
+lc3_vm *lc3_create(const lc3_io *io)
+{
+    lc3_vm *vm = vm_alloc(io);
+    if (!vm)
+        return NULL;
+
+    /*
+        Load the Operating System. Every VM of the process maps the same ROM file
+        copy-on-write, so they share its pages until they store to them. Without it,
+        copy the pages of the boot ROM that hold anything.
+    */
+    pthread_once(&rom_once, make_rom_file);
+    if (rom_fd < 0 || !map_memory(vm, rom_fd, 0))
+    {
+        for (int page = 0; page < ROM_PAGES; page++)
+        {
+            if (lc3_os_rom_used[page])
+                memcpy(vm->memory + page * ROM_PAGE_WORDS, lc3_os_rom + page * ROM_PAGE_WORDS, ROM_PAGE_WORDS * sizeof(uint16_t));
+        }
+    }
+    vm->running = (vm->memory[MR_MCR] >> 15) & 1;
+
+    vm->reg[R_PC] = PC_START;
+
+    /* PSR set initially to x8002*/
+    vm->reg[R_PSR] = 0x8002;
+
+    /* Interrupts push onto the supervisor stack, which grows down from below user programs */
+    vm->reg[R_SSP] = 0x3000;
+
+    return vm;
+}
+
+void lc3_destroy(lc3_vm *vm)
+{
+    if (vm->jit)
+        jit_destroy(vm->jit);
+    if (vm->profile)
+        profile_destroy(vm->profile);
+    if (vm->trace)
+        trace_close(vm->trace);
+    if (vm->input)
+        input_close(vm->input);
+    if (vm->history)
+        history_destroy(vm->history);
+    free(vm->debug);
+    free(vm->aot_map);
+    for (int i = 1; i < vm->device_count; i++)
+    {
+        if (vm->devices[i].destroy)
+            vm->devices[i].destroy(vm->devices[i].ctx);
+    }
+    munmap(vm, sizeof(lc3_vm));
+}
+
+int lc3_load_image(lc3_vm *vm, const char *path)
+{
+    if (!read_image(vm, path))
+        return 0;
+
+    memory_changed(vm);
+    if (vm->history)
+        history_restart(vm->history, vm);
+    return 1;
+}
+
+int lc3_load_image_data(lc3_vm *vm, const void *data, size_t size)
+{
+    if (!read_image_data(vm, data, size))
+        return 0;
+
+    memory_changed(vm);
+    if (vm->history)
+        history_restart(vm->history, vm);
+    return 1;
+}
+
+int lc3_load_rom(lc3_vm *vm, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    int ok = fstat(fd, &st) == 0 && st.st_size == sizeof(vm->memory) && map_memory(vm, fd, 0);
+    close(fd);
+    if (ok && vm->history)
+        history_restart(vm->history, vm);
+    return ok;
+}
+
+int lc3_enable_jit(lc3_vm *vm)
+{
+    if (vm->aot)
+        return 0;
+    if (!vm->jit)
+    {
+        vm->jit = jit_create();
+        if (!vm->jit)
+            return 0;
+    }
+
+    /* A debugged or recorded VM keeps its own code_map, the JIT runs again once it is done */
+    set_code_map(vm);
+    return 1;
+}
+
+int lc3_enable_aot(lc3_vm *vm, lc3_aot_fn run, size_t count, const uint16_t *addr, const uint16_t *word)
+{
+    if (vm->jit || vm->debug || vm->history)
+        return 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (vm->memory[addr[i]] != word[i])
+            return 0;
+    }
+
+    if (!vm->aot_map)
+    {
+        vm->aot_map = malloc(MEMORY_MAX);
+        if (!vm->aot_map)
+            return 0;
+    }
+    memset(vm->aot_map, 0, MEMORY_MAX);
+    for (size_t i = 0; i < count; i++)
+        vm->aot_map[addr[i]] = 1;
+
+    vm->aot = run;
+    vm->code_map = vm->aot_map;
+    return 1;
+}
+
+int lc3_enable_profile(lc3_vm *vm)
+{
+    if (vm->history)
+        return 0;
+    if (!vm->profile)
+        vm->profile = profile_create(vm->reg[R_PC]);
+    return vm->profile != NULL;
+}
+
+int lc3_write_profile(const lc3_vm *vm, const char *report, const char *folded)
+{
+    if (!vm->profile)
+        return 0;
+    if (report && !profile_write_report(vm->profile, vm, report))
+        return 0;
+    return !folded || profile_write_folded(vm->profile, folded);
+}
+
+int lc3_start_trace(lc3_vm *vm, const char *path)
+{
+    if (vm->trace || vm->history)
+        return 0;
+    vm->trace = trace_open(path, vm);
+    return vm->trace != NULL;
+}
+
+int lc3_stop_trace(lc3_vm *vm)
+{
+    if (!vm->trace)
+        return 0;
+    int ok = trace_close(vm->trace);
+    vm->trace = NULL;
+    return ok;
+}
+
+int lc3_record_input(lc3_vm *vm, const char *path)
+{
+    if (vm->input || vm->history)
+        return 0;
+    vm->input = input_record(vm, path);
+    return vm->input != NULL;
+}
+
+int lc3_replay_input(lc3_vm *vm, const char *path)
+{
+    if (vm->input || vm->history)
+        return 0;
+    vm->input = input_replay(vm, path);
+    return vm->input != NULL;
+}
+
+int lc3_stop_input(lc3_vm *vm)
+{
+    if (!vm->input)
+        return 0;
+    int ok = input_close(vm->input);
+    vm->input = NULL;
+    return ok;
+}
+
+void lc3_set_trap_mode(lc3_vm *vm, int mode)
+{
+    vm->trap_mode = mode;
+    /* Translated blocks either jump to the OS routines or leave TRAP to the interpreter */
+    if (vm->jit)
+        jit_flush(vm->jit);
+}
+
+unsigned long lc3_trap_mismatches(const lc3_vm *vm)
+{
+    return vm->trap_mismatches;
+}
+
+/*
+    Breakpoints and watchpoints. The first one set moves the VM off translated code:
+    the JIT starts over once the last one is removed, ahead-of-time code is given up.
+*/
+static struct debug *debug_state(lc3_vm *vm)
+{
+    if (!vm->debug)
+    {
+        vm->debug = calloc(1, sizeof(struct debug));
+        if (!vm->debug)
+            return NULL;
+        if (vm->jit)
+            jit_flush(vm->jit);
+        vm->aot = NULL;
+        set_code_map(vm);
+    }
+    return vm->debug;
+}
+
+static void debug_release(lc3_vm *vm)
+{
+    if (vm->debug->breakpoints || vm->debug->watchpoints)
+        return;
+    free(vm->debug);
+    vm->debug = NULL;
+    set_code_map(vm);
+}
+
+int lc3_set_breakpoint(lc3_vm *vm, uint16_t addr, int on)
+{
+    struct debug *dbg = on ? debug_state(vm) : vm->debug;
+    if (!dbg)
+        return !on;
+    if (dbg->breakpoint[addr] != !!on)
+    {
+        dbg->breakpoint[addr] = !!on;
+        dbg->breakpoints += on ? 1 : -1;
+    }
+
+    /* Decoded again with or without the breakpoint, so is a pair the instruction is the second of */
+    vm->dcache[addr].handler = 0;
+    vm->dcache[(uint16_t)(addr - 1)].handler = 0;
+    debug_release(vm);
+    return 1;
+}
+
+int lc3_set_watchpoint(lc3_vm *vm, uint16_t addr, int on)
+{
+    struct debug *dbg = on ? debug_state(vm) : vm->debug;
+    if (!dbg)
+        return !on;
+    if (dbg->watch[addr] != !!on)
+    {
+        dbg->watch[addr] = !!on;
+        dbg->watchpoints += on ? 1 : -1;
+    }
+    debug_release(vm);
+    return 1;
+}
+
+uint16_t lc3_watch_address(const lc3_vm *vm)
+{
+    return vm->debug ? vm->debug->watch_address : 0;
+}
+
+/*
+    Run on from a breakpoint at the PC: the loops would stop at it again, so its
+    instruction runs first with the breakpoint lifted. Returns 0 if that stopped the machine
+*/
+static int step_over_breakpoint(lc3_vm *vm)
+{
+    uint16_t pc = vm->reg[R_PC];
+    if (!vm->debug || !vm->debug->breakpoint[pc])
+        return 1;
+
+    vm->debug->breakpoint[pc] = 0;
+    vm->dcache[pc].handler = 0;
+    vm->quantum = vm->steps = 1;
+    vm->idle = 0;
+    if (vm->history)
+        run_history(vm);
+    else
+        run_steps(vm);
+    vm->retired += 1 - vm->steps;
+    vm->quantum = vm->steps = 0;
+    vm->debug->breakpoint[pc] = 1;
+    vm->dcache[pc].handler = 0;
+    return vm->running;
+}
+
+/*
+    A breakpoint or watchpoint stopped the loop by clearing running: report it, and
+    whether the machine runs is up to the Machine Control Register again
+*/
+static void debug_stopped(lc3_vm *vm)
+{
+    if (!vm->debug || !vm->debug->stop)
+        return;
+    vm->stop_reason = vm->debug->stop;
+    vm->debug->stop = 0;
+    vm->running = (vm->memory[MR_MCR] >> 15) & 1;
+}
+
+/* lc3_step without leaving a breakpoint or reporting one */
+static void step(lc3_vm *vm, unsigned long n)
+{
+    do
+    {
+        /* Stop where a replayed key is due, a polling loop must not be skipped past it */
+        unsigned long due = vm->input ? input_next(vm->input) : ULONG_MAX;
+        unsigned long quantum = due > 0 && due < n ? due : n;
+
+        vm->quantum = vm->steps = quantum;
+        vm->idle = 0;
+        if (vm->history)
+            run_history(vm);
+        else
+            run_steps(vm);
+        vm->retired += quantum - vm->steps;
+        n -= quantum - vm->steps;
+        vm->quantum = vm->steps = 0;
+        /* The recording loop does not skip polling, its caller waits for a key instead */
+    } while (vm->running && n && !(vm->history && vm->idle));
+
+    vm->io.flush(vm->io.ctx);
+}
+
+int lc3_step(lc3_vm *vm, unsigned long n)
+{
+    vm->stop_reason = LC3_STOP_HALT;
+
+    /* In the past the history moves forward up to the present, execution takes over from there */
+    if (vm->history)
+        n = history_forward(vm->history, vm, n);
+
+    /* Running on from a breakpoint first runs the instruction under it */
+    if (n > 0 && vm->debug && vm->debug->breakpoint[vm->reg[R_PC]])
+        n = step_over_breakpoint(vm) ? n - 1 : 0;
+    if (n > 0)
+        step(vm, n);
+    debug_stopped(vm);
+    return vm->running;
+}
+
+/* Microseconds, a limit of a millisecond or two must not run out as soon as it is set */
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+    lc3_run with limits, or with recorded or replayed input. Runs a quantum at a time,
+    then looks at the instruction count and the clock, and waits for a key where the
+    program polls for one. A run that used up its instructions stops for that even if
+    the time ran out in the same quantum.
+*/
+static void run_limited(lc3_vm *vm)
+{
+    unsigned long start = vm->retired;
+    uint64_t deadline = vm->max_ms ? now_us() + (uint64_t)vm->max_ms * 1000 : 0;
+
+    for (;;)
+    {
+        unsigned long done = vm->retired - start;
+        unsigned long quantum = vm->input ? INPUT_QUANTUM : WATCH_QUANTUM;
+        if (vm->max_instructions && vm->max_instructions - done < quantum)
+            quantum = vm->max_instructions - done;
+
+        /* Recorded and replayed input is placed by instruction count, which only lc3_step keeps */
+        if (vm->input || vm->history)
+            step(vm, quantum);
+        else
+        {
+            vm->watch = quantum;
+            vm->idle = 0;
+            if (vm->jit && !vm->debug)
+                run_jit_watched(vm);
+            else
+                run_watched(vm);
+            vm->retired += quantum - vm->watch;
+        }
+        if (!vm->running)
+            break;
+        if (vm->max_instructions && vm->retired - start >= vm->max_instructions)
+        {
+            vm->stop_reason = LC3_STOP_INSTRUCTIONS;
+            break;
+        }
+
+        long wait = -1;
+        if (deadline)
+        {
+            uint64_t now = now_us();
+            if (now >= deadline)
+            {
+                vm->stop_reason = LC3_STOP_TIMEOUT;
+                break;
+            }
+            /* Rounded up, waking before the deadline would only wait again */
+            wait = (deadline - now + 999) / 1000;
+        }
+        if (!vm->idle)
+            continue;
+
+        /* Replay: the program waits for a key that never comes. Otherwise sleep until one does */
+        if (vm->input && vm->input->replay && input_next(vm->input) == ULONG_MAX)
+        {
+            vm->stop_reason = LC3_STOP_NO_INPUT;
+            break;
+        }
+        /* A device may interrupt the wait, it is polled again soon */
+        if (vm->armed && (wait < 0 || wait > INTERRUPT_WAIT_MS))
+            wait = INTERRUPT_WAIT_MS;
+        if (vm->io.wait_key)
+            vm->io.wait_key(vm->io.ctx, wait);
+        if (vm->armed)
+            vm->poll = 0;
+    }
+}
+
+/* The loop lc3_run runs the VM with */
+static void run_loop(lc3_vm *vm)
+{
+    /* Translated code is neither traced nor profiled, those loops always interpret */
+    if (vm->input || vm->history)
+        run_limited(vm);
+    else if (vm->trace)
+    {
+        run_trace(vm);
+        /* The last instruction is only recorded when the next one is fetched */
+        if (vm->trace->pending)
+            trace_record(vm->trace, vm);
+    }
+    else if (vm->profile)
+        run_profile(vm);
+    else if (vm->max_instructions || vm->max_ms)
+        run_limited(vm);
+    else if (vm->jit && !vm->debug)
+        run_jit(vm);
+    else if (vm->aot)
+        run_aot(vm);
+    else
+        run(vm);
+}
+
+void lc3_run(lc3_vm *vm)
+{
+    vm->stop_reason = LC3_STOP_HALT;
+
+    /* Running on from a breakpoint first runs the instruction under it, from the past the present first */
+    if ((!vm->history || history_forward(vm->history, vm, ULONG_MAX)) && step_over_breakpoint(vm))
+        run_loop(vm);
+    debug_stopped(vm);
+
+    /* Halted, or the host takes over: the output so far must be visible */
+    vm->io.flush(vm->io.ctx);
+}
+
+int lc3_enable_history(lc3_vm *vm, size_t size, unsigned long interval)
+{
+    /* Those loops would not record, and ahead-of-time code does not store through mem_write */
+    if (vm->history || vm->input || vm->trace || vm->profile)
+        return 0;
+    vm->history = history_create(vm, size, interval ? interval : LC3_HISTORY_INTERVAL);
+    if (!vm->history)
+        return 0;
+    vm->aot = NULL;
+    set_code_map(vm);
+    return 1;
+}
+
+void lc3_disable_history(lc3_vm *vm)
+{
+    if (!vm->history)
+        return;
+    history_destroy(vm->history);
+    vm->history = NULL;
+    set_code_map(vm);
+    /* Stores to translated code went to the history instead */
+    if (vm->jit)
+        jit_flush(vm->jit);
+}
+
+int lc3_history_range(const lc3_vm *vm, unsigned long *begin, unsigned long *end)
+{
+    if (!vm->history)
+        return 0;
+    *begin = history_begin(vm->history);
+    *end = vm->history->end;
+    return 1;
+}
+
+int lc3_seek(lc3_vm *vm, unsigned long n)
+{
+    return vm->history && history_seek(vm->history, vm, n);
+}
+
+void lc3_reverse_step(lc3_vm *vm, unsigned long n)
+{
+    vm->stop_reason = LC3_STOP_HALT;
+    if (vm->history)
+        history_back(vm->history, vm, n);
+}
+
+void lc3_reverse_run(lc3_vm *vm)
+{
+    lc3_reverse_step(vm, ULONG_MAX);
+}
+
+void lc3_set_limits(lc3_vm *vm, unsigned long instructions, unsigned long ms)
+{
+    vm->max_instructions = instructions;
+    vm->max_ms = ms;
+}
+
+int lc3_stop_reason(const lc3_vm *vm)
+{
+    return vm->stop_reason;
+}
+
+int lc3_running(const lc3_vm *vm)
+{
+    return vm->running;
+}
+
+unsigned long lc3_retired(const lc3_vm *vm)
+{
+    return vm->retired;
+}
+
+int lc3_idle(const lc3_vm *vm)
+{
+    return vm->idle;
+}
+
+uint16_t lc3_get_reg(const lc3_vm *vm, int r)
+{
+    return vm->reg[r];
+}
+
+/* A change the program did not make has no undo record, the history starts over from it */
+void lc3_set_reg(lc3_vm *vm, int r, uint16_t val)
+{
+    if (vm->reg[r] == val)
+        return;
+    vm->reg[r] = val;
+    if (vm->history)
+        history_restart(vm->history, vm);
+}
+
+uint16_t lc3_read(lc3_vm *vm, uint16_t addr)
+{
+    return mem_read(vm, addr);
+}
+
+void lc3_write(lc3_vm *vm, uint16_t addr, uint16_t val)
+{
+    mem_write(vm, addr, val);
+    /* Devices write during instructions, which records the store */
+    if (vm->history && !vm->history->pending)
+        history_restart(vm->history, vm);
+}
+
+uint16_t lc3_peek(const lc3_vm *vm, uint16_t addr)
+{
+    return vm->memory[addr];
+}
+
+void lc3_poke(lc3_vm *vm, uint16_t addr, uint16_t val)
+{
+    if (vm->memory[addr] == val)
+        return;
+    vm->memory[addr] = val;
+    vm->dcache[addr].handler = 0;
+    /* Like a store to the device page, it may enable an interrupt */
+    if (addr >= LC3_DEVICE_PAGE)
+    {
+        vm->armed = 1;
+        vm->poll = 0;
+    }
+    if (vm->history)
+        history_restart(vm->history, vm);
+    else if (vm->code_map[addr] && !vm->debug)
+        code_written(vm);
+}
@@ -0,0 +1,215 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "lc3.h"
+
+/* Internals of liblc3 shared by the interpreter and the JIT */
+
+/* The LC-3 has 16 different instructions */
+enum instruction_set
+{
+    OP_BR = 0,
+    OP_ADD,      /* OPCODE ADD*/
+    OP_LD,       /* LOAD */
+    OP_ST,       /* STORE */
+    OP_JSR,      /* JUMP SUB-ROUTINE */
+    OP_AND,      /* AND */
+    OP_LDR,      /* LOAD (PC-RELATIVE) */
+    OP_STR,      /* STORE (PC-RELATIVE) */
+    OP_RTI,      /* RETURN */
+    OP_NOT,      /* NOT */
+    OP_LDI,      /* LOAD INDIRECT */
+    OP_STI,      /* STORE INDIRECT */
+    OP_JMP,      /* JUMP */
+    OP_RESERVED, /* RESERVED INSTRUCTION*/
+    OP_LEA,      /* LOAD EFFECTIVE ADDRESS*/
+    OP_TRAP,     /* TRAP */
+};
+
+/* Conditional Flags */
+enum FLAGS
+{
+    FL_P = 1 << 0, /* Positive */
+    FL_Z = 1 << 1, /* Zero */
+    FL_N = 1 << 2, /* Negative */
+};
+
+/* Instruction handlers, one per instruction form the decoder distinguishes */
+enum handlers
+{
+    H_DECODE = 0, /* NOT DECODED YET */
+    H_NOP,        /* BR WITHOUT CONDITIONS, RESERVED */
+    H_BR,
+    H_BR_ALWAYS, /* BRnzp */
+    H_ADD,
+    H_ADD_IMM,
+    H_AND,
+    H_AND_IMM,
+    H_NOT,
+    H_LD,
+    H_LDI,
+    H_LDR,
+    H_LEA,
+    H_ST,
+    H_STI,
+    H_STR,
+    H_JSR,
+    H_JSRR,
+    H_JMP,
+    H_RTI,
+    H_TRAP,
+    H_CLEAR,       /* AND with #0 */
+    H_RET,         /* JMP R7 */
+    H_ADD_IMM_BR,  /* ADD immediate fused with the conditional BR after it */
+    H_LDR_ADD_IMM, /* LDR fused with the ADD immediate after it */
+    H_BREAK,       /* debugger breakpoint in place of the instruction */
+    H_COUNT, /* NUMBER OF TOTAL HANDLERS */
+};
+
+/* An instruction with its fields already extracted */
+typedef struct
+{
+    int32_t handler; /* handler address relative to the decode handler, 0 if not decoded */
+    uint16_t arg;    /* SR2, sign-extended immediate or precomputed PC-relative address */
+    uint8_t r1;      /* DR, SR or the BR condition mask */
+    uint8_t r2;      /* SR1 or BaseR */
+} decoded_instr;
+
+/* Breakpoints and watchpoints of a VM being debugged, see lc3_set_breakpoint */
+struct debug
+{
+    uint8_t breakpoint[MEMORY_MAX]; /* the decoder puts H_BREAK at these addresses */
+    uint8_t watch[MEMORY_MAX];      /* the VM's code_map while it is debugged */
+    int breakpoints;
+    int watchpoints;
+
+    /* An lc3_stop_reason once a breakpoint or watchpoint cleared running, 0 otherwise */
+    int stop;
+    uint16_t watch_address;
+};
+
+struct jit;
+struct profile;
+struct trace;
+struct input_log;
+struct history;
+
+struct lc3_vm
+{
+    /*
+        The LC-3 has 65,536 available memory locations. They come first, so they are
+        page aligned and a snapshot can be mapped over them.
+    */
+    uint16_t memory[MEMORY_MAX];
+
+    /* Decoded instruction cache, one entry per memory location */
+    decoded_instr dcache[MEMORY_MAX];
+
+    uint16_t reg[R_COUNT];
+    /* Interpreter loop whose handlers are in dcache */
+    void (*dcache_owner)(lc3_vm *vm);
+
+    /* Keep the CPU Running */
+    int running;
+
+    /* Instructions left before lc3_step returns, out of quantum, and executed by lc3_step so far */
+    unsigned long steps;
+    unsigned long quantum;
+    unsigned long retired;
+
+    /* The last lc3_step ended in a loop polling the keyboard */
+    int idle;
+
+    /* Limits of lc3_run, 0 for none, and why it last returned (an lc3_stop_reason) */
+    unsigned long max_instructions;
+    unsigned long max_ms;
+    int stop_reason;
+
+    /* Instructions run_watched may still execute, it returns once this is used up */
+    long watch;
+
+    lc3_io io;
+
+    /* Slot in devices of each address of the device page, 0 for plain memory */
+    uint8_t device_map[MEMORY_MAX - LC3_DEVICE_PAGE];
+    lc3_device devices[LC3_MAX_DEVICES];
+    int device_count;
+
+    /* How TRAP instructions are run, an lc3_trap_mode */
+    int trap_mode;
+    unsigned long trap_mismatches;
+
+    /*
+        Set for memory locations the JIT or lc3-aot translated, all zero while neither is
+        enabled. Stores to them take the slow path, which is also how watchpoints work
+    */
+    const uint8_t *code_map;
+    struct jit *jit;
+
+    /* Ahead-of-time translated code and the addresses it covers, NULL unless enabled */
+    lc3_aot_fn aot;
+    uint8_t *aot_map;
+
+    /* Execution counts gathered by lc3_run, NULL unless profiling */
+    struct profile *profile;
+
+    /* Recorder of every instruction lc3_run executes, NULL unless tracing */
+    struct trace *trace;
+
+    /* Keyboard input being recorded or replayed, NULL if it comes straight from io */
+    struct input_log *input;
+
+    /* Breakpoints and watchpoints, NULL while there are none */
+    struct debug *debug;
+
+    /* Undo records and checkpoints for time travel, NULL unless recorded */
+    struct history *history;
+
+    /* A device may request an interrupt, and basic blocks left before the devices are polled */
+    int armed;
+    int poll;
+};
+
+/*
+    Condition codes of the interpreter loops and translated code, kept as the last result
+    written, sign extended. Condition codes that no result gives (none or several flags,
+    before the first instruction set them) are kept as 0x10000 + reg[R_COND]
+*/
+static inline uint16_t lazy_cond(int32_t cc)
+{
+    if (cc < 0)
+        return FL_N;
+    if (cc == 0)
+        return FL_Z;
+    return cc < 0x10000 ? FL_P : cc & 0x7;
+}
+
+static inline int32_t lazy_result(uint16_t cond)
+{
+    switch (cond)
+    {
+    case FL_N:
+        return -1;
+    case FL_Z:
+        return 0;
+    case FL_P:
+        return 1;
+    default:
+        return 0x10000 + cond;
+    }
+}
+
+uint16_t sign_extend(uint16_t n, int bit_count);
+int decode_instr(lc3_vm *vm, uint16_t addr, decoded_instr *d);
+int host_trap(lc3_vm *vm, uint16_t trap_vect);
+void io_puts(lc3_vm *vm, const char *s);
+
+/* A VM without the OS loaded */
+lc3_vm *vm_alloc(const lc3_io *io);
+void memory_changed(lc3_vm *vm);
+int map_memory(lc3_vm *vm, int fd, off_t offset);
+
+#endif